@@ -0,0 +1,176 @@
+
+#include <assert.h>
+#include <string.h>
+#include "compressor.h"
+
+/* Reads the next chunk of input from the source into the input buffer */
+static int compressor_fill( compressor* c, compressor_source source, void* arg, size_t* length ) {
+  size_t got = source(arg, c->input, COMPRESSOR_INPUT_SIZE);
+
+  if (got > COMPRESSOR_INPUT_SIZE) { return COMPRESSOR_ERROR; }
+  if (0 == got) { c->eof = 1; }
+  c->bytes_in += got;
+  *length = got;
+  return COMPRESSOR_OK;
+}
+
+#ifdef COMPRESSOR_GZIP_SUPPORTED
+static int gzip_start( compressor* c ) {
+  int level = COMPRESSOR_DEFAULT_LEVEL == c->level ? Z_DEFAULT_COMPRESSION : c->level;
+
+  memset(&c->stream.gzip, 0, sizeof(c->stream.gzip));
+  /* 16 added to the window bits asks for a gzip header and trailer instead of zlib ones */
+  return Z_OK == deflateInit2(&c->stream.gzip, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY)
+    ? COMPRESSOR_OK : COMPRESSOR_ERROR;
+}
+
+static size_t gzip_read( compressor* c, compressor_source source, void* arg, char* dst, size_t length ) {
+  z_stream* zs = &c->stream.gzip;
+  uInt avail = length > UINT_MAX ? UINT_MAX : (uInt) length;
+
+  zs->next_out = (Bytef*) dst;
+  zs->avail_out = avail;
+  while (zs->avail_out > 0 && !c->finished) {
+    int rc;
+    if (0 == zs->avail_in && !c->eof) {
+      size_t got;
+      if (zs->avail_out < avail) { break; }
+      if (COMPRESSOR_OK != compressor_fill(c, source, arg, &got)) { return COMPRESSOR_READ_ERROR; }
+      zs->next_in = (Bytef*) c->input;
+      zs->avail_in = (uInt) got;
+    }
+    rc = deflate(zs, c->eof ? Z_FINISH : Z_NO_FLUSH);
+    if (Z_STREAM_END == rc) {
+      c->finished = 1;
+    } else if (Z_OK != rc && Z_BUF_ERROR != rc) {
+      return COMPRESSOR_READ_ERROR;
+    }
+  }
+  return avail - zs->avail_out;
+}
+#endif
+
+#ifdef COMPRESSOR_ZSTD_SUPPORTED
+static int zstd_start( compressor* c ) {
+  int level = COMPRESSOR_DEFAULT_LEVEL == c->level ? ZSTD_CLEVEL_DEFAULT : c->level;
+
+  c->stream.zstd.ctx = ZSTD_createCCtx();
+  if (NULL == c->stream.zstd.ctx) { return COMPRESSOR_ERROR; }
+  c->stream.zstd.in.src = c->input;
+  c->stream.zstd.in.size = 0;
+  c->stream.zstd.in.pos = 0;
+  return ZSTD_isError(ZSTD_CCtx_setParameter(c->stream.zstd.ctx, ZSTD_c_compressionLevel, level))
+    ? COMPRESSOR_ERROR : COMPRESSOR_OK;
+}
+
+static size_t zstd_read( compressor* c, compressor_source source, void* arg, char* dst, size_t length ) {
+  ZSTD_inBuffer* in = &c->stream.zstd.in;
+  ZSTD_outBuffer out = { dst, length, 0 };
+
+  while (out.pos < out.size && !c->finished) {
+    size_t remaining;
+    if (in->pos == in->size && !c->eof) {
+      size_t got;
+      if (out.pos > 0) { break; }
+      if (COMPRESSOR_OK != compressor_fill(c, source, arg, &got)) { return COMPRESSOR_READ_ERROR; }
+      in->size = got;
+      in->pos = 0;
+    }
+    remaining = ZSTD_compressStream2(c->stream.zstd.ctx, &out, in, c->eof ? ZSTD_e_end : ZSTD_e_continue);
+    if (ZSTD_isError(remaining)) { return COMPRESSOR_READ_ERROR; }
+    if (c->eof && 0 == remaining) { c->finished = 1; }
+  }
+  return out.pos;
+}
+#endif
+
+int compressor_supported( int type ) {
+  switch (type) {
+#ifdef COMPRESSOR_GZIP_SUPPORTED
+    case COMPRESS_GZIP: return 1;
+#endif
+#ifdef COMPRESSOR_ZSTD_SUPPORTED
+    case COMPRESS_ZSTD: return 1;
+#endif
+    default: return 0;
+  }
+}
+
+void compressor_init( compressor* c ) {
+  assert(NULL != c);
+
+  memset(c, 0, sizeof(*c));
+  c->type = COMPRESS_NONE;
+}
+
+int compressor_start( compressor* c, int type, int level ) {
+  int rc = COMPRESSOR_ERROR;
+
+  compressor_destroy(c);
+  if (!compressor_supported(type)) { return COMPRESSOR_ERROR; }
+
+  c->input = malloc(COMPRESSOR_INPUT_SIZE);
+  if (NULL == c->input) { return COMPRESSOR_ERROR; }
+  c->type = type;
+  c->level = level;
+
+#ifdef COMPRESSOR_GZIP_SUPPORTED
+  if (COMPRESS_GZIP == type) { rc = gzip_start(c); }
+#endif
+#ifdef COMPRESSOR_ZSTD_SUPPORTED
+  if (COMPRESS_ZSTD == type) { rc = zstd_start(c); }
+#endif
+  if (COMPRESSOR_OK != rc) { compressor_destroy(c); }
+  return rc;
+}
+
+size_t compressor_read( compressor* c, compressor_source source, void* arg, char* dst, size_t length ) {
+  size_t produced = COMPRESSOR_READ_ERROR;
+
+  assert(COMPRESS_NONE != c->type);
+  if (c->finished) { return 0; }
+
+#ifdef COMPRESSOR_GZIP_SUPPORTED
+  if (COMPRESS_GZIP == c->type) { produced = gzip_read(c, source, arg, dst, length); }
+#endif
+#ifdef COMPRESSOR_ZSTD_SUPPORTED
+  if (COMPRESS_ZSTD == c->type) { produced = zstd_read(c, source, arg, dst, length); }
+#endif
+  if (COMPRESSOR_READ_ERROR != produced) { c->bytes_out += produced; }
+  return produced;
+}
+
+int compressor_reset( compressor* c ) {
+  int rc = COMPRESSOR_ERROR;
+
+  c->eof = 0;
+  c->finished = 0;
+  c->bytes_in = 0;
+  c->bytes_out = 0;
+#ifdef COMPRESSOR_GZIP_SUPPORTED
+  if (COMPRESS_GZIP == c->type) {
+    c->stream.gzip.avail_in = 0;
+    rc = Z_OK == deflateReset(&c->stream.gzip) ? COMPRESSOR_OK : COMPRESSOR_ERROR;
+  }
+#endif
+#ifdef COMPRESSOR_ZSTD_SUPPORTED
+  if (COMPRESS_ZSTD == c->type) {
+    c->stream.zstd.in.size = 0;
+    c->stream.zstd.in.pos = 0;
+    rc = ZSTD_isError(ZSTD_CCtx_reset(c->stream.zstd.ctx, ZSTD_reset_session_only))
+      ? COMPRESSOR_ERROR : COMPRESSOR_OK;
+  }
+#endif
+  return rc;
+}
+
+void compressor_destroy( compressor* c ) {
+#ifdef COMPRESSOR_GZIP_SUPPORTED
+  if (COMPRESS_GZIP == c->type) { deflateEnd(&c->stream.gzip); }
+#endif
+#ifdef COMPRESSOR_ZSTD_SUPPORTED
+  if (COMPRESS_ZSTD == c->type) { ZSTD_freeCCtx(c->stream.zstd.ctx); }
+#endif
+  free(c->input);
+  compressor_init(c);
+}
@@ -0,0 +1,117 @@
+
+#ifndef PATRON_COMPRESSOR_H
+#define PATRON_COMPRESSOR_H
+
+#include <stdlib.h>
+#include <limits.h>
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#define COMPRESSOR_GZIP_SUPPORTED 1
+#endif
+
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#define COMPRESSOR_ZSTD_SUPPORTED 1
+#endif
+
+#define COMPRESS_NONE  0
+#define COMPRESS_GZIP  1
+#define COMPRESS_ZSTD  2
+
+#define COMPRESSOR_OK     0
+#define COMPRESSOR_ERROR  1
+
+/* Returned by compressor_read when the source or the compression failed */
+#define COMPRESSOR_READ_ERROR  ((size_t) -1)
+
+/* Asks for the default level of the compression type */
+#define COMPRESSOR_DEFAULT_LEVEL  INT_MIN
+
+/* How much uncompressed data is read from the source at a time */
+#define COMPRESSOR_INPUT_SIZE  (64 * 1024)
+
+/**
+ * Reads up to _length_ bytes of the uncompressed data into _dst_. Returns the
+ * number of bytes read, 0 at the end of the data, or anything larger than
+ * _length_ on failure.
+ */
+typedef size_t (*compressor_source)( void* arg, char* dst, size_t length );
+
+/**
+ * Implementation of a streaming compressor for request bodies. The compressed
+ * data is produced on demand straight into the buffer of the caller, pulling
+ * the uncompressed data from a source as needed - so the body never has to be
+ * compressed ahead of time or held in memory as a whole.
+ *
+ * The compressor counts the bytes which went in and came out, so that the
+ * savings can be reported.
+ */
+typedef struct {
+  int      type;
+  int      level;
+  int      eof;       /* the source has no more data */
+  int      finished;  /* all of the compressed data has been produced */
+  char*    input;
+  size_t   bytes_in;
+  size_t   bytes_out;
+  union {
+#ifdef COMPRESSOR_GZIP_SUPPORTED
+    z_stream gzip;
+#endif
+#ifdef COMPRESSOR_ZSTD_SUPPORTED
+    struct {
+      ZSTD_CCtx*     ctx;
+      ZSTD_inBuffer  in;
+    } zstd;
+#endif
+    int none;
+  } stream;
+} compressor;
+
+/**
+ * Returns non-zero if this build supports the compression _type_.
+ */
+int compressor_supported( int type );
+
+/**
+ * Initialize the compressor so that it does not compress. A compressor needs
+ * to be initialized once before being used with `compressor_start`.
+ */
+void compressor_init( compressor* c );
+
+/**
+ * Start compressing with the given _type_ at the given _level_, which can be
+ * COMPRESSOR_DEFAULT_LEVEL. Any previous compression is discarded first.
+ *
+ * Return Codes:
+ *   COMPRESSOR_OK
+ *   COMPRESSOR_ERROR
+ */
+int compressor_start( compressor* c, int type, int level );
+
+/**
+ * Produce up to _length_ bytes of compressed data into _dst_, reading the
+ * uncompressed data from _source_. Returns the number of bytes produced, 0
+ * once all of the compressed data has been produced, or COMPRESSOR_READ_ERROR.
+ * Returns as soon as some data has been produced and more input would be
+ * needed, so that a slow source does not hold back what is ready to be sent.
+ */
+size_t compressor_read( compressor* c, compressor_source source, void* arg, char* dst, size_t length );
+
+/**
+ * Start over with the same type and level, for when the data has to be sent
+ * again from the beginning. The source has to be rewound by the caller.
+ *
+ * Return Codes:
+ *   COMPRESSOR_OK
+ *   COMPRESSOR_ERROR
+ */
+int compressor_reset( compressor* c );
+
+/**
+ * Release the memory held by the compressor, and make it not compress.
+ */
+void compressor_destroy( compressor* c );
+
+#endif
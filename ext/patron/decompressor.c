@@ -0,0 +1,130 @@
+
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+#include "decompressor.h"
+
+/* How much decompressed data is produced at a time */
+#define DECOMPRESSOR_CHUNK_SIZE  (64 * 1024)
+
+/* Appends _length_ bytes of output, unless that goes over the limit or the decompression got
+   cancelled, which is checked once for every chunk of output */
+static int decompressor_emit( membuffer* out, const char* data, size_t length, size_t limit, size_t* total,
+                              const volatile int* cancelled ) {
+  if (NULL != cancelled && *cancelled) { return DECOMPRESSOR_CANCELLED; }
+  if (0 == length) { return DECOMPRESSOR_OK; }
+  *total += length;
+  if (limit && *total > limit) { return DECOMPRESSOR_LIMIT_EXCEEDED; }
+  return MB_OK == membuffer_append(out, data, length) ? DECOMPRESSOR_OK : DECOMPRESSOR_OUT_OF_MEMORY;
+}
+
+#ifdef DECOMPRESSOR_GZIP_SUPPORTED
+/* Inflates gzip or zlib data, or raw deflate data with negative _window_bits_. Several gzip
+   members one after another get decompressed as one body, as by gunzip. */
+static int inflate_body( const char* src, size_t length, int window_bits, membuffer* out, size_t limit, char* chunk,
+                         const volatile int* cancelled ) {
+  z_stream zs;
+  size_t total = 0;
+  int rc = DECOMPRESSOR_OK;
+  int zrc = Z_OK;
+  int full = 0;
+
+  memset(&zs, 0, sizeof(zs));
+  if (Z_OK != inflateInit2(&zs, window_bits)) { return DECOMPRESSOR_OUT_OF_MEMORY; }
+  zs.next_in = (Bytef*) src;
+
+  while (DECOMPRESSOR_OK == rc) {
+    if (0 == zs.avail_in) {
+      /* zlib takes its input in pieces of at most 4GB */
+      size_t left = length - (size_t) ((const char*) zs.next_in - src);
+      zs.avail_in = left > UINT_MAX ? UINT_MAX : (uInt) left;
+      /* Unless the output filled up last time, there is nothing left to inflate */
+      if (0 == left && !full) { break; }
+    }
+    zs.next_out = (Bytef*) chunk;
+    zs.avail_out = DECOMPRESSOR_CHUNK_SIZE;
+    zrc = inflate(&zs, Z_NO_FLUSH);
+    if (Z_OK != zrc && Z_STREAM_END != zrc) {
+      rc = DECOMPRESSOR_ERROR;
+      break;
+    }
+    full = 0 == zs.avail_out;
+    rc = decompressor_emit(out, chunk, DECOMPRESSOR_CHUNK_SIZE - zs.avail_out, limit, &total, cancelled);
+    if (Z_STREAM_END == zrc) {
+      if (length == (size_t) ((const char*) zs.next_in - src) || window_bits < 0) { break; }
+      inflateReset(&zs);
+    }
+  }
+  inflateEnd(&zs);
+  /* A body which stops in the middle of the compressed data is truncated */
+  if (DECOMPRESSOR_OK == rc && Z_STREAM_END != zrc) { rc = DECOMPRESSOR_ERROR; }
+  return rc;
+}
+#endif
+
+#ifdef DECOMPRESSOR_ZSTD_SUPPORTED
+static int zstd_body( const char* src, size_t length, membuffer* out, size_t limit, char* chunk,
+                      const volatile int* cancelled ) {
+  ZSTD_DCtx* ctx = ZSTD_createDCtx();
+  ZSTD_inBuffer in = { src, length, 0 };
+  size_t total = 0;
+  size_t remaining = 1;
+  int rc = DECOMPRESSOR_OK;
+
+  if (NULL == ctx) { return DECOMPRESSOR_OUT_OF_MEMORY; }
+  while (DECOMPRESSOR_OK == rc) {
+    ZSTD_outBuffer outbuf = { chunk, DECOMPRESSOR_CHUNK_SIZE, 0 };
+    remaining = ZSTD_decompressStream(ctx, &outbuf, &in);
+    if (ZSTD_isError(remaining)) {
+      rc = DECOMPRESSOR_ERROR;
+      break;
+    }
+    rc = decompressor_emit(out, chunk, outbuf.pos, limit, &total, cancelled);
+    /* Done once all of the input is used up and nothing more is held back */
+    if (in.pos == in.size && outbuf.pos < outbuf.size) { break; }
+  }
+  ZSTD_freeDCtx(ctx);
+  if (DECOMPRESSOR_OK == rc && 0 != remaining) { rc = DECOMPRESSOR_ERROR; }
+  return rc;
+}
+#endif
+
+int decompressor_type( const char* name, size_t length ) {
+#ifdef DECOMPRESSOR_GZIP_SUPPORTED
+  if ((4 == length && 0 == strncasecmp(name, "gzip", length)) ||
+      (6 == length && 0 == strncasecmp(name, "x-gzip", length))) {
+    return DECOMPRESS_GZIP;
+  }
+  if (7 == length && 0 == strncasecmp(name, "deflate", length)) { return DECOMPRESS_DEFLATE; }
+#endif
+#ifdef DECOMPRESSOR_ZSTD_SUPPORTED
+  if (4 == length && 0 == strncasecmp(name, "zstd", length)) { return DECOMPRESS_ZSTD; }
+#endif
+  return DECOMPRESS_NONE;
+}
+
+int decompress( int type, const char* src, size_t length, membuffer* out, size_t limit,
+                const volatile int* cancelled ) {
+  char* chunk = malloc(DECOMPRESSOR_CHUNK_SIZE);
+  int rc = DECOMPRESSOR_ERROR;
+
+  if (NULL == chunk) { return DECOMPRESSOR_OUT_OF_MEMORY; }
+#ifdef DECOMPRESSOR_GZIP_SUPPORTED
+  /* 32 added to the window bits detects a gzip or a zlib header */
+  if (DECOMPRESS_GZIP == type) { rc = inflate_body(src, length, 15 + 32, out, limit, chunk, cancelled); }
+  if (DECOMPRESS_DEFLATE == type) {
+    size_t start = out->length;
+    rc = inflate_body(src, length, 15 + 32, out, limit, chunk, cancelled);
+    if (DECOMPRESSOR_ERROR == rc) {
+      /* Some servers send deflate without the zlib header it should have */
+      out->length = start;
+      rc = inflate_body(src, length, -15, out, limit, chunk, cancelled);
+    }
+  }
+#endif
+#ifdef DECOMPRESSOR_ZSTD_SUPPORTED
+  if (DECOMPRESS_ZSTD == type) { rc = zstd_body(src, length, out, limit, chunk, cancelled); }
+#endif
+  free(chunk);
+  return rc;
+}
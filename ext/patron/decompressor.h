@@ -0,0 +1,69 @@
+
+#ifndef PATRON_DECOMPRESSOR_H
+#define PATRON_DECOMPRESSOR_H
+
+#include <stdlib.h>
+#include "membuffer.h"
+
+#ifdef HAVE_ZLIB_H
+#include <zlib.h>
+#define DECOMPRESSOR_GZIP_SUPPORTED 1
+#endif
+
+#ifdef HAVE_ZSTD_H
+#include <zstd.h>
+#define DECOMPRESSOR_ZSTD_SUPPORTED 1
+#endif
+
+#define DECOMPRESS_NONE     0
+#define DECOMPRESS_GZIP     1
+#define DECOMPRESS_DEFLATE  2
+#define DECOMPRESS_ZSTD     3
+
+#define DECOMPRESSOR_OK              0
+#define DECOMPRESSOR_ERROR           1  /* the data is not valid for the encoding */
+#define DECOMPRESSOR_OUT_OF_MEMORY   2
+#define DECOMPRESSOR_LIMIT_EXCEEDED  3
+#define DECOMPRESSOR_CANCELLED       4  /* _cancelled_ got set while decompressing */
+
+/* The Accept-Encoding to ask for bodies which can be decompressed */
+#if defined(DECOMPRESSOR_GZIP_SUPPORTED) && defined(DECOMPRESSOR_ZSTD_SUPPORTED)
+#define DECOMPRESSOR_ACCEPT_ENCODING "gzip, deflate, zstd"
+#elif defined(DECOMPRESSOR_GZIP_SUPPORTED)
+#define DECOMPRESSOR_ACCEPT_ENCODING "gzip, deflate"
+#elif defined(DECOMPRESSOR_ZSTD_SUPPORTED)
+#define DECOMPRESSOR_ACCEPT_ENCODING "zstd"
+#else
+#define DECOMPRESSOR_ACCEPT_ENCODING "identity"
+#endif
+
+/**
+ * Decompression of response bodies which were received with their
+ * Content-Encoding kept, so that they only get decoded if they are used.
+ * Unlike the compressor this works on the whole body at once, and does not
+ * touch any Ruby objects so that it can run without the GVL.
+ */
+
+/**
+ * Returns the type for the name of a Content-Encoding given with its
+ * _length_, like "gzip", or DECOMPRESS_NONE if it is not supported.
+ */
+int decompressor_type( const char* name, size_t length );
+
+/**
+ * Decompress the _length_ bytes at _src_ with the given _type_, appending the
+ * result to _out_. With a non-zero _limit_ the decompression stops once the
+ * result would get larger than that. Unless _cancelled_ is NULL, the
+ * decompression gives up once another thread sets the int it points to.
+ *
+ * Return Codes:
+ *   DECOMPRESSOR_OK
+ *   DECOMPRESSOR_ERROR
+ *   DECOMPRESSOR_OUT_OF_MEMORY
+ *   DECOMPRESSOR_LIMIT_EXCEEDED
+ *   DECOMPRESSOR_CANCELLED
+ */
+int decompress( int type, const char* src, size_t length, membuffer* out, size_t limit,
+                const volatile int* cancelled );
+
+#endif
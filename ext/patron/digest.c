@@ -0,0 +1,496 @@
+
+#include <assert.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include "digest.h"
+
+#if defined(__SSE4_2__) && defined(__x86_64__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+static const char HEX_DIGITS[] = "0123456789abcdef";
+
+/* Buffers the data for a hash working on 64 byte blocks, whole blocks get hashed straight from the input */
+static void block_update( unsigned char* block, size_t* used, const unsigned char* data, size_t length,
+                          void (*hash_block)( void* ctx, const unsigned char* block ), void* ctx ) {
+  if (*used > 0) {
+    size_t room = 64 - *used;
+    size_t chunk = length < room ? length : room;
+    memcpy(block + *used, data, chunk);
+    *used += chunk;
+    data += chunk;
+    length -= chunk;
+    if (*used < 64) { return; }
+    hash_block(ctx, block);
+    *used = 0;
+  }
+  while (length >= 64) {
+    hash_block(ctx, data);
+    data += 64;
+    length -= 64;
+  }
+  memcpy(block, data, length);
+  *used = length;
+}
+
+/* SHA-256 as specified in FIPS 180-4 */
+
+static const uint32_t SHA256_K[64] = {
+  0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+  0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+  0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+  0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+  0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+  0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+  0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+  0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+#define ROTR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_init( sha256_context* c ) {
+  c->state[0] = 0x6a09e667;
+  c->state[1] = 0xbb67ae85;
+  c->state[2] = 0x3c6ef372;
+  c->state[3] = 0xa54ff53a;
+  c->state[4] = 0x510e527f;
+  c->state[5] = 0x9b05688c;
+  c->state[6] = 0x1f83d9ab;
+  c->state[7] = 0x5be0cd19;
+  c->length = 0;
+  c->used = 0;
+}
+
+static void sha256_block( sha256_context* c, const unsigned char* block ) {
+  uint32_t w[64];
+  uint32_t a, b, d, e, f, g, h, cc;
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    w[i] = ((uint32_t) block[i * 4] << 24) | ((uint32_t) block[i * 4 + 1] << 16) |
+           ((uint32_t) block[i * 4 + 2] << 8) | (uint32_t) block[i * 4 + 3];
+  }
+  for (i = 16; i < 64; i++) {
+    uint32_t s0 = ROTR32(w[i - 15], 7) ^ ROTR32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+    uint32_t s1 = ROTR32(w[i - 2], 17) ^ ROTR32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+    w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+  }
+
+  a = c->state[0]; b = c->state[1]; cc = c->state[2]; d = c->state[3];
+  e = c->state[4]; f = c->state[5]; g = c->state[6]; h = c->state[7];
+
+  for (i = 0; i < 64; i++) {
+    uint32_t s1 = ROTR32(e, 6) ^ ROTR32(e, 11) ^ ROTR32(e, 25);
+    uint32_t ch = (e & f) ^ (~e & g);
+    uint32_t t1 = h + s1 + ch + SHA256_K[i] + w[i];
+    uint32_t s0 = ROTR32(a, 2) ^ ROTR32(a, 13) ^ ROTR32(a, 22);
+    uint32_t maj = (a & b) ^ (a & cc) ^ (b & cc);
+    uint32_t t2 = s0 + maj;
+
+    h = g; g = f; f = e;
+    e = d + t1;
+    d = cc; cc = b; b = a;
+    a = t1 + t2;
+  }
+
+  c->state[0] += a; c->state[1] += b; c->state[2] += cc; c->state[3] += d;
+  c->state[4] += e; c->state[5] += f; c->state[6] += g; c->state[7] += h;
+}
+
+static void sha256_hash_block( void* ctx, const unsigned char* block ) {
+  sha256_block((sha256_context*) ctx, block);
+}
+
+static void sha256_update( sha256_context* c, const unsigned char* data, size_t length ) {
+  c->length += length;
+  block_update(c->block, &c->used, data, length, &sha256_hash_block, c);
+}
+
+static void sha256_final( sha256_context* c, unsigned char* out ) {
+  uint64_t bits = c->length * 8;
+  int i;
+
+  c->block[c->used++] = 0x80;
+  if (c->used > 56) {
+    memset(c->block + c->used, 0, sizeof(c->block) - c->used);
+    sha256_block(c, c->block);
+    c->used = 0;
+  }
+  memset(c->block + c->used, 0, 56 - c->used);
+  for (i = 0; i < 8; i++) {
+    c->block[56 + i] = (unsigned char) (bits >> (56 - i * 8));
+  }
+  sha256_block(c, c->block);
+
+  for (i = 0; i < 8; i++) {
+    out[i * 4]     = (unsigned char) (c->state[i] >> 24);
+    out[i * 4 + 1] = (unsigned char) (c->state[i] >> 16);
+    out[i * 4 + 2] = (unsigned char) (c->state[i] >> 8);
+    out[i * 4 + 3] = (unsigned char) c->state[i];
+  }
+}
+
+/* MD5 as specified in RFC 1321 */
+
+static const uint32_t MD5_K[64] = {
+  0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+  0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+  0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+  0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+  0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+  0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+  0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+  0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391
+};
+
+static const unsigned char MD5_S[64] = {
+  7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+  5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+  4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+  6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21
+};
+
+#define ROTL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void md5_init( md5_context* c ) {
+  c->state[0] = 0x67452301;
+  c->state[1] = 0xefcdab89;
+  c->state[2] = 0x98badcfe;
+  c->state[3] = 0x10325476;
+  c->length = 0;
+  c->used = 0;
+}
+
+static void md5_block( void* ctx, const unsigned char* block ) {
+  md5_context* c = ctx;
+  uint32_t m[16];
+  uint32_t a = c->state[0], b = c->state[1], cc = c->state[2], d = c->state[3];
+  int i;
+
+  for (i = 0; i < 16; i++) {
+    m[i] = (uint32_t) block[i * 4] | ((uint32_t) block[i * 4 + 1] << 8) |
+           ((uint32_t) block[i * 4 + 2] << 16) | ((uint32_t) block[i * 4 + 3] << 24);
+  }
+  for (i = 0; i < 64; i++) {
+    uint32_t f, tmp;
+    int g;
+    if (i < 16) {
+      f = (b & cc) | (~b & d);
+      g = i;
+    } else if (i < 32) {
+      f = (d & b) | (~d & cc);
+      g = (5 * i + 1) % 16;
+    } else if (i < 48) {
+      f = b ^ cc ^ d;
+      g = (3 * i + 5) % 16;
+    } else {
+      f = cc ^ (b | ~d);
+      g = (7 * i) % 16;
+    }
+    tmp = d;
+    d = cc;
+    cc = b;
+    b = b + ROTL32(a + f + MD5_K[i] + m[g], MD5_S[i]);
+    a = tmp;
+  }
+
+  c->state[0] += a; c->state[1] += b; c->state[2] += cc; c->state[3] += d;
+}
+
+static void md5_update( md5_context* c, const unsigned char* data, size_t length ) {
+  c->length += length;
+  block_update(c->block, &c->used, data, length, &md5_block, c);
+}
+
+static void md5_final( md5_context* c, unsigned char* out ) {
+  uint64_t bits = c->length * 8;
+  int i;
+
+  c->block[c->used++] = 0x80;
+  if (c->used > 56) {
+    memset(c->block + c->used, 0, sizeof(c->block) - c->used);
+    md5_block(c, c->block);
+    c->used = 0;
+  }
+  memset(c->block + c->used, 0, 56 - c->used);
+  for (i = 0; i < 8; i++) {
+    c->block[56 + i] = (unsigned char) (bits >> (i * 8));
+  }
+  md5_block(c, c->block);
+
+  for (i = 0; i < 16; i++) {
+    out[i] = (unsigned char) (c->state[i / 4] >> ((i % 4) * 8));
+  }
+}
+
+/* CRC32C (Castagnoli) as used by iSCSI and cloud storage checksums */
+
+#if !(defined(__SSE4_2__) && defined(__x86_64__)) && !defined(__ARM_FEATURE_CRC32)
+static const uint32_t CRC32C_TABLE[256] = {
+  0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c, 0x26a1e7e8, 0xd4ca64eb,
+  0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b, 0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24,
+  0x105ec76f, 0xe235446c, 0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+  0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc, 0xbc267848, 0x4e4dfb4b,
+  0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a, 0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35,
+  0xaa64d611, 0x580f5512, 0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+  0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad, 0x1642ae59, 0xe4292d5a,
+  0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a, 0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595,
+  0x417b1dbc, 0xb3109ebf, 0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+  0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f, 0xed03a29b, 0x1f682198,
+  0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927, 0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38,
+  0xdbfc821c, 0x2997011f, 0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+  0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e, 0x4767748a, 0xb50cf789,
+  0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859, 0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46,
+  0x7198540d, 0x83f3d70e, 0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+  0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de, 0xdde0eb2a, 0x2f8b6829,
+  0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c, 0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93,
+  0x082f63b7, 0xfa44e0b4, 0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+  0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b, 0xb4091bff, 0x466298fc,
+  0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c, 0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033,
+  0xa24bb5a6, 0x502036a5, 0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+  0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975, 0x0e330a81, 0xfc588982,
+  0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d, 0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622,
+  0x38cc2a06, 0xcaa7a905, 0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+  0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8, 0xe52cc12c, 0x1747422f,
+  0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff, 0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0,
+  0xd3d3e1ab, 0x21b862a8, 0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+  0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78, 0x7fab5e8c, 0x8dc0dd8f,
+  0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee, 0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1,
+  0x69e9f0d5, 0x9b8273d6, 0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+  0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69, 0xd5cf889d, 0x27a40b9e,
+  0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e, 0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+#endif
+
+/* Works on the inverted CRC, see digest_init and digest_final */
+static uint32_t crc32c_update( uint32_t crc, const unsigned char* data, size_t length ) {
+#if defined(__SSE4_2__) && defined(__x86_64__)
+  while (length >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc = (uint32_t) _mm_crc32_u64(crc, word);
+    data += 8;
+    length -= 8;
+  }
+  while (length-- > 0) { crc = _mm_crc32_u8(crc, *data++); }
+#elif defined(__ARM_FEATURE_CRC32)
+  while (length >= 8) {
+    uint64_t word;
+    memcpy(&word, data, 8);
+    crc = __crc32cd(crc, word);
+    data += 8;
+    length -= 8;
+  }
+  while (length-- > 0) { crc = __crc32cb(crc, *data++); }
+#else
+  while (length-- > 0) { crc = (crc >> 8) ^ CRC32C_TABLE[(crc ^ *data++) & 0xff]; }
+#endif
+  return crc;
+}
+
+static size_t hex_encode( char* hex, const unsigned char* raw, size_t length ) {
+  size_t i;
+  for (i = 0; i < length; i++) {
+    hex[i * 2]     = HEX_DIGITS[raw[i] >> 4];
+    hex[i * 2 + 1] = HEX_DIGITS[raw[i] & 0x0f];
+  }
+  hex[length * 2] = '\0';
+  return length * 2;
+}
+
+static int base64_value( char c ) {
+  if (c >= 'A' && c <= 'Z') { return c - 'A'; }
+  if (c >= 'a' && c <= 'z') { return c - 'a' + 26; }
+  if (c >= '0' && c <= '9') { return c - '0' + 52; }
+  if ('+' == c || '-' == c) { return 62; }
+  if ('/' == c || '_' == c) { return 63; }
+  return -1;
+}
+
+/* Decodes standard or URL safe Base64, with or without padding. Returns the decoded length, or 0 if the input is invalid. */
+static size_t base64_decode( const char* src, size_t length, unsigned char* dst, size_t capacity ) {
+  uint32_t bits = 0;
+  int count = 0;
+  size_t out = 0;
+  size_t i;
+
+  while (length > 0 && '=' == src[length - 1]) { length--; }
+  for (i = 0; i < length; i++) {
+    int value = base64_value(src[i]);
+    if (value < 0) { return 0; }
+    bits = (bits << 6) | (uint32_t) value;
+    if (++count == 4) {
+      if (out + 3 > capacity) { return 0; }
+      dst[out++] = (unsigned char) (bits >> 16);
+      dst[out++] = (unsigned char) (bits >> 8);
+      dst[out++] = (unsigned char) bits;
+      bits = 0;
+      count = 0;
+    }
+  }
+  if (1 == count) { return 0; }
+  if (count > 1) {
+    if (out + count - 1 > capacity) { return 0; }
+    bits <<= 6 * (4 - count);
+    dst[out++] = (unsigned char) (bits >> 16);
+    if (3 == count) { dst[out++] = (unsigned char) (bits >> 8); }
+  }
+  return out;
+}
+
+/* The value of the finished digest, or of the expectation */
+static unsigned char* digest_value( unsigned char* sha256, unsigned char* md5, unsigned char* crc32c, int type, size_t* size ) {
+  switch (type) {
+    case DIGEST_SHA256: *size = 32; return sha256;
+    case DIGEST_MD5:    *size = 16; return md5;
+    case DIGEST_CRC32C: *size = 4;  return crc32c;
+    default:            *size = 0;  return NULL;
+  }
+}
+
+void digest_init( digest* d, int types ) {
+  assert(NULL != d);
+
+  d->types = types;
+  if (types & DIGEST_SHA256) { sha256_init(&d->sha256); }
+  if (types & DIGEST_MD5) { md5_init(&d->md5); }
+  d->crc32c = 0xffffffff;
+}
+
+void digest_update( digest* d, const void* data, size_t length ) {
+  if (d->types & DIGEST_SHA256) { sha256_update(&d->sha256, data, length); }
+  if (d->types & DIGEST_MD5) { md5_update(&d->md5, data, length); }
+  if (d->types & DIGEST_CRC32C) { d->crc32c = crc32c_update(d->crc32c, data, length); }
+}
+
+void digest_final( digest* d ) {
+  if (d->types & DIGEST_SHA256) { sha256_final(&d->sha256, d->sha256_raw); }
+  if (d->types & DIGEST_MD5) { md5_final(&d->md5, d->md5_raw); }
+  if (d->types & DIGEST_CRC32C) {
+    uint32_t crc = ~d->crc32c;
+    d->crc32c_raw[0] = (unsigned char) (crc >> 24);
+    d->crc32c_raw[1] = (unsigned char) (crc >> 16);
+    d->crc32c_raw[2] = (unsigned char) (crc >> 8);
+    d->crc32c_raw[3] = (unsigned char) crc;
+  }
+}
+
+size_t digest_raw( digest* d, int type, const unsigned char** raw ) {
+  size_t size = 0;
+
+  if (!(d->types & type)) { return 0; }
+  *raw = digest_value(d->sha256_raw, d->md5_raw, d->crc32c_raw, type, &size);
+  return size;
+}
+
+size_t digest_hex( digest* d, int type, char* hex ) {
+  const unsigned char* raw = NULL;
+  size_t size = digest_raw(d, type, &raw);
+
+  hex[0] = '\0';
+  return size > 0 ? hex_encode(hex, raw, size) : 0;
+}
+
+const char* digest_name( int type ) {
+  switch (type) {
+    case DIGEST_SHA256: return "sha256";
+    case DIGEST_MD5:    return "md5";
+    case DIGEST_CRC32C: return "crc32c";
+    default:            return "none";
+  }
+}
+
+void digest_expect_none( digest_expectation* e ) {
+  e->types = DIGEST_NONE;
+}
+
+int digest_expect( digest_expectation* e, int type, const unsigned char* raw, size_t length ) {
+  size_t size = 0;
+  unsigned char* value = digest_value(e->sha256, e->md5, e->crc32c, type, &size);
+
+  if (NULL == value || length != size) { return DIGEST_ERROR; }
+  memcpy(value, raw, size);
+  e->types |= type;
+  return DIGEST_OK;
+}
+
+int digest_expect_base64( digest_expectation* e, int type, const char* base64, size_t length ) {
+  unsigned char raw[DIGEST_MAX_SIZE];
+  size_t size = base64_decode(base64, length, raw, sizeof(raw));
+
+  return size > 0 ? digest_expect(e, type, raw, size) : DIGEST_ERROR;
+}
+
+int digest_expect_hex( digest_expectation* e, int type, const char* hex, size_t length ) {
+  unsigned char raw[DIGEST_MAX_SIZE];
+  size_t i;
+
+  if (0 != length % 2 || length / 2 > sizeof(raw)) { return DIGEST_ERROR; }
+  for (i = 0; i < length; i++) {
+    const char* digit = memchr(HEX_DIGITS, tolower((unsigned char) hex[i]), 16);
+    if (NULL == digit || '\0' == hex[i]) { return DIGEST_ERROR; }
+    raw[i / 2] = (unsigned char) ((i % 2) ? (raw[i / 2] << 4) | (digit - HEX_DIGITS) : (digit - HEX_DIGITS));
+  }
+  return digest_expect(e, type, raw, length / 2);
+}
+
+static int digest_type_named( const char* name, size_t length ) {
+  if (7 == length && 0 == strncasecmp(name, "sha-256", length)) { return DIGEST_SHA256; }
+  if (3 == length && 0 == strncasecmp(name, "md5", length)) { return DIGEST_MD5; }
+  if (6 == length && 0 == strncasecmp(name, "crc32c", length)) { return DIGEST_CRC32C; }
+  return DIGEST_NONE;
+}
+
+void digest_expect_header( digest_expectation* e, const char* value, size_t length ) {
+  const char* end = value + length;
+
+  while (value < end) {
+    const char* item_end = memchr(value, ',', end - value);
+    const char* equals;
+    if (NULL == item_end) { item_end = end; }
+    while (value < item_end && isspace((unsigned char) *value)) { value++; }
+    equals = memchr(value, '=', item_end - value);
+    if (NULL != equals) {
+      int type = digest_type_named(value, equals - value);
+      const char* v = equals + 1;
+      const char* v_end = item_end;
+      while (v_end > v && isspace((unsigned char) v_end[-1])) { v_end--; }
+      /* Content-Digest has the value as a structured field byte sequence, between colons */
+      if (v_end - v >= 2 && ':' == *v && ':' == v_end[-1]) { v++; v_end--; }
+      if (DIGEST_NONE != type) { digest_expect_base64(e, type, v, v_end - v); }
+    }
+    value = item_end + 1;
+  }
+}
+
+void digest_expect_merge( digest_expectation* e, const digest_expectation* other ) {
+  if ((other->types & DIGEST_SHA256) && !(e->types & DIGEST_SHA256)) {
+    digest_expect(e, DIGEST_SHA256, other->sha256, sizeof(other->sha256));
+  }
+  if ((other->types & DIGEST_MD5) && !(e->types & DIGEST_MD5)) {
+    digest_expect(e, DIGEST_MD5, other->md5, sizeof(other->md5));
+  }
+  if ((other->types & DIGEST_CRC32C) && !(e->types & DIGEST_CRC32C)) {
+    digest_expect(e, DIGEST_CRC32C, other->crc32c, sizeof(other->crc32c));
+  }
+}
+
+int digest_verify( digest* d, const digest_expectation* e ) {
+  static const int TYPES[] = { DIGEST_SHA256, DIGEST_MD5, DIGEST_CRC32C };
+  size_t i;
+
+  for (i = 0; i < sizeof(TYPES) / sizeof(TYPES[0]); i++) {
+    int type = TYPES[i];
+    const unsigned char* raw = NULL;
+    size_t size;
+    unsigned char* expected;
+
+    if (!(e->types & type)) { continue; }
+    expected = digest_value((unsigned char*) e->sha256, (unsigned char*) e->md5, (unsigned char*) e->crc32c, type, &size);
+    if (digest_raw(d, type, &raw) != size || 0 != memcmp(raw, expected, size)) { return type; }
+  }
+  return DIGEST_NONE;
+}
@@ -0,0 +1,145 @@
+
+#ifndef PATRON_DIGEST_H
+#define PATRON_DIGEST_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+/* The digest types, which can be combined to compute several digests at once */
+#define DIGEST_NONE    0
+#define DIGEST_SHA256  1
+#define DIGEST_MD5     2
+#define DIGEST_CRC32C  4
+
+#define DIGEST_OK     0
+#define DIGEST_ERROR  1
+
+/* Size of the largest digest, and of the buffer needed for it hex encoded including the terminating NUL */
+#define DIGEST_MAX_SIZE  32
+#define DIGEST_HEX_SIZE  65
+
+/**
+ * Message digests computed over a response body while it is being received,
+ * so that the body does not need to be read a second time to check it or to
+ * store it by its content. `digest_update` is called from the libCURL write
+ * callbacks with whatever chunks of the body arrive. Any combination of the
+ * digest types can be computed in the same pass over the data.
+ *
+ * CRC32C uses the CRC32 instructions of SSE4.2 or ARMv8 when the extension
+ * gets compiled for a CPU which has them.
+ */
+typedef struct {
+  uint32_t       state[8];
+  uint64_t       length;
+  unsigned char  block[64];
+  size_t         used;
+} sha256_context;
+
+typedef struct {
+  uint32_t       state[4];
+  uint64_t       length;
+  unsigned char  block[64];
+  size_t         used;
+} md5_context;
+
+typedef struct {
+  int             types;
+  sha256_context  sha256;
+  md5_context     md5;
+  uint32_t        crc32c;
+  unsigned char   sha256_raw[32];
+  unsigned char   md5_raw[16];
+  unsigned char   crc32c_raw[4];
+} digest;
+
+/**
+ * The values the digests of a body are expected to have, see `digest_verify`.
+ */
+typedef struct {
+  int            types;
+  unsigned char  sha256[32];
+  unsigned char  md5[16];
+  unsigned char  crc32c[4];
+} digest_expectation;
+
+/**
+ * Start computing the digests of the given _types_. With DIGEST_NONE the other
+ * functions do nothing, so that the callers do not need to check whether a
+ * digest was requested.
+ */
+void digest_init( digest* d, int types );
+
+/**
+ * Add _length_ bytes from _data_ to the digests.
+ */
+void digest_update( digest* d, const void* data, size_t length );
+
+/**
+ * Finish the digests. Their values can then be read with `digest_raw` and
+ * `digest_hex`. The digest needs to be initialized again to be reused.
+ */
+void digest_final( digest* d );
+
+/**
+ * Point _raw_ at the value of the finished digest of the given _type_, and
+ * return its size. Returns 0 if that digest was not computed.
+ */
+size_t digest_raw( digest* d, int type, const unsigned char** raw );
+
+/**
+ * Write the value of the finished digest of the given _type_ as lowercase hex
+ * into _hex_, which must have room for DIGEST_HEX_SIZE bytes. Returns the
+ * length of the hex string, or 0 if that digest was not computed.
+ */
+size_t digest_hex( digest* d, int type, char* hex );
+
+/**
+ * Returns the name of the digest _type_, like "sha256".
+ */
+const char* digest_name( int type );
+
+/**
+ * Initialize the expectation so that no digest is expected.
+ */
+void digest_expect_none( digest_expectation* e );
+
+/**
+ * Expect the digest of the given _type_ to have the _length_ bytes at _raw_ as
+ * its value.
+ *
+ * Return Codes:
+ *   DIGEST_OK
+ *   DIGEST_ERROR if _length_ is not the size of the digest
+ */
+int digest_expect( digest_expectation* e, int type, const unsigned char* raw, size_t length );
+
+/**
+ * Same as `digest_expect`, with the value Base64 encoded as in the Content-MD5
+ * and Digest headers.
+ */
+int digest_expect_base64( digest_expectation* e, int type, const char* base64, size_t length );
+
+/**
+ * Same as `digest_expect`, with the value hex encoded.
+ */
+int digest_expect_hex( digest_expectation* e, int type, const char* hex, size_t length );
+
+/**
+ * Expect the digests listed in the value of a Digest or Content-Digest header,
+ * like "sha-256=X48E9qOokqqrvdts8nOJRJN3OWDUoyWxBf7kbu9DBPE=". Algorithms which
+ * are not supported and values which can not be decoded are skipped.
+ */
+void digest_expect_header( digest_expectation* e, const char* value, size_t length );
+
+/**
+ * Add the expectations of _other_ for the types which _e_ does not expect yet.
+ */
+void digest_expect_merge( digest_expectation* e, const digest_expectation* other );
+
+/**
+ * Compare the finished digests against the expectation. Returns DIGEST_NONE
+ * if all of the expected digests match, or the type of a digest which does not.
+ */
+int digest_verify( digest* d, const digest_expectation* e );
+
+#endif
@@ -0,0 +1,145 @@
+
+#include <assert.h>
+#include <string.h>
+#include "escape.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define ESCAPE_SIMD_WIDTH 16
+#endif
+
+static const char HEX_DIGITS[] = "0123456789ABCDEF";
+
+/* Non-zero for the bytes which can be left as-is (the RFC 3986 unreserved characters) */
+static const unsigned char UNRESERVED[256] = {
+  ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1, ['F'] = 1, ['G'] = 1,
+  ['H'] = 1, ['I'] = 1, ['J'] = 1, ['K'] = 1, ['L'] = 1, ['M'] = 1, ['N'] = 1,
+  ['O'] = 1, ['P'] = 1, ['Q'] = 1, ['R'] = 1, ['S'] = 1, ['T'] = 1, ['U'] = 1,
+  ['V'] = 1, ['W'] = 1, ['X'] = 1, ['Y'] = 1, ['Z'] = 1,
+  ['a'] = 1, ['b'] = 1, ['c'] = 1, ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1,
+  ['h'] = 1, ['i'] = 1, ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1,
+  ['o'] = 1, ['p'] = 1, ['q'] = 1, ['r'] = 1, ['s'] = 1, ['t'] = 1, ['u'] = 1,
+  ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1,
+  ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1,
+  ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1,
+  ['-'] = 1, ['.'] = 1, ['_'] = 1, ['~'] = 1,
+};
+
+#ifdef ESCAPE_SIMD_WIDTH
+/*
+ * Classifies 16 bytes at once. Returns a bitmask with bit N set when byte N
+ * is an unreserved character. Bytes above 0x7F compare as negative numbers,
+ * so they never fall into any of the ranges below.
+ */
+static unsigned int unreserved_mask16( const unsigned char* p ) {
+  __m128i v = _mm_loadu_si128((const __m128i*) p);
+  /* Setting bit 5 maps "A".."Z" onto "a".."z" and only those two ranges land there */
+  __m128i folded = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  __m128i alpha = _mm_and_si128(_mm_cmpgt_epi8(folded, _mm_set1_epi8('a' - 1)),
+                                _mm_cmplt_epi8(folded, _mm_set1_epi8('z' + 1)));
+  __m128i digit = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('0' - 1)),
+                                _mm_cmplt_epi8(v, _mm_set1_epi8('9' + 1)));
+  __m128i mark = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('-')),
+                                           _mm_cmpeq_epi8(v, _mm_set1_epi8('.'))),
+                              _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')),
+                                           _mm_cmpeq_epi8(v, _mm_set1_epi8('~'))));
+
+  return (unsigned int) _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(alpha, digit), mark));
+}
+#endif
+
+size_t escape_count( const char* src, size_t length ) {
+  const unsigned char* s = (const unsigned char*) src;
+  size_t count = 0;
+  size_t i = 0;
+
+#ifdef ESCAPE_SIMD_WIDTH
+  for (; i + ESCAPE_SIMD_WIDTH <= length; i += ESCAPE_SIMD_WIDTH) {
+    count += ESCAPE_SIMD_WIDTH - __builtin_popcount(unreserved_mask16(s + i));
+  }
+#endif
+
+  for (; i < length; i++) {
+    count += !UNRESERVED[s[i]];
+  }
+  return count;
+}
+
+size_t escape_into( char* dst, const char* src, size_t length ) {
+  const unsigned char* s = (const unsigned char*) src;
+  char* d = dst;
+  size_t i = 0;
+
+  assert(NULL != dst || 0 == length);
+
+#ifdef ESCAPE_SIMD_WIDTH
+  /* Copy runs of 16 unreserved bytes in one go, only falling back to the
+     byte-by-byte loop for blocks that contain something to escape */
+  while (i + ESCAPE_SIMD_WIDTH <= length) {
+    size_t block_end;
+
+    if (unreserved_mask16(s + i) == 0xFFFF) {
+      memcpy(d, s + i, ESCAPE_SIMD_WIDTH);
+      d += ESCAPE_SIMD_WIDTH;
+      i += ESCAPE_SIMD_WIDTH;
+      continue;
+    }
+    for (block_end = i + ESCAPE_SIMD_WIDTH; i < block_end; i++) {
+      if (UNRESERVED[s[i]]) {
+        *d++ = (char) s[i];
+      } else {
+        *d++ = '%';
+        *d++ = HEX_DIGITS[s[i] >> 4];
+        *d++ = HEX_DIGITS[s[i] & 0x0F];
+      }
+    }
+  }
+#endif
+
+  for (; i < length; i++) {
+    if (UNRESERVED[s[i]]) {
+      *d++ = (char) s[i];
+    } else {
+      *d++ = '%';
+      *d++ = HEX_DIGITS[s[i] >> 4];
+      *d++ = HEX_DIGITS[s[i] & 0x0F];
+    }
+  }
+  return (size_t) (d - dst);
+}
+
+static int hex_value( unsigned char c ) {
+  if (c >= '0' && c <= '9') { return c - '0'; }
+  if (c >= 'a' && c <= 'f') { return c - 'a' + 10; }
+  if (c >= 'A' && c <= 'F') { return c - 'A' + 10; }
+  return -1;
+}
+
+size_t unescape_into( char* dst, const char* src, size_t length ) {
+  const char* end = src + length;
+  char* d = dst;
+
+  assert(NULL != dst || 0 == length);
+
+  while (src < end) {
+    const char* percent = memchr(src, '%', (size_t) (end - src));
+    size_t run = percent ? (size_t) (percent - src) : (size_t) (end - src);
+    int hi, lo;
+
+    memcpy(d, src, run);
+    d += run;
+    src += run;
+    if (!percent) { break; }
+
+    hi = (end - src) > 2 ? hex_value((unsigned char) src[1]) : -1;
+    lo = hi >= 0 ? hex_value((unsigned char) src[2]) : -1;
+    if (hi >= 0 && lo >= 0) {
+      *d++ = (char) ((hi << 4) | lo);
+      src += 3;
+    } else {
+      /* Not a valid escape sequence, keep it as-is like curl_easy_unescape does */
+      *d++ = *src++;
+    }
+  }
+  return (size_t) (d - dst);
+}
@@ -0,0 +1,38 @@
+
+#ifndef PATRON_ESCAPE_H
+#define PATRON_ESCAPE_H
+
+#include <stdlib.h>
+
+/**
+ * Percent-encoding of strings for use in URLs and form bodies. These functions
+ * produce the same output as `curl_easy_escape`: every byte except for the
+ * RFC 3986 unreserved characters (ALPHA, DIGIT, "-", ".", "_" and "~") gets
+ * encoded as "%XX" with uppercase hex digits.
+ *
+ * Unlike `curl_easy_escape` these do not allocate, so the caller can size the
+ * destination once and write the escaped data directly into it. When built
+ * with SSE2 the input gets classified 16 bytes at a time.
+ */
+
+/**
+ * Count the number of bytes in _src_ that need to be percent-encoded. The
+ * escaped length of _src_ is then _length_ + 2 * the returned count.
+ */
+size_t escape_count( const char* src, size_t length );
+
+/**
+ * Percent-encode _length_ bytes from _src_ into _dst_. The _dst_ buffer must
+ * have room for at least the escaped length of _src_ (see `escape_count`).
+ * Returns the number of bytes written to _dst_.
+ */
+size_t escape_into( char* dst, const char* src, size_t length );
+
+/**
+ * Decode the "%XX" sequences in _length_ bytes from _src_ into _dst_, which
+ * must have room for _length_ bytes. Invalid sequences are copied as-is, the
+ * same way `curl_easy_unescape` does. Returns the number of bytes written.
+ */
+size_t unescape_into( char* dst, const char* src, size_t length );
+
+#endif
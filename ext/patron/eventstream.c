@@ -0,0 +1,224 @@
+
+#include <ruby.h>
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+#include "eventstream.h"
+
+/* Precedes the type, data and ID of every record in the records buffer */
+typedef struct {
+  size_t  type_length;
+  size_t  data_length;
+  size_t  id_length;
+  long    retry;
+} record_header;
+
+static int eventstream_add_record( eventstream* es, const char* type, size_t type_length,
+                                   const char* data, size_t data_length ) {
+  record_header header;
+
+  header.type_length = type_length;
+  header.data_length = data_length;
+  header.id_length = EVENTSTREAM_EVENTS == es->mode ? es->id.length : 0;
+  header.retry = es->retry;
+
+  if (MB_OK != membuffer_append(&es->records, &header, sizeof(header)) ||
+      MB_OK != membuffer_append(&es->records, type, type_length) ||
+      MB_OK != membuffer_append(&es->records, data, data_length) ||
+      MB_OK != membuffer_append(&es->records, es->id.buf, header.id_length)) {
+    return EVENTSTREAM_OUT_OF_MEMORY;
+  }
+  es->record_count++;
+  return EVENTSTREAM_OK;
+}
+
+/* Dispatches the event collected so far, if it has any data */
+static int eventstream_dispatch( eventstream* es ) {
+  int rc = EVENTSTREAM_OK;
+
+  if (es->data.length > 0) {
+    /* Every data line added a LF, the last one is not part of the data */
+    if (es->type.length > 0) {
+      rc = eventstream_add_record(es, es->type.buf, es->type.length, es->data.buf, es->data.length - 1);
+    } else {
+      rc = eventstream_add_record(es, "message", 7, es->data.buf, es->data.length - 1);
+    }
+  }
+  membuffer_clear(&es->type);
+  membuffer_clear(&es->data);
+  return rc;
+}
+
+/* Parses a "retry" field, which is ignored unless it is made up of digits only */
+static void eventstream_set_retry( eventstream* es, const char* value, size_t length ) {
+  long retry = 0;
+  size_t i;
+
+  if (0 == length) { return; }
+  for (i = 0; i < length; i++) {
+    if (value[i] < '0' || value[i] > '9') { return; }
+    if (retry > (LONG_MAX - 9) / 10) { return; }
+    retry = retry * 10 + (value[i] - '0');
+  }
+  es->retry = retry;
+}
+
+static int eventstream_event_line( eventstream* es, const char* line, size_t length ) {
+  const char* colon = NULL;
+  const char* value = NULL;
+  size_t name_length = length;
+  size_t value_length = 0;
+
+  if (0 == length) { return eventstream_dispatch(es); }
+  if (':' == line[0]) { return EVENTSTREAM_OK; }  /* a comment, used to keep connections alive */
+
+  colon = memchr(line, ':', length);
+  if (colon) {
+    name_length = colon - line;
+    value = colon + 1;
+    value_length = length - name_length - 1;
+    if (value_length > 0 && ' ' == value[0]) {
+      value++;
+      value_length--;
+    }
+  }
+
+  if (5 == name_length && 0 == memcmp(line, "event", 5)) {
+    membuffer_clear(&es->type);
+    return MB_OK == membuffer_append(&es->type, value, value_length) ? EVENTSTREAM_OK : EVENTSTREAM_OUT_OF_MEMORY;
+  }
+  if (4 == name_length && 0 == memcmp(line, "data", 4)) {
+    return MB_OK == membuffer_append(&es->data, value, value_length) && MB_OK == membuffer_append(&es->data, "\n", 1)
+      ? EVENTSTREAM_OK : EVENTSTREAM_OUT_OF_MEMORY;
+  }
+  if (2 == name_length && 0 == memcmp(line, "id", 2)) {
+    if (value_length > 0 && memchr(value, '\0', value_length)) { return EVENTSTREAM_OK; }
+    membuffer_clear(&es->id);
+    return MB_OK == membuffer_append(&es->id, value, value_length) ? EVENTSTREAM_OK : EVENTSTREAM_OUT_OF_MEMORY;
+  }
+  if (5 == name_length && 0 == memcmp(line, "retry", 5)) {
+    eventstream_set_retry(es, value, value_length);
+  }
+  /* Any other field is ignored */
+  return EVENTSTREAM_OK;
+}
+
+static int eventstream_complete_line( eventstream* es, const char* line, size_t length ) {
+  if (es->first_line) {
+    es->first_line = 0;
+    if (length >= 3 && 0 == memcmp(line, "\xEF\xBB\xBF", 3)) {
+      line += 3;
+      length -= 3;
+    }
+  }
+
+  if (EVENTSTREAM_EVENTS == es->mode) {
+    return eventstream_event_line(es, line, length);
+  }
+  if (length > 0 && '\r' == line[length - 1]) { length--; }
+  return eventstream_add_record(es, NULL, 0, line, length);
+}
+
+/* Completes the line which was started in earlier data with _length_ more bytes */
+static int eventstream_end_line( eventstream* es, const char* data, size_t length ) {
+  int rc;
+
+  if (0 == es->line.length) {
+    return eventstream_complete_line(es, data, length);
+  }
+  if (MB_OK != membuffer_append(&es->line, data, length)) { return EVENTSTREAM_OUT_OF_MEMORY; }
+  rc = eventstream_complete_line(es, es->line.buf, es->line.length);
+  membuffer_clear(&es->line);
+  return rc;
+}
+
+void eventstream_init( eventstream* es, int mode, const char* last_event_id, size_t id_length ) {
+  assert(NULL != es);
+
+  es->mode = mode;
+  es->first_line = 1;
+  es->after_cr = 0;
+  es->record_count = 0;
+  es->retry = -1;
+  membuffer_init(&es->line);
+  membuffer_init(&es->records);
+  membuffer_init(&es->type);
+  membuffer_init(&es->data);
+  membuffer_init(&es->id);
+  if (last_event_id) {
+    membuffer_append(&es->id, last_event_id, id_length);
+  }
+}
+
+void eventstream_destroy( eventstream* es ) {
+  membuffer_destroy(&es->line);
+  membuffer_destroy(&es->records);
+  membuffer_destroy(&es->type);
+  membuffer_destroy(&es->data);
+  membuffer_destroy(&es->id);
+  es->record_count = 0;
+}
+
+int eventstream_feed( eventstream* es, const char* data, size_t length ) {
+  size_t start = 0;
+  size_t i;
+  int rc;
+
+  for (i = 0; i < length; i++) {
+    char c = data[i];
+    if (es->after_cr) {
+      /* The LF of a CRLF which was split over two chunks */
+      es->after_cr = 0;
+      if ('\n' == c) {
+        start = i + 1;
+        continue;
+      }
+    }
+    /* Events can end their lines with a CR alone, for lines the CR of a CRLF gets removed later */
+    if ('\n' == c || ('\r' == c && EVENTSTREAM_EVENTS == es->mode)) {
+      rc = eventstream_end_line(es, data + start, i - start);
+      if (EVENTSTREAM_OK != rc) { return rc; }
+      if ('\r' == c) {
+        if (i + 1 < length && '\n' == data[i + 1]) { i++; }
+        else if (i + 1 == length) { es->after_cr = 1; }
+      }
+      start = i + 1;
+    }
+  }
+  return MB_OK == membuffer_append(&es->line, data + start, length - start) ? EVENTSTREAM_OK : EVENTSTREAM_OUT_OF_MEMORY;
+}
+
+int eventstream_finish( eventstream* es ) {
+  int rc = EVENTSTREAM_OK;
+
+  if (EVENTSTREAM_LINES == es->mode && es->line.length > 0) {
+    rc = eventstream_complete_line(es, es->line.buf, es->line.length);
+  }
+  membuffer_clear(&es->line);
+  return rc;
+}
+
+int eventstream_next( eventstream* es, size_t* offset, eventstream_record* record ) {
+  record_header header;
+  const char* fields;
+
+  if (*offset + sizeof(header) > es->records.length) { return 0; }
+
+  memcpy(&header, es->records.buf + *offset, sizeof(header));
+  fields = es->records.buf + *offset + sizeof(header);
+  record->type = fields;
+  record->type_length = header.type_length;
+  record->data = fields + header.type_length;
+  record->data_length = header.data_length;
+  record->id = record->data + header.data_length;
+  record->id_length = header.id_length;
+  record->retry = header.retry;
+
+  *offset += sizeof(header) + header.type_length + header.data_length + header.id_length;
+  return 1;
+}
+
+void eventstream_clear( eventstream* es ) {
+  membuffer_clear(&es->records);
+  es->record_count = 0;
+}
@@ -0,0 +1,99 @@
+
+#ifndef PATRON_EVENTSTREAM_H
+#define PATRON_EVENTSTREAM_H
+
+#include <stdlib.h>
+#include "membuffer.h"
+
+#define EVENTSTREAM_LINES   1  /* newline delimited records, like NDJSON */
+#define EVENTSTREAM_EVENTS  2  /* Server-Sent Events */
+
+#define EVENTSTREAM_OK             0
+#define EVENTSTREAM_OUT_OF_MEMORY  1
+
+/**
+ * Framing of a response body which is consumed while it streams in, instead
+ * of being collected until the transfer ends. The chunks of the body are fed
+ * in as libCURL hands them to the write callback, and complete records are
+ * collected until they get taken out - so that the records of a chunk can be
+ * handed to Ruby all at once, and a record split over several chunks is only
+ * handed out once all of it has arrived.
+ *
+ * In EVENTSTREAM_LINES mode every line is a record, with its line ending
+ * removed. In EVENTSTREAM_EVENTS mode the stream is parsed as Server-Sent
+ * Events (text/event-stream): the "event", "data", "id" and "retry" fields
+ * are collected and an event is dispatched at every empty line, the way the
+ * HTML specification describes it for EventSource.
+ */
+typedef struct {
+  int        mode;
+  int        first_line;  /* a byte order mark is only skipped at the start of the stream */
+  int        after_cr;    /* the last line ended with a CR, which a LF may still belong to */
+  membuffer  line;        /* the incomplete line at the end of the data so far */
+  membuffer  records;     /* the complete records which have not been taken out yet */
+  size_t     record_count;
+  membuffer  type;        /* the fields of the event being collected */
+  membuffer  data;
+  membuffer  id;          /* the last event ID, which carries over to the following events */
+  long       retry;       /* the reconnection time in milliseconds, or -1 if the stream has not set one */
+} eventstream;
+
+/**
+ * A record taken out of the stream. The fields point into the buffer of the
+ * stream and stay valid until `eventstream_clear` is called. A line only has
+ * its _data_.
+ */
+typedef struct {
+  const char*  type;
+  size_t       type_length;
+  const char*  data;
+  size_t       data_length;
+  const char*  id;
+  size_t       id_length;
+  long         retry;
+} eventstream_record;
+
+/**
+ * Initialize the stream in the given _mode_. With EVENTSTREAM_EVENTS the
+ * _last_event_id_ of an earlier connection can be given to carry on from it,
+ * or NULL.
+ */
+void eventstream_init( eventstream* es, int mode, const char* last_event_id, size_t id_length );
+
+/**
+ * Free any memory used by the stream.
+ */
+void eventstream_destroy( eventstream* es );
+
+/**
+ * Feed the next _length_ bytes of the body into the stream.
+ *
+ * Return Codes:
+ *   EVENTSTREAM_OK
+ *   EVENTSTREAM_OUT_OF_MEMORY
+ */
+int eventstream_feed( eventstream* es, const char* data, size_t length );
+
+/**
+ * Frame what is left at the end of the body. A last line without a line
+ * ending becomes a record, while an event which has not been completed by
+ * an empty line is discarded.
+ *
+ * Return Codes:
+ *   EVENTSTREAM_OK
+ *   EVENTSTREAM_OUT_OF_MEMORY
+ */
+int eventstream_finish( eventstream* es );
+
+/**
+ * Read the record at _offset_ into _record_ and advance _offset_ past it.
+ * Start with an _offset_ of 0. Returns 0 once there are no more records.
+ */
+int eventstream_next( eventstream* es, size_t* offset, eventstream_record* record );
+
+/**
+ * Discard the records which have been taken out.
+ */
+void eventstream_clear( eventstream* es );
+
+#endif
@@ -15,6 +15,17 @@ elsif !have_library('curl') or !have_header('curl/curl.h')
   EOM
 end
 
+# Optional system calls used by the file download sink
+have_func('fallocate', 'fcntl.h')
+have_func('posix_fadvise', 'fcntl.h')
+have_func('posix_memalign', 'stdlib.h')
+have_func('futimens', 'sys/stat.h')
+have_header('linux/fs.h')
+
+# Optional compressors for request bodies
+have_library('z', 'deflateInit2_', 'zlib.h') && have_header('zlib.h')
+have_library('zstd', 'ZSTD_compressStream2', 'zstd.h') && have_header('zstd.h')
+
 if CONFIG['CC'] =~ /gcc/
   $CFLAGS << ' -pedantic -Wall'
 end
@@ -0,0 +1,487 @@
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for fallocate and O_DIRECT */
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif
+#include "filesink.h"
+
+/* Data gets written out in blocks of this size. It is a multiple of the
+   logical block size of any file system, which O_DIRECT requires. */
+#define FS_BUFFER_CAPACITY  (1024 * 1024)
+#define FS_BUFFER_ALIGNMENT 4096
+#define FS_TMP_ATTEMPTS     100
+#define FS_POLL_INTERVAL_MS 50
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+static unsigned int tmp_counter = 0;
+
+static int filesink_fail( filesink* f, int error ) {
+  if (0 == f->error) { f->error = error; }
+  return FS_ERROR;
+}
+
+static char* filesink_strdup( const char* str ) {
+  size_t len = strlen(str);
+  char* copy = malloc(len + 1);
+  if (NULL != copy) { memcpy(copy, str, len + 1); }
+  return copy;
+}
+
+/* Writes the _length_ bytes out at the current offset, retrying short writes */
+static int filesink_write_out( filesink* f, const char* src, size_t length ) {
+  while (length > 0) {
+    ssize_t written;
+    if (NULL != f->tmp_path) {
+      written = pwrite(f->fd, src, length, f->offset);
+    } else {
+      /* Not a regular file, which might not be seekable (a FIFO for instance) */
+      written = write(f->fd, src, length);
+    }
+    if (written < 0) {
+      if (EINTR == errno) { continue; }
+      if (EAGAIN == errno || EWOULDBLOCK == errno) {
+        /* A non-blocking pipe or socket which is full, wait until the reader catches up */
+        struct pollfd pfd;
+        pfd.fd = f->fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+        if (f->cancelled) { return filesink_fail(f, ECANCELED); }
+        if (poll(&pfd, 1, FS_POLL_INTERVAL_MS) >= 0 || EINTR == errno) { continue; }
+      }
+      return filesink_fail(f, errno);
+    }
+    src += written;
+    length -= (size_t) written;
+    f->offset += written;
+  }
+  return FS_OK;
+}
+
+#ifdef O_DIRECT
+/* O_DIRECT only permits writes of whole blocks, so it gets switched off for the last, partial one */
+static void filesink_drop_direct( filesink* f ) {
+  int fl = fcntl(f->fd, F_GETFL);
+  if (fl >= 0 && (fl & O_DIRECT)) {
+    fcntl(f->fd, F_SETFL, fl & ~O_DIRECT);
+  }
+}
+#endif
+
+static int filesink_flush( filesink* f ) {
+  int rc = FS_OK;
+
+  if (0 == f->length) { return FS_OK; }
+#ifdef O_DIRECT
+  if (f->length % FS_BUFFER_ALIGNMENT) { filesink_drop_direct(f); }
+#endif
+  rc = filesink_write_out(f, f->buf, f->length);
+  f->length = 0;
+  return rc;
+}
+
+static void filesink_release( filesink* f ) {
+  if (f->fd >= 0 && !(f->flags & FS_BORROWED)) { close(f->fd); }
+  free(f->buf);
+  free(f->path);
+  free(f->tmp_path);
+  f->fd = -1;
+  f->buf = NULL;
+  f->path = NULL;
+  f->tmp_path = NULL;
+  f->length = 0;
+  f->capacity = 0;
+}
+
+/* Opens a new temporary file next to the destination, so that it can be renamed over it */
+static int filesink_open_tmp( filesink* f, int oflags ) {
+  size_t tmp_size = strlen(f->path) + 64;
+  int attempt;
+
+  f->tmp_path = malloc(tmp_size);
+  if (NULL == f->tmp_path) { return filesink_fail(f, ENOMEM); }
+
+  for (attempt = 0; attempt < FS_TMP_ATTEMPTS; attempt++) {
+    snprintf(f->tmp_path, tmp_size, "%s.patron-%ld-%u", f->path, (long) getpid(), tmp_counter++);
+    /* 0666 so that the umask applies the same way it would to the destination file */
+    f->fd = open(f->tmp_path, oflags | O_CREAT | O_EXCL, 0666);
+#ifdef O_DIRECT
+    if (f->fd < 0 && EINVAL == errno && (oflags & O_DIRECT)) {
+      /* The file system does not support O_DIRECT, carry on without it */
+      oflags &= ~O_DIRECT;
+      f->fd = open(f->tmp_path, oflags | O_CREAT | O_EXCL, 0666);
+    }
+#endif
+    if (f->fd >= 0 || EEXIST != errno) { break; }
+  }
+  if (f->fd < 0) { return filesink_fail(f, errno); }
+  return FS_OK;
+}
+
+void filesink_init( filesink* f ) {
+  assert(NULL != f);
+
+  memset(f, 0, sizeof(*f));
+  f->fd = -1;
+  f->mtime = -1;
+}
+
+int filesink_is_open( const filesink* f ) {
+  return f->fd >= 0;
+}
+
+int filesink_open( filesink* f, const char* path, int flags ) {
+  struct stat st;
+  int oflags = O_WRONLY | O_CLOEXEC;
+  void* buf = NULL;
+
+  assert(NULL != f && NULL != path);
+  filesink_init(f);
+  f->flags = flags;
+
+  f->path = filesink_strdup(path);
+  if (NULL == f->path) { return filesink_fail(f, ENOMEM); }
+
+#ifdef HAVE_POSIX_MEMALIGN
+  if (0 != posix_memalign(&buf, FS_BUFFER_ALIGNMENT, FS_BUFFER_CAPACITY)) { buf = NULL; }
+#else
+  buf = malloc(FS_BUFFER_CAPACITY);
+#endif
+  if (NULL == buf) {
+    filesink_release(f);
+    return filesink_fail(f, ENOMEM);
+  }
+  f->buf = buf;
+  f->capacity = FS_BUFFER_CAPACITY;
+
+  if (0 == stat(path, &st) && !S_ISREG(st.st_mode)) {
+    f->fd = open(path, oflags | O_CREAT | O_TRUNC, 0666);
+  } else {
+#if defined(O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+    if (flags & FS_DIRECT) { oflags |= O_DIRECT; }
+#endif
+    filesink_open_tmp(f, oflags);
+  }
+  if (f->fd < 0) {
+    int error = f->error ? f->error : errno;
+    filesink_release(f);
+    f->error = error;
+    return FS_ERROR;
+  }
+
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
+  posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  return FS_OK;
+}
+
+int filesink_open_fd( filesink* f, int fd, size_t buffer_size, int flags ) {
+  struct stat st;
+
+  assert(NULL != f && fd >= 0);
+  filesink_init(f);
+  f->flags = (flags & FS_FSYNC) | FS_BORROWED;
+
+  if (0 != fstat(fd, &st)) { return filesink_fail(f, errno); }
+  if (buffer_size > 0) {
+    f->buf = malloc(buffer_size);
+    if (NULL == f->buf) { return filesink_fail(f, ENOMEM); }
+    f->capacity = buffer_size;
+#ifdef F_SETPIPE_SZ
+    /* Fails if the size is past the limit for unprivileged users, which is fine */
+    if (S_ISFIFO(st.st_mode)) { fcntl(fd, F_SETPIPE_SZ, (int) buffer_size); }
+#endif
+  }
+  f->fd = fd;
+  return FS_OK;
+}
+
+int filesink_open_resumable( filesink* f, const char* path, off_t offset, int flags ) {
+  size_t part_size = strlen(path) + sizeof(FS_PARTIAL_SUFFIX);
+  int oflags = O_WRONLY | O_CREAT | O_CLOEXEC;
+  void* buf = NULL;
+
+  assert(NULL != f && NULL != path);
+  filesink_init(f);
+  f->flags = flags | FS_RESUME;
+
+  f->path = filesink_strdup(path);
+  f->tmp_path = malloc(part_size);
+#ifdef HAVE_POSIX_MEMALIGN
+  if (0 != posix_memalign(&buf, FS_BUFFER_ALIGNMENT, FS_BUFFER_CAPACITY)) { buf = NULL; }
+#else
+  buf = malloc(FS_BUFFER_CAPACITY);
+#endif
+  f->buf = buf;
+  if (NULL == f->path || NULL == f->tmp_path || NULL == f->buf) {
+    filesink_release(f);
+    return filesink_fail(f, ENOMEM);
+  }
+  f->capacity = FS_BUFFER_CAPACITY;
+  snprintf(f->tmp_path, part_size, "%s%s", path, FS_PARTIAL_SUFFIX);
+
+#if defined(O_DIRECT) && defined(HAVE_POSIX_MEMALIGN)
+  /* Appending at an unaligned offset rules out O_DIRECT */
+  if ((flags & FS_DIRECT) && 0 == offset % FS_BUFFER_ALIGNMENT) { oflags |= O_DIRECT; }
+#endif
+  f->fd = open(f->tmp_path, oflags, 0666);
+#ifdef O_DIRECT
+  if (f->fd < 0 && EINVAL == errno && (oflags & O_DIRECT)) {
+    f->fd = open(f->tmp_path, oflags & ~O_DIRECT, 0666);
+  }
+#endif
+  if (f->fd < 0 || 0 != ftruncate(f->fd, offset)) {
+    int error = errno;
+    filesink_release(f);
+    return filesink_fail(f, error);
+  }
+  f->offset = offset;
+
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
+  posix_fadvise(f->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  return FS_OK;
+}
+
+int filesink_restart( filesink* f ) {
+  assert(filesink_is_open(f));
+
+  f->length = 0;
+  f->offset = 0;
+  f->preallocated = 0;
+  if (NULL != f->tmp_path && 0 != ftruncate(f->fd, 0)) { return filesink_fail(f, errno); }
+  return FS_OK;
+}
+
+off_t filesink_size( const filesink* f ) {
+  return f->offset + (off_t) f->length;
+}
+
+void filesink_preallocate( filesink* f, off_t size ) {
+  assert(filesink_is_open(f));
+
+  if (NULL == f->tmp_path || size <= f->preallocated) { return; }
+#ifdef HAVE_FALLOCATE
+  if (0 == fallocate(f->fd, 0, 0, size)) { f->preallocated = size; }
+#endif
+}
+
+void filesink_set_mtime( filesink* f, time_t mtime ) {
+  f->mtime = mtime;
+}
+
+int filesink_write( filesink* f, const void* src, size_t length ) {
+  const char* data = src;
+
+  assert(filesink_is_open(f));
+  if (f->error) { return FS_ERROR; }
+  if (0 == f->capacity) { return filesink_write_out(f, data, length); }
+
+  while (length > 0) {
+    size_t room = f->capacity - f->length;
+    size_t chunk = length < room ? length : room;
+
+    memcpy(f->buf + f->length, data, chunk);
+    f->length += chunk;
+    data += chunk;
+    length -= chunk;
+
+    if (f->length == f->capacity && FS_OK != filesink_flush(f)) { return FS_ERROR; }
+  }
+  return FS_OK;
+}
+
+int filesink_write_at( filesink* f, off_t offset, const void* src, size_t length ) {
+  const char* data = src;
+
+  assert(filesink_is_open(f));
+  if (f->error) { return FS_ERROR; }
+  if (NULL == f->tmp_path) { return filesink_fail(f, ESPIPE); }
+#ifdef O_DIRECT
+  /* The ranges arrive in arbitrarily sized pieces, which O_DIRECT does not allow */
+  filesink_drop_direct(f);
+#endif
+
+  while (length > 0) {
+    ssize_t written = pwrite(f->fd, data, length, offset);
+    if (written < 0) {
+      if (EINTR == errno) { continue; }
+      return filesink_fail(f, errno);
+    }
+    data += written;
+    length -= (size_t) written;
+    offset += written;
+  }
+  /* Keep track of the end of the file, so that commit trims the preallocated space correctly */
+  if (offset > f->offset) { f->offset = offset; }
+  return FS_OK;
+}
+
+void filesink_cancel( filesink* f ) {
+  f->cancelled = 1;
+}
+
+int filesink_commit( filesink* f ) {
+  int rc = FS_OK;
+  struct stat existing;
+
+  assert(filesink_is_open(f));
+  if (f->error || FS_OK != filesink_flush(f)) {
+    filesink_abort(f);
+    return FS_ERROR;
+  }
+
+  if (NULL != f->tmp_path) {
+    /* The server may have sent less than the Content-Length we preallocated for */
+    if (f->preallocated > f->offset && 0 != ftruncate(f->fd, f->offset)) { rc = filesink_fail(f, errno); }
+#ifdef HAVE_FUTIMENS
+    if (FS_OK == rc && f->mtime >= 0) {
+      struct timespec times[2];
+      times[0].tv_sec = 0;
+      times[0].tv_nsec = UTIME_OMIT;
+      times[1].tv_sec = f->mtime;
+      times[1].tv_nsec = 0;
+      futimens(f->fd, times);
+    }
+#endif
+    /* The temporary file got the default permissions, keep the ones of the file it replaces */
+    if (FS_OK == rc && 0 == stat(f->path, &existing) && 0 != fchmod(f->fd, existing.st_mode & 07777)) {
+      rc = filesink_fail(f, errno);
+    }
+    if (FS_OK == rc && (f->flags & FS_FSYNC) && 0 != fsync(f->fd)) { rc = filesink_fail(f, errno); }
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_DONTNEED)
+    /* Once synced the pages are clean, so they can be dropped from the page cache right away */
+    if (FS_OK == rc && (f->flags & FS_FSYNC)) { posix_fadvise(f->fd, 0, 0, POSIX_FADV_DONTNEED); }
+#endif
+    if (0 != close(f->fd) && FS_OK == rc) { rc = filesink_fail(f, errno); }
+    f->fd = -1;
+
+    if (FS_OK == rc && 0 != rename(f->tmp_path, f->path)) { rc = filesink_fail(f, errno); }
+    if (FS_OK != rc) {
+      if (!(f->flags & FS_RESUME)) { unlink(f->tmp_path); }
+    } else if (f->flags & FS_FSYNC) {
+      /* Make the rename itself durable */
+      char* slash = strrchr(f->path, '/');
+      int dir_fd;
+      if (slash == f->path) {
+        dir_fd = open("/", O_RDONLY | O_CLOEXEC);
+      } else if (NULL != slash) {
+        *slash = '\0';
+        dir_fd = open(f->path, O_RDONLY | O_CLOEXEC);
+        *slash = '/';
+      } else {
+        dir_fd = open(".", O_RDONLY | O_CLOEXEC);
+      }
+      if (dir_fd >= 0) {
+        fsync(dir_fd);
+        close(dir_fd);
+      }
+    }
+  } else if ((f->flags & FS_FSYNC) && 0 != fsync(f->fd) && EINVAL != errno) {
+    /* EINVAL means the destination does not support syncing, like a pipe */
+    rc = filesink_fail(f, errno);
+  }
+
+  filesink_release(f);
+  return rc;
+}
+
+void filesink_abort( filesink* f ) {
+  if (!filesink_is_open(f)) { return; }
+
+  if (f->flags & FS_RESUME) {
+    /* Keep what has been received so far for resuming, without the preallocated space */
+    filesink_flush(f);
+    if (0 != ftruncate(f->fd, f->offset) && 0 == f->error) { f->error = errno; }
+    if (0 == f->offset) { unlink(f->tmp_path); }
+  } else if (NULL != f->tmp_path) {
+    unlink(f->tmp_path);
+  }
+  filesink_release(f);
+}
+
+int filesink_read_back( const filesink* f, off_t length,
+                        void (*consume)( void* arg, const void* data, size_t length ), void* arg ) {
+  char* buf = NULL;
+  off_t offset = 0;
+  int fd = -1;
+  int error = 0;
+
+  assert(filesink_is_open(f) && NULL != consume);
+  if (length <= 0) { return FS_OK; }
+
+  /* The sink writes through its own descriptor, which may be write-only and use O_DIRECT */
+  fd = open(f->tmp_path ? f->tmp_path : f->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) { return FS_ERROR; }
+  buf = malloc(FS_BUFFER_CAPACITY);
+  if (NULL == buf) {
+    close(fd);
+    errno = ENOMEM;
+    return FS_ERROR;
+  }
+
+  while (offset < length) {
+    size_t wanted = length - offset < FS_BUFFER_CAPACITY ? (size_t) (length - offset) : FS_BUFFER_CAPACITY;
+    ssize_t got = pread(fd, buf, wanted, offset);
+    if (got < 0 && EINTR == errno) { continue; }
+    if (got <= 0) {
+      /* A file shorter than expected is as bad as one which cannot be read */
+      error = got < 0 ? errno : EIO;
+      break;
+    }
+    consume(arg, buf, (size_t) got);
+    offset += got;
+  }
+
+  free(buf);
+  close(fd);
+  if (error) {
+    errno = error;
+    return FS_ERROR;
+  }
+  return FS_OK;
+}
+
+int filesink_clone( const char* src, const char* dst ) {
+#ifdef FICLONE
+  int src_fd = -1;
+  int dst_fd = -1;
+  int error = 0;
+
+  src_fd = open(src, O_RDONLY | O_CLOEXEC);
+  if (src_fd < 0) { return FS_ERROR; }
+  dst_fd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+  if (dst_fd < 0) {
+    error = errno;
+  } else if (0 != ioctl(dst_fd, FICLONE, src_fd)) {
+    error = errno;
+    unlink(dst);
+  }
+  if (dst_fd >= 0) { close(dst_fd); }
+  close(src_fd);
+  if (error) {
+    errno = error;
+    return FS_ERROR;
+  }
+  return FS_OK;
+#else
+  (void) src;
+  (void) dst;
+  errno = ENOTSUP;
+  return FS_ERROR;
+#endif
+}
@@ -0,0 +1,201 @@
+
+#ifndef PATRON_FILESINK_H
+#define PATRON_FILESINK_H
+
+#include <stdlib.h>
+#include <sys/types.h>
+#include <time.h>
+
+#define FS_OK     0
+#define FS_ERROR  1
+
+/* Flags for filesink_open */
+#define FS_FSYNC   1  /* fsync the file (and its directory) before reporting success */
+#define FS_DIRECT  2  /* bypass the page cache with O_DIRECT where supported */
+#define FS_RESUME  4  /* set by filesink_open_resumable */
+#define FS_BORROWED 8 /* set by filesink_open_fd, the descriptor is not closed */
+
+/* Suffix of the partial file kept by resumable file sinks */
+#define FS_PARTIAL_SUFFIX ".part"
+
+/**
+ * Implementation of a download sink which writes a response body into a file.
+ * The data gets collected in a large, page-aligned buffer and written out with
+ * `pwrite` once the buffer is full, so that the file grows in large extents.
+ *
+ * Regular files are written to a temporary file in the same directory, which
+ * gets renamed over the destination path only once the download completes. An
+ * interrupted download therefore never leaves a half-written destination file
+ * behind. Destinations which exist and are not regular files (like FIFOs or
+ * devices) are written to directly.
+ *
+ * On failure the functions return FS_ERROR and store the errno in _error_.
+ */
+typedef struct {
+  int      fd;
+  int      flags;
+  int      error;
+  int      cancelled;
+  char    *buf;
+  size_t   length;
+  size_t   capacity;
+  off_t    offset;
+  off_t    preallocated;
+  time_t   mtime;
+  char    *path;
+  char    *tmp_path;
+} filesink;
+
+/**
+ * Initialize the file sink so that it is not open. A sink needs to be
+ * initialized once before being used with `filesink_open`.
+ */
+void filesink_init( filesink* f );
+
+/**
+ * Returns non-zero if the file sink has been opened and not yet committed
+ * or aborted.
+ */
+int filesink_is_open( const filesink* f );
+
+/**
+ * Open the file sink for writing to _path_, using the given combination of
+ * FS_FSYNC and FS_DIRECT _flags_. O_DIRECT is silently dropped if the file
+ * system does not support it.
+ *
+ * Return Codes:
+ *   FS_OK
+ *   FS_ERROR
+ */
+int filesink_open( filesink* f, const char* path, int flags );
+
+/**
+ * Open the file sink for writing to the already open descriptor _fd_, which
+ * can be a pipe or a socket as well as a file. The descriptor is written to at
+ * its current position and is not closed by the sink. With a _buffer_size_ of
+ * 0 every write goes to the descriptor right away, otherwise the data gets
+ * collected in a buffer of that size first. The capacity of a pipe is raised
+ * to the buffer size where possible, so that a full buffer fits into it in one
+ * write. Non-blocking descriptors are waited on when they are not writable.
+ *
+ * Return Codes:
+ *   FS_OK
+ *   FS_ERROR
+ */
+int filesink_open_fd( filesink* f, int fd, size_t buffer_size, int flags );
+
+/**
+ * Open the file sink for resuming a download into _path_. The data is written to
+ * _path_ with FS_PARTIAL_SUFFIX appended, which is kept when the sink is aborted
+ * so that a later download can continue where this one stopped. Writing starts
+ * at _offset_, anything in the partial file beyond it gets discarded.
+ *
+ * Return Codes:
+ *   FS_OK
+ *   FS_ERROR
+ */
+int filesink_open_resumable( filesink* f, const char* path, off_t offset, int flags );
+
+/**
+ * Discard everything written so far, including what the partial file contained
+ * when it got opened, and start over at the beginning of the file.
+ *
+ * Return Codes:
+ *   FS_OK
+ *   FS_ERROR
+ */
+int filesink_restart( filesink* f );
+
+/**
+ * Returns the size the file will have once the buffered data is written out.
+ */
+off_t filesink_size( const filesink* f );
+
+/**
+ * Read the first _length_ bytes of the file as written so far back in, handing
+ * them to _consume_ along with _arg_ a chunk at a time. Used to carry a digest
+ * over what a resumed download had before, and to digest a file downloaded in
+ * ranges. Data still in the buffer is not read back.
+ *
+ * Return Codes:
+ *   FS_OK
+ *   FS_ERROR (errno is set)
+ */
+int filesink_read_back( const filesink* f, off_t length,
+                        void (*consume)( void* arg, const void* data, size_t length ), void* arg );
+
+/**
+ * Reserve _size_ bytes of disk space for the file, typically taken from the
+ * Content-Length of the response. This is only a hint, so file systems which
+ * cannot preallocate are not treated as an error.
+ */
+void filesink_preallocate( filesink* f, off_t size );
+
+/**
+ * Set the modification time the file gets when it is committed, typically
+ * the Last-Modified date of the response. Only applies to regular files.
+ */
+void filesink_set_mtime( filesink* f, time_t mtime );
+
+/**
+ * Append _length_ bytes from _src_ to the file. The data is buffered and
+ * written out once the buffer fills up.
+ *
+ * Return Codes:
+ *   FS_OK
+ *   FS_ERROR
+ */
+int filesink_write( filesink* f, const void* src, size_t length );
+
+/**
+ * Write _length_ bytes from _src_ at _offset_ in the file right away, bypassing
+ * the buffer. This is used for downloading several ranges of a file at once,
+ * and must not be mixed with `filesink_write`. Only works for regular files.
+ *
+ * Return Codes:
+ *   FS_OK
+ *   FS_ERROR
+ */
+int filesink_write_at( filesink* f, off_t offset, const void* src, size_t length );
+
+/**
+ * Make a write which waits for a full pipe or socket to become writable give
+ * up with ECANCELED. Can be called from another thread.
+ */
+void filesink_cancel( filesink* f );
+
+/**
+ * Write out any buffered data, trim any preallocated space which did not get
+ * used, sync the file if FS_FSYNC was given and move the temporary file over
+ * the destination path. A file which exists at the destination already passes
+ * its permissions on to the one replacing it. The sink is closed afterwards,
+ * also on failure. A sink
+ * opened with `filesink_open_fd` leaves the descriptor open.
+ *
+ * Return Codes:
+ *   FS_OK
+ *   FS_ERROR
+ */
+int filesink_commit( filesink* f );
+
+/**
+ * Close the file sink, discarding the temporary file. The destination path
+ * is left untouched. A resumable sink writes out its buffer and keeps the
+ * partial file instead, unless it is empty. A sink opened with `filesink_open_fd`
+ * drops its buffer and leaves the descriptor open. Does nothing if the sink is
+ * not open.
+ */
+void filesink_abort( filesink* f );
+
+/**
+ * Create the file _dst_ as a copy of _src_ which shares its data on disk (a
+ * reflink), so that no data gets copied. Only some file systems support this,
+ * and only within the same file system. _dst_ must not exist yet.
+ *
+ * Return Codes:
+ *   FS_OK
+ *   FS_ERROR (errno is set)
+ */
+int filesink_clone( const char* src, const char* dst );
+
+#endif
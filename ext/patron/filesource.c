@@ -0,0 +1,102 @@
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "filesource.h"
+
+/* How far ahead of the upload the kernel is asked to read the file */
+#define FSRC_READAHEAD  (8 * FSRC_READ_SIZE)
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC 0
+#endif
+
+static int filesource_fail( filesource* s, int error ) {
+  if (0 == s->error) { s->error = error; }
+  return FSRC_ERROR;
+}
+
+/* Asks the kernel to start reading the part of the file which is going to be needed next */
+static void filesource_readahead( filesource* s ) {
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_WILLNEED)
+  if (s->advised >= s->size || s->offset + FSRC_READAHEAD / 2 < s->advised) { return; }
+  if (s->advised < s->offset) { s->advised = s->offset; }
+  posix_fadvise(s->fd, s->advised, FSRC_READAHEAD, POSIX_FADV_WILLNEED);
+  s->advised += FSRC_READAHEAD;
+#else
+  (void) s;
+#endif
+}
+
+void filesource_init( filesource* s ) {
+  assert(NULL != s);
+
+  memset(s, 0, sizeof(*s));
+  s->fd = -1;
+}
+
+int filesource_is_open( const filesource* s ) {
+  return s->fd >= 0;
+}
+
+int filesource_open( filesource* s, const char* path ) {
+  struct stat st;
+
+  assert(NULL != s && NULL != path);
+  filesource_init(s);
+
+  s->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (s->fd < 0) { return filesource_fail(s, errno); }
+  if (0 != fstat(s->fd, &st)) {
+    int error = errno;
+    filesource_close(s);
+    return filesource_fail(s, error);
+  }
+  s->size = st.st_size;
+
+#if defined(HAVE_POSIX_FADVISE) && defined(POSIX_FADV_SEQUENTIAL)
+  posix_fadvise(s->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  filesource_readahead(s);
+  return FSRC_OK;
+}
+
+size_t filesource_read( filesource* s, void* dst, size_t length ) {
+  char* buf = dst;
+  size_t total = 0;
+
+  assert(filesource_is_open(s));
+  while (total < length) {
+    ssize_t got = pread(s->fd, buf + total, length - total, s->offset);
+    if (got < 0) {
+      if (EINTR == errno) { continue; }
+      filesource_fail(s, errno);
+      return 0;
+    }
+    if (0 == got) { break; }
+    total += (size_t) got;
+    s->offset += got;
+  }
+  filesource_readahead(s);
+  return total;
+}
+
+int filesource_seek( filesource* s, off_t offset ) {
+  assert(filesource_is_open(s));
+
+  if (offset < 0) { return filesource_fail(s, EINVAL); }
+  s->offset = offset;
+  s->advised = offset;
+  filesource_readahead(s);
+  return FSRC_OK;
+}
+
+void filesource_close( filesource* s ) {
+  if (!filesource_is_open(s)) { return; }
+
+  close(s->fd);
+  s->fd = -1;
+}
@@ -0,0 +1,73 @@
+
+#ifndef PATRON_FILESOURCE_H
+#define PATRON_FILESOURCE_H
+
+#include <stdlib.h>
+#include <sys/types.h>
+
+#define FSRC_OK     0
+#define FSRC_ERROR  1
+
+/* The size of the reads libCURL gets asked to make, see CURLOPT_UPLOAD_BUFFERSIZE */
+#define FSRC_READ_SIZE  (1024 * 1024)
+
+/**
+ * Implementation of an upload source which reads a request body from a file.
+ * The data is read with `pread` straight into the buffer libCURL passes to
+ * the read callback, without going through a stdio buffer. The kernel gets
+ * told that the file is read sequentially, and is asked to read ahead of the
+ * upload so that reading does not stall the transfer.
+ *
+ * On failure the functions store the errno in _error_.
+ */
+typedef struct {
+  int      fd;
+  int      error;
+  off_t    size;
+  off_t    offset;
+  off_t    advised;
+} filesource;
+
+/**
+ * Initialize the file source so that it is not open. A source needs to be
+ * initialized once before being used with `filesource_open`.
+ */
+void filesource_init( filesource* s );
+
+/**
+ * Returns non-zero if the file source has been opened and not yet closed.
+ */
+int filesource_is_open( const filesource* s );
+
+/**
+ * Open the file at _path_ for reading. The size of the file is stored in
+ * _size_.
+ *
+ * Return Codes:
+ *   FSRC_OK
+ *   FSRC_ERROR
+ */
+int filesource_open( filesource* s, const char* path );
+
+/**
+ * Read up to _length_ bytes into _dst_. Returns the number of bytes read, which
+ * is only less than _length_ at the end of the file. On failure 0 is returned
+ * and the errno is stored in _error_.
+ */
+size_t filesource_read( filesource* s, void* dst, size_t length );
+
+/**
+ * Continue reading at _offset_, for when libCURL needs to send the body again.
+ *
+ * Return Codes:
+ *   FSRC_OK
+ *   FSRC_ERROR
+ */
+int filesource_seek( filesource* s, off_t offset );
+
+/**
+ * Close the file source. Does nothing if the source is not open.
+ */
+void filesource_close( filesource* s );
+
+#endif
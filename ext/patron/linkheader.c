@@ -0,0 +1,155 @@
+
+#include <ruby.h>
+#include <ctype.h>
+#include <string.h>
+#include <strings.h>
+#include "linkheader.h"
+
+/* Precedes the relation type and target of every link in the links buffer */
+typedef struct {
+  size_t  rel_length;
+  size_t  target_length;
+} link_entry;
+
+static int linkheader_is_space( char c ) {
+  return ' ' == c || '\t' == c || '\r' == c || '\n' == c;
+}
+
+static const char* linkheader_skip_space( const char* p, const char* end ) {
+  while (p < end && linkheader_is_space(*p)) { p++; }
+  return p;
+}
+
+/* Adds an entry for each of the space separated relation types in _rels_ */
+static int linkheader_add( membuffer* links, const char* rels, size_t rels_length,
+                           const char* target, size_t target_length ) {
+  const char* p = rels;
+  const char* end = rels + rels_length;
+  link_entry entry;
+
+  while (p < end) {
+    const char* rel;
+    size_t start, i;
+
+    p = linkheader_skip_space(p, end);
+    rel = p;
+    while (p < end && !linkheader_is_space(*p)) { p++; }
+    if (p == rel) { break; }
+
+    entry.rel_length = p - rel;
+    entry.target_length = target_length;
+    start = links->length + sizeof(entry);
+    if (MB_OK != membuffer_append(links, &entry, sizeof(entry)) ||
+        MB_OK != membuffer_append(links, rel, entry.rel_length) ||
+        MB_OK != membuffer_append(links, target, target_length)) {
+      return LINKHEADER_OUT_OF_MEMORY;
+    }
+    /* Relation types are compared case-insensitively */
+    for (i = 0; i < entry.rel_length; i++) {
+      links->buf[start + i] = tolower((unsigned char) links->buf[start + i]);
+    }
+  }
+  return LINKHEADER_OK;
+}
+
+/* Reads the value of a link parameter at _p_, which can be a quoted string, and returns the end of it */
+static const char* linkheader_value( const char* p, const char* end, const char** value, size_t* length ) {
+  if (p < end && '"' == *p) {
+    *value = ++p;
+    while (p < end && '"' != *p) {
+      if ('\\' == *p && p + 1 < end) { p++; }
+      p++;
+    }
+    *length = p - *value;
+    return p < end ? p + 1 : p;
+  }
+
+  *value = p;
+  while (p < end && ';' != *p && ',' != *p && !linkheader_is_space(*p)) { p++; }
+  *length = p - *value;
+  return p;
+}
+
+int linkheader_line( membuffer* links, const char* line, size_t length ) {
+  const char* end = line + length;
+  const char* p;
+
+  if (length >= 5 && 0 == strncmp(line, "HTTP/", 5)) {
+    /* The status line of the next response */
+    membuffer_clear(links);
+    return LINKHEADER_OK;
+  }
+  if (length < 5 || 0 != strncasecmp(line, "Link:", 5)) { return LINKHEADER_OK; }
+
+  p = line + 5;
+  while (p < end) {
+    const char* target;
+    size_t target_length;
+    const char* rels = NULL;
+    size_t rels_length = 0;
+
+    p = linkheader_skip_space(p, end);
+    if (p == end) { break; }
+    if (',' == *p) {
+      p++;
+      continue;
+    }
+    if ('<' != *p) {
+      /* Not a link, skip to the next one */
+      p = memchr(p, ',', end - p);
+      if (NULL == p) { break; }
+      continue;
+    }
+
+    target = ++p;
+    p = memchr(p, '>', end - p);
+    if (NULL == p) { break; }
+    target_length = p - target;
+    p++;
+
+    /* The parameters of the link, of which only the first "rel" counts */
+    for (;;) {
+      const char* name;
+      size_t name_length;
+      const char* value = NULL;
+      size_t value_length = 0;
+
+      p = linkheader_skip_space(p, end);
+      if (p == end || ';' != *p) { break; }
+      p = linkheader_skip_space(p + 1, end);
+      name = p;
+      while (p < end && '=' != *p && ';' != *p && ',' != *p && !linkheader_is_space(*p)) { p++; }
+      name_length = p - name;
+      p = linkheader_skip_space(p, end);
+      if (p < end && '=' == *p) {
+        p = linkheader_value(linkheader_skip_space(p + 1, end), end, &value, &value_length);
+      }
+      if (NULL == rels && NULL != value && 3 == name_length && 0 == strncasecmp(name, "rel", 3)) {
+        rels = value;
+        rels_length = value_length;
+      }
+    }
+
+    if (NULL != rels && LINKHEADER_OK != linkheader_add(links, rels, rels_length, target, target_length)) {
+      return LINKHEADER_OUT_OF_MEMORY;
+    }
+    /* Anything else up to the next link is skipped */
+    while (p < end && ',' != *p) { p++; }
+  }
+  return LINKHEADER_OK;
+}
+
+int linkheader_next( const membuffer* links, size_t* offset, linkheader_link* link ) {
+  link_entry entry;
+
+  if (*offset + sizeof(entry) > links->length) { return 0; }
+
+  memcpy(&entry, links->buf + *offset, sizeof(entry));
+  link->rel = links->buf + *offset + sizeof(entry);
+  link->rel_length = entry.rel_length;
+  link->target = link->rel + entry.rel_length;
+  link->target_length = entry.target_length;
+
+  *offset += sizeof(entry) + entry.rel_length + entry.target_length;
+  return 1;
+}
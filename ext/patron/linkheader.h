@@ -0,0 +1,52 @@
+
+#ifndef PATRON_LINKHEADER_H
+#define PATRON_LINKHEADER_H
+
+#include <stdlib.h>
+#include "membuffer.h"
+
+#define LINKHEADER_OK             0
+#define LINKHEADER_OUT_OF_MEMORY  1
+
+/**
+ * Collection of the links of a response from its Link headers (RFC 8288),
+ * like the `<https://api.example.com/items?page=2>; rel="next"` with which
+ * paginated APIs point to their next page. The header lines are fed in as
+ * libCURL hands them to the header callback, so the links of a response are
+ * known as soon as its headers are in.
+ *
+ * Every relation type of a link becomes its own entry in the _links_ buffer,
+ * with the relation type in lowercase and the target as it was given, which
+ * can be relative to the URL of the response. The status line of a following
+ * response, like the one after a redirect, discards the links collected so
+ * far.
+ */
+
+/**
+ * A link taken out of the links buffer. The fields point into the buffer and
+ * stay valid until it gets changed.
+ */
+typedef struct {
+  const char*  rel;
+  size_t       rel_length;
+  const char*  target;
+  size_t       target_length;
+} linkheader_link;
+
+/**
+ * Feed a header line of _length_ bytes, as received, into the _links_ buffer.
+ * Lines other than status lines and Link headers are skipped.
+ *
+ * Return Codes:
+ *   LINKHEADER_OK
+ *   LINKHEADER_OUT_OF_MEMORY
+ */
+int linkheader_line( membuffer* links, const char* line, size_t length );
+
+/**
+ * Read the link at _offset_ into _link_ and advance _offset_ past it. Start
+ * with an _offset_ of 0. Returns 0 once there are no more links.
+ */
+int linkheader_next( const membuffer* links, size_t* offset, linkheader_link* link );
+
+#endif
@@ -67,12 +67,16 @@ int membuffer_insert( membuffer* m, size_t index, const void* src, size_t length
  */
 int membuffer_append( membuffer* m, const void* src, size_t length );
 
+#ifdef RUBY_RUBY_H
+/* Only where ruby.h is included, so that the modules which run without the GVL need not include it */
+
 /**
  * Convert the memory buffer into a Ruby String instance. This method will
  * return an empty String instance if the memory buffer is empty. This method
  * will never return Qnil.
  */
 VALUE membuffer_to_rb_str( membuffer* m );
+#endif
 
 #endif
 
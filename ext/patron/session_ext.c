@@ -1,18 +1,49 @@
 #include <ruby.h>
 #include <ruby/thread.h>
+#include <ruby/thread_native.h>
+#include <assert.h>
+#include <ctype.h>
+#include <strings.h>
 #include <sys/stat.h>
 #include <curl/curl.h>
 #include "membuffer.h"
-#include "sglib.h"  /* Simple Generic Library -> http://sglib.sourceforge.net */
+#include "escape.h"
+#include "filesink.h"
+#include "filesource.h"
+#include "digest.h"
+#include "compressor.h"
+#include "decompressor.h"
+#include "eventstream.h"
+#include "linkheader.h"
 
 #define UNUSED_ARGUMENT(x) (void)x
 #define INTERRUPT_ABORT 1
 #define INTERRUPT_DOWNLOAD_OVERFLOW 2
+#define INTERRUPT_DECOMPRESSED_OVERFLOW 3
+#define INTERRUPT_HEADERS_REJECTED 4
+
+/* Why the headers of a response were rejected */
+#define REJECTED_STATUS   1  /* by fail_on_status */
+#define REJECTED_LENGTH   2  /* by max_content_length */
+#define REJECTED_CALLBACK 3  /* by the on_headers proc */
+
+/* Segmented downloads: the smallest range worth its own connection, and how many
+   times a single range gets retried before the whole download fails */
+#define SEGMENT_MIN_SIZE (1024 * 1024)
+#define SEGMENT_ATTEMPTS 3
+
+/* Resumable downloads keep the validator and the size of the file next to the partial file */
+#define RESUME_METADATA_SUFFIX ".meta"
+#define RESUME_BODY_REPLACES 0  /* the body is the whole file */
+#define RESUME_BODY_DISCARD  1  /* the body is an error page, which is not a part of the file */
+#define RESUME_BODY_APPENDS  2  /* the body continues the partial file */
 
 static VALUE mPatron = Qnil;
 static VALUE mProxyType = Qnil;
+static VALUE mUtil = Qnil;
 static VALUE cSession = Qnil;
 static VALUE cRequest = Qnil;
+static VALUE cDownloadCache = Qnil;
 static VALUE ePatronError = Qnil;
 static VALUE eUnsupportedProtocol = Qnil;
 static VALUE eUnsupportedSSLVersion = Qnil;
@@ -24,28 +55,136 @@ static VALUE ePartialFileError = Qnil;
 static VALUE eTimeoutError = Qnil;
 static VALUE eTooManyRedirects = Qnil;
 static VALUE eAborted = Qnil;
+static VALUE eDigestMismatch = Qnil;
+static VALUE eResponseRejected = Qnil;
+
+struct patron_curl_state;
+
+/* A request body, or a part of one, which gets sent straight from the memory of a frozen Ruby String */
+struct string_source {
+  const char* ptr;
+  size_t length;
+  size_t offset;
+};
+
+/* A request body, or a part of one, which gets read from a Ruby IO while the request is sent */
+struct io_source {
+  struct patron_curl_state* state;
+  VALUE io;
+  VALUE buffer;       /* the String the IO reads into, reused for every read */
+  int seekable;
+  curl_off_t start;   /* the position of the IO when the request was set up */
+  curl_off_t offset;  /* where to seek to, relative to the start */
+  char* dst;
+  size_t length;
+  size_t result;
+};
 
 struct patron_curl_state {
+  /* Links in the registry of live sessions, see cs_list_append */
+  struct patron_curl_state* prev;
+  struct patron_curl_state* next;
+  int in_flight;
   CURL* handle;
   CURL* base_handle;
   CURLSH* share;
   char* upload_buf;
-  FILE* download_file;
+  filesink download_sink;
+  curl_off_t resume_from;
+  int resume_body;
+  int keep_filetime;
+  digest body_digest;
+  digest_expectation body_expected;
+  int content_digest_pending;  /* the digest headers of the response still need to be looked at */
+  digest upload_digest;
   FILE* debug_file;
-  FILE* request_body_file;
+  filesource upload_source;
+  struct string_source upload_string;
+  struct io_source upload_io;
+  compressor upload_compressor;
+  curl_read_callback upload_read;  /* reads the request body for the upload_compressor and upload_digest */
+  curl_seek_callback upload_seek;
+  void* upload_arg;
   char error_buf[CURL_ERROR_SIZE];
   struct curl_slist* headers;
+#if LIBCURL_VERSION_NUM >= 0x073800
+  /* this is libCURLv7.56.0 or later, supports the MIME API */
+  curl_mime* mime;
+#else
   struct curl_httppost* post;
   struct curl_httppost* last;
+#endif
+  VALUE upload_values;  /* the Strings and IOs a request body, multipart or not, gets read from */
   membuffer header_buffer;
+  membuffer links;       /* the links of the Link headers of the last response */
   membuffer body_buffer;
   size_t download_byte_limit;
+  size_t decompressed_byte_limit;
+  int keep_content_encoding;  /* the body is kept encoded, to be decoded by Response#body */
+  size_t body_bytes;
   VALUE user_progress_blk;
+  VALUE on_headers_blk;
+  VALUE stream_blk;      /* the block the records of a streamed body are handed to */
+  eventstream stream;
+  int streaming;         /* -1 until the status of the response tells whether its body gets streamed */
+  VALUE self;  /* the Session, to build the Response handed to the on_headers proc */
+  int check_headers;     /* whether the headers of the final response need to be looked at */
+  int follow_redirects;
+  unsigned char fail_on_status[125];  /* a bit for each of the status codes 0 to 999 */
+  curl_off_t max_content_length;      /* -1 for no limit */
+  int headers_rejected;  /* one of the REJECTED_ reasons */
   int interrupt;
   size_t dltotal;
   size_t dlnow;
   size_t ultotal;
   size_t ulnow;
+  curl_off_t progress_interval_us;
+  size_t progress_bytes;
+  curl_off_t progress_reported_at_us;
+  size_t progress_reported_bytes;
+  size_t progress_reported_dlnow;
+  unsigned long progress_delivered;
+  unsigned long progress_suppressed;
+  int callback_exception_tag;
+#if LIBCURL_VERSION_NUM >= 0x073F00
+  /* this is libCURLv7.63.0 or later, supports the URL API and CURLOPT_CURLU */
+  CURLU* base_url;
+  VALUE base_url_str;
+  CURLU* url;
+  VALUE url_str;
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074400
+  /* this is libCURLv7.68.0 or later, supports curl_multi_poll and curl_multi_wakeup */
+  CURLM* multi;
+#endif
+  struct download_segment* segments;
+  int segment_count;
+  struct concurrent_transfer* transfers;
+  int transfer_count;
+};
+
+/* One byte range of a segmented download, fetched on its own easy handle */
+struct download_segment {
+  struct patron_curl_state* state;
+  CURL* handle;
+  curl_off_t from;  /* the next byte to receive */
+  curl_off_t to;    /* the last byte of the range */
+  int attempts;
+  int checked;      /* whether the response status of the current attempt has been checked */
+};
+
+/* One of several requests run concurrently on the multi handle, each on its own easy handle
+   with its own response. They all send the request body from the same memory. */
+struct concurrent_transfer {
+  struct patron_curl_state* state;
+  CURL* handle;
+  membuffer header_buffer;
+  membuffer links;
+  membuffer body_buffer;
+  struct curl_slist* headers;  /* the request headers, when the transfer has headers of its own */
+  CURLcode code;
+  int interrupt;    /* the INTERRUPT_ reason if a limit of the request stopped the transfer */
+  char error_buf[CURL_ERROR_SIZE];
 };
 
 
@@ -63,29 +202,590 @@ static size_t session_write_handler(char* stream, size_t size, size_t nmemb, mem
   return size * nmemb;
 }
 
-/* Used as WRITEFUNCTION for file downloads (required on Windows) */
-static size_t file_write_handler(void* stream, size_t size, size_t nmemb, FILE* fp) {
-  fwrite(stream, size, nmemb, fp);
-  if (ferror(fp)) {
-    return 0;
+/* Checks the response body limits once _body_bytes_ have been written out for the transfer on
+ * _curl_. The download_byte_limit applies to the bytes received from the server, which differ
+ * from the bytes written when libCURL decodes the Content-Encoding - those are limited by the
+ * decompressed_byte_limit. Returns the INTERRUPT_ reason for the limit which got crossed, or 0.
+ */
+static int body_limit_reached(struct patron_curl_state* state, CURL* curl, size_t body_bytes) {
+  if (state->decompressed_byte_limit && body_bytes > state->decompressed_byte_limit) {
+    return INTERRUPT_DECOMPRESSED_OVERFLOW;
+  }
+  if (state->download_byte_limit) {
+#if LIBCURL_VERSION_NUM >= 0x073700
+    /* this is libCURLv7.55.0 or later, supports CURLINFO_SIZE_DOWNLOAD_T */
+    curl_off_t received = 0;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+#else
+    double received = 0;
+    curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &received);
+#endif
+    if ((size_t) received > state->download_byte_limit) {
+      return INTERRUPT_DOWNLOAD_OVERFLOW;
+    }
+  }
+  return 0;
+}
+
+/* Checks the response body limits before _len_ more bytes get written out. Sets the interrupt and
+ * returns non-zero once either limit gets crossed, so that the transfer stops right there instead
+ * of streaming on until libCURL next reports progress.
+ */
+static int body_limit_exceeded(struct patron_curl_state* state, size_t len) {
+  int reason;
+
+  state->body_bytes += len;
+  reason = body_limit_reached(state, state->handle, state->body_bytes);
+  if (reason) {
+    state->interrupt = reason;
+    return 1;
+  }
+  return 0;
+}
+
+/* Returns the value of the header _name_ in the last response of the headers collected so far, with
+ * its length in _length_, or NULL if that response does not have the header. The header buffer has the
+ * headers of every response received for the request, like those of redirects and of interim responses.
+ */
+static const char* find_header(const membuffer* headers, const char* name, size_t* length) {
+  const char* line = headers->buf;
+  const char* end = line + headers->length;
+  const char* found = NULL;
+  size_t name_length = strlen(name);
+
+  while (line < end) {
+    const char* line_end = memchr(line, '\n', end - line);
+    if (NULL == line_end) { line_end = end; }
+    if (line_end - line >= 5 && 0 == strncmp(line, "HTTP/", 5)) {
+      /* The status line of the next response */
+      found = NULL;
+    } else if ((size_t) (line_end - line) > name_length && ':' == line[name_length] &&
+               0 == strncasecmp(line, name, name_length)) {
+      const char* value = line + name_length + 1;
+      const char* value_end = line_end;
+      while (value < value_end && isspace((unsigned char) *value)) { value++; }
+      while (value_end > value && isspace((unsigned char) value_end[-1])) { value_end--; }
+      found = value;
+      *length = value_end - value;
+    }
+    line = line_end + 1;
+  }
+  return found;
+}
+
+/* Takes the expected digests of the body from the Digest, Content-Digest and Content-MD5 headers
+ * of the last response received, and starts computing those digests. Called once all of the headers
+ * are in, before the first byte of the body. The headers describe the body as it was sent, so with a
+ * Content-Encoding nothing is taken from them.
+ */
+static void expect_content_digest(struct patron_curl_state* state) {
+  digest_expectation found;
+  const char* value;
+  size_t length = 0;
+
+  state->content_digest_pending = 0;
+  value = find_header(&state->header_buffer, "Content-Encoding", &length);
+  if (NULL != value && !(8 == length && 0 == strncasecmp(value, "identity", 8))) { return; }
+
+  digest_expect_none(&found);
+  if (NULL != (value = find_header(&state->header_buffer, "Content-MD5", &length))) {
+    digest_expect_base64(&found, DIGEST_MD5, value, length);
+  }
+  if (NULL != (value = find_header(&state->header_buffer, "Digest", &length))) {
+    digest_expect_header(&found, value, length);
+  }
+  if (NULL != (value = find_header(&state->header_buffer, "Content-Digest", &length))) {
+    digest_expect_header(&found, value, length);
+  }
+  if (DIGEST_NONE == found.types) { return; }
+
+  digest_expect_merge(&state->body_expected, &found);
+  /* Nothing has been added to the digests yet, so they can start over with more types */
+  digest_init(&state->body_digest, state->body_digest.types | found.types);
+}
+
+static int status_fails(struct patron_curl_state* state, long status) {
+  return status >= 0 && status < 1000 && (state->fail_on_status[status / 8] & (1 << (status % 8)));
+}
+
+/* Whether the response of _status_ is the one the request ends with, rather than an interim
+   response or a redirect which libCURL is going to follow */
+static int final_response(struct patron_curl_state* state, long status) {
+  size_t length;
+
+  if (status < 200) { return 0; }
+  if (state->follow_redirects && (301 == status || 302 == status || 303 == status || 307 == status || 308 == status)) {
+    return NULL == find_header(&state->header_buffer, "Location", &length);
+  }
+  return 1;
+}
+
+static VALUE create_response(VALUE self, CURL* curl, VALUE header_buffer, VALUE body_buffer, const membuffer* links);
+
+static VALUE call_on_headers_blk_protected(VALUE vd_curl_state) {
+  struct patron_curl_state* state = (struct patron_curl_state*) vd_curl_state;
+  VALUE response = create_response(state->self, state->handle, membuffer_to_rb_str(&state->header_buffer), Qnil, &state->links);
+  return rb_funcall(state->on_headers_blk, rb_intern("call"), 1, response);
+}
+
+/* Calls the on_headers proc with the GVL held, see call_user_rb_progress_blk */
+static void *call_on_headers_blk(void *vd_curl_state) {
+  struct patron_curl_state* state = (struct patron_curl_state*) vd_curl_state;
+  VALUE retval = rb_protect(call_on_headers_blk_protected, (VALUE) state, &state->callback_exception_tag);
+
+  if (!state->callback_exception_tag && retval == ID2SYM(rb_intern("abort"))) {
+    state->headers_rejected = REJECTED_CALLBACK;
+  }
+  return NULL;
+}
+
+/* Looks at the headers of the final response before any of its body is received. The fail_on_status
+   and max_content_length checks run without the GVL, which only gets acquired for the on_headers proc. */
+static void check_headers(struct patron_curl_state* state) {
+  long status = 0;
+
+  curl_easy_getinfo(state->handle, CURLINFO_RESPONSE_CODE, &status);
+  if (!final_response(state, status)) { return; }
+  /* Trailers of a chunked response end with an empty line too */
+  state->check_headers = 0;
+
+  if (status_fails(state, status)) {
+    state->headers_rejected = REJECTED_STATUS;
+    return;
+  }
+  if (state->max_content_length >= 0) {
+#if LIBCURL_VERSION_NUM >= 0x073700
+    /* this is libCURLv7.55.0 or later, supports CURLINFO_CONTENT_LENGTH_DOWNLOAD_T */
+    curl_off_t content_length = -1;
+    curl_easy_getinfo(state->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+#else
+    double content_length = -1;
+    curl_easy_getinfo(state->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &content_length);
+#endif
+    if (content_length > state->max_content_length) {
+      state->headers_rejected = REJECTED_LENGTH;
+      return;
+    }
+  }
+  if (RTEST(state->on_headers_blk)) {
+    rb_thread_call_with_gvl(call_on_headers_blk, state);
+  }
+}
+
+/* Collects the response headers into the header buffer, and checks them once the headers of the final
+   response are complete. Returning 0 aborts the transfer before the body of a rejected response. */
+static size_t session_header_handler(char* stream, size_t size, size_t nmemb, void* clientp) {
+  struct patron_curl_state* state = (struct patron_curl_state*) clientp;
+  size_t len = session_write_handler(stream, size, nmemb, &state->header_buffer);
+
+  if (LINKHEADER_OK != linkheader_line(&state->links, stream, len)) { return 0; }
+
+  if (state->check_headers && ((2 == len && '\r' == stream[0]) || (1 == len && '\n' == stream[0]))) {
+    check_headers(state);
+    if (state->headers_rejected || state->callback_exception_tag) {
+      state->interrupt = INTERRUPT_HEADERS_REJECTED;
+      return 0;
+    }
+  }
+  return len;
+}
+
+/* Hands the records collected from the streamed body to the stream block. Called with the GVL. */
+static VALUE stream_records_to_blk(VALUE vd_curl_state) {
+  struct patron_curl_state* state = (struct patron_curl_state*) vd_curl_state;
+  eventstream_record record;
+  size_t offset = 0;
+  ID call = rb_intern("call");
+
+  while (eventstream_next(&state->stream, &offset, &record)) {
+    VALUE data = rb_utf8_str_new(record.data, record.data_length);
+    if (EVENTSTREAM_EVENTS == state->stream.mode) {
+      rb_funcall(state->stream_blk, call, 4, rb_utf8_str_new(record.type, record.type_length), data,
+                 rb_utf8_str_new(record.id, record.id_length), record.retry < 0 ? Qnil : LONG2NUM(record.retry));
+    } else {
+      rb_funcall(state->stream_blk, call, 1, data);
+    }
+  }
+  return Qnil;
+}
+
+/* Calls the stream block with the GVL held, see call_user_rb_progress_blk */
+static void *call_stream_blk(void *vd_curl_state) {
+  struct patron_curl_state* state = (struct patron_curl_state*) vd_curl_state;
+
+  rb_protect(stream_records_to_blk, (VALUE) state, &state->callback_exception_tag);
+  eventstream_clear(&state->stream);
+  if (state->callback_exception_tag) {
+    state->interrupt = INTERRUPT_ABORT;
+  }
+  return NULL;
+}
+
+/* Tells whether the body gets streamed to the stream block. Only the body of a successful response
+   is, the body of an error response gets collected as usual. */
+static int stream_body(struct patron_curl_state* state) {
+  if (!state->stream.mode) { return 0; }
+  if (state->streaming < 0) {
+    long status = 0;
+    curl_easy_getinfo(state->handle, CURLINFO_RESPONSE_CODE, &status);
+    state->streaming = 2 == status / 100;
+  }
+  return state->streaming;
+}
+
+/* Frames the streamed body, and hands the records which are complete to the stream block.
+   The GVL is only acquired when a chunk completes at least one record. */
+static size_t stream_write(struct patron_curl_state* state, char* data, size_t len) {
+  if (EVENTSTREAM_OK != eventstream_feed(&state->stream, data, len)) { return 0; }
+  if (state->stream.record_count > 0) {
+    rb_thread_call_with_gvl(call_stream_blk, state);
+    if (state->callback_exception_tag) { return 0; }
+  }
+  return len;
+}
+
+/* Takes the response body streamed from libcurl and writes it to the body buffer. */
+static size_t session_body_write_handler(char* stream, size_t size, size_t nmemb, void* clientp) {
+  struct patron_curl_state* state = (struct patron_curl_state*) clientp;
+
+  /* returning 0 aborts the transfer */
+  if (body_limit_exceeded(state, size * nmemb)) { return 0; }
+  if (stream_body(state)) { return stream_write(state, stream, size * nmemb); }
+  if (state->content_digest_pending) { expect_content_digest(state); }
+  digest_update(&state->body_digest, stream, size * nmemb);
+  return session_write_handler(stream, size, nmemb, &state->body_buffer);
+}
+
+/* Returns the path of the file with the metadata for resuming the download, to be freed by the caller */
+static char* resume_metadata_path(filesink* sink) {
+  size_t size = strlen(sink->tmp_path) + sizeof(RESUME_METADATA_SUFFIX);
+  char* path = malloc(size);
+  if (path) { snprintf(path, size, "%s%s", sink->tmp_path, RESUME_METADATA_SUFFIX); }
+  return path;
+}
+
+/* Stores the validator (a strong ETag, or the Last-Modified date) and the size of the file
+ * being downloaded next to the partial file, so that a later request can continue the
+ * download with If-Range. Without a validator the download cannot be resumed safely.
+ */
+static void resume_write_metadata(struct patron_curl_state* state, curl_off_t length) {
+  char* path = resume_metadata_path(&state->download_sink);
+  const char* validator = NULL;
+  FILE* fp = NULL;
+#if LIBCURL_VERSION_NUM >= 0x075300
+  /* this is libCURLv7.83.0 or later, supports curl_easy_header */
+  struct curl_header* header = NULL;
+
+  if (CURLHE_OK == curl_easy_header(state->handle, "ETag", 0, CURLH_HEADER, -1, &header) &&
+      0 != strncmp(header->value, "W/", 2)) {
+    validator = header->value;
+  } else if (CURLHE_OK == curl_easy_header(state->handle, "Last-Modified", 0, CURLH_HEADER, -1, &header)) {
+    validator = header->value;
+  }
+#endif
+
+  if (!path) { return; }
+  if (validator && (fp = fopen(path, "w"))) {
+    fprintf(fp, "%s\n%" CURL_FORMAT_CURL_OFF_T "\n", validator, length);
+    fclose(fp);
   } else {
-    /* Just always OK the write */
-    return size * nmemb;
+    unlink(path);
   }
+  free(path);
 }
 
-static void *call_user_rb_progress_blk(void *vd_curl_state) {
+/* Tells whether a resumed download has all of the file, going by the Content-Range of the response */
+static int resume_complete(struct patron_curl_state* state) {
+#if LIBCURL_VERSION_NUM >= 0x075300
+  /* this is libCURLv7.83.0 or later, supports curl_easy_header */
+  struct curl_header* header = NULL;
+  const char* total = NULL;
+
+  if (CURLHE_OK == curl_easy_header(state->handle, "Content-Range", 0, CURLH_HEADER, -1, &header) &&
+      (total = strchr(header->value, '/')) && '*' != total[1]) {
+    return strtoll(total + 1, NULL, 10) == (long long) filesink_size(&state->download_sink);
+  }
+#endif
+  return 1;
+}
+
+/* Adds data read back from a download to the digests of the body */
+static void digest_read_back(void* arg, const void* data, size_t length) {
+  digest_update((digest*) arg, data, length);
+}
+
+/* Decides what to do with the partial file once the status of the response is known,
+ * before the first byte of the body gets written, and sets resume_body accordingly.
+ */
+static int resume_start_body(struct patron_curl_state* state, curl_off_t content_length) {
+  long code = 0;
+
+  curl_easy_getinfo(state->handle, CURLINFO_RESPONSE_CODE, &code);
+  if (206 == code && state->resume_from > 0) {
+    /* The server continues where the partial file ends. The digests cover the whole file, so they
+       start with what the partial file has, while digest headers would only describe the range. */
+    state->resume_body = RESUME_BODY_APPENDS;
+    state->content_digest_pending = 0;
+    if (FS_OK != filesink_read_back(&state->download_sink, (off_t) state->resume_from,
+                                    digest_read_back, &state->body_digest)) {
+      return FS_ERROR;
+    }
+  } else if (code >= 200 && code < 300) {
+    /* The file has changed or the server does not do ranges, so it starts from scratch */
+    if (filesink_size(&state->download_sink) > 0 && FS_OK != filesink_restart(&state->download_sink)) {
+      return FS_ERROR;
+    }
+    resume_write_metadata(state, content_length);
+  } else {
+    /* An error page is not a part of the file */
+    state->resume_body = RESUME_BODY_DISCARD;
+  }
+  return FS_OK;
+}
+
+/* Used as WRITEFUNCTION for file downloads, writes the response body to the download sink */
+static size_t file_write_handler(void* stream, size_t size, size_t nmemb, void* clientp) {
+  struct patron_curl_state* state = (struct patron_curl_state*) clientp;
+  size_t len = size * nmemb;
+
+  if (body_limit_exceeded(state, len)) { return 0; }
+
+  /* On the first write of the body, reserve the space for all of it at once */
+  if (state->body_bytes == len) {
+#if LIBCURL_VERSION_NUM >= 0x073700
+    /* this is libCURLv7.55.0 or later, supports CURLINFO_CONTENT_LENGTH_DOWNLOAD_T */
+    curl_off_t content_length = -1;
+    curl_easy_getinfo(state->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &content_length);
+#else
+    double content_length = -1;
+    curl_easy_getinfo(state->handle, CURLINFO_CONTENT_LENGTH_DOWNLOAD, &content_length);
+#endif
+
+    if (state->resume_from >= 0) {
+      if (FS_OK != resume_start_body(state, content_length)) { return 0; }
+      if (RESUME_BODY_APPENDS == state->resume_body) {
+        content_length = content_length > 0 ? content_length + state->resume_from : -1;
+      }
+    }
+    if (content_length > 0) {
+      filesink_preallocate(&state->download_sink, (off_t) content_length);
+    }
+  }
+
+  if (RESUME_BODY_DISCARD == state->resume_body) { return len; }
+  if (state->content_digest_pending) { expect_content_digest(state); }
+  digest_update(&state->body_digest, stream, len);
+  if (FS_OK != filesink_write(&state->download_sink, stream, len)) {
+    return 0;
+  }
+  return len;
+}
+
+/* Used as READFUNCTION for file uploads, reads the request body straight into the buffer of libCURL */
+static size_t file_read_handler(char* buffer, size_t size, size_t nitems, void* clientp) {
+  struct patron_curl_state* state = (struct patron_curl_state*) clientp;
+  size_t len = filesource_read(&state->upload_source, buffer, size * nitems);
+
+  if (0 == len && state->upload_source.error) { return CURL_READFUNC_ABORT; }
+  return len;
+}
+
+/* Used as SEEKFUNCTION for file uploads, for sending the body again after a redirect or an auth challenge */
+static int file_seek_handler(void* clientp, curl_off_t offset, int origin) {
+  struct patron_curl_state* state = (struct patron_curl_state*) clientp;
+
+  if (SEEK_SET != origin) { return CURL_SEEKFUNC_CANTSEEK; }
+  return FSRC_OK == filesource_seek(&state->upload_source, (off_t) offset) ? CURL_SEEKFUNC_OK : CURL_SEEKFUNC_FAIL;
+}
+
+/* Used as READFUNCTION for request bodies and multipart parts sent from a String */
+static size_t string_source_read(char* buffer, size_t size, size_t nitems, void* arg) {
+  struct string_source* src = arg;
+  size_t len = src->length - src->offset;
+
+  if (len > size * nitems) { len = size * nitems; }
+  memcpy(buffer, src->ptr + src->offset, len);
+  src->offset += len;
+  return len;
+}
+
+static int string_source_seek(void* arg, curl_off_t offset, int origin) {
+  struct string_source* src = arg;
+
+  if (SEEK_SET != origin || offset < 0 || (size_t) offset > src->length) { return CURL_SEEKFUNC_FAIL; }
+  src->offset = (size_t) offset;
+  return CURL_SEEKFUNC_OK;
+}
+
+static VALUE io_source_read_protected(VALUE arg) {
+  struct io_source* src = (struct io_source*) arg;
+  VALUE chunk = rb_funcall(src->io, rb_intern("read"), 2, SIZET2NUM(src->length), src->buffer);
+
+  src->result = 0;
+  if (!NIL_P(chunk)) {
+    StringValue(chunk);
+    src->result = (size_t) RSTRING_LEN(chunk) < src->length ? (size_t) RSTRING_LEN(chunk) : src->length;
+    memcpy(src->dst, RSTRING_PTR(chunk), src->result);
+  }
+  return Qnil;
+}
+
+/* Reads from the IO with the GVL held. Like for the progress proc, an exception raised
+   by the IO aborts the request, and perform_request re-raises it. */
+static void *io_source_read_with_gvl(void* arg) {
+  struct io_source* src = arg;
+  struct patron_curl_state* state = src->state;
+
+  rb_protect(io_source_read_protected, (VALUE) src, &state->callback_exception_tag);
+  if (state->callback_exception_tag) {
+    state->interrupt = INTERRUPT_ABORT;
+    src->result = CURL_READFUNC_ABORT;
+  }
+  return NULL;
+}
+
+static size_t io_source_read(char* buffer, size_t size, size_t nitems, void* arg) {
+  struct io_source* src = arg;
+
+  /* Do not overwrite an exception which is still to be re-raised */
+  if (src->state->callback_exception_tag) { return CURL_READFUNC_ABORT; }
+
+  src->dst = buffer;
+  src->length = size * nitems;
+  rb_thread_call_with_gvl(io_source_read_with_gvl, src);
+  return src->result;
+}
+
+static VALUE io_source_seek_protected(VALUE arg) {
+  struct io_source* src = (struct io_source*) arg;
+  return rb_funcall(src->io, rb_intern("seek"), 1, LL2NUM(src->start + src->offset));
+}
+
+static void *io_source_seek_with_gvl(void* arg) {
+  struct io_source* src = arg;
+  int tag = 0;
+
+  rb_protect(io_source_seek_protected, (VALUE) src, &tag);
+  if (tag) { rb_set_errinfo(Qnil); }
+  src->result = tag ? CURL_SEEKFUNC_CANTSEEK : CURL_SEEKFUNC_OK;
+  return NULL;
+}
+
+/* For sending the part again after a redirect or an auth challenge */
+static int io_source_seek(void* arg, curl_off_t offset, int origin) {
+  struct io_source* src = arg;
+
+  if (SEEK_SET != origin || !src->seekable) { return CURL_SEEKFUNC_CANTSEEK; }
+  src->offset = offset;
+  rb_thread_call_with_gvl(io_source_seek_with_gvl, src);
+  return (int) src->result;
+}
+
+/* Reads the request body from the source given to set_upload_source, adding it to the upload_digest */
+static size_t upload_source_read(void* arg, char* dst, size_t length) {
+  struct patron_curl_state* state = (struct patron_curl_state*) arg;
+  size_t len = state->upload_read(dst, 1, length, state->upload_arg);
+
+  /* anything larger than asked for is CURL_READFUNC_ABORT or CURL_READFUNC_PAUSE */
+  if (len <= length) { digest_update(&state->upload_digest, dst, len); }
+  return len;
+}
+
+/* Used as READFUNCTION for request bodies which get compressed or digested while libCURL sends them */
+static size_t upload_read_handler(char* buffer, size_t size, size_t nitems, void* clientp) {
+  struct patron_curl_state* state = (struct patron_curl_state*) clientp;
+  size_t len;
+
+  if (COMPRESS_NONE == state->upload_compressor.type) {
+    return upload_source_read(state, buffer, size * nitems);
+  }
+  len = compressor_read(&state->upload_compressor, &upload_source_read, state, buffer, size * nitems);
+  return COMPRESSOR_READ_ERROR == len ? CURL_READFUNC_ABORT : len;
+}
+
+/* Used as SEEKFUNCTION for request bodies which get compressed or digested, which can only be sent again from the start */
+static int upload_seek_handler(void* clientp, curl_off_t offset, int origin) {
+  struct patron_curl_state* state = (struct patron_curl_state*) clientp;
+  int rc;
+
+  if (SEEK_SET != origin || 0 != offset || NULL == state->upload_seek) { return CURL_SEEKFUNC_CANTSEEK; }
+  rc = state->upload_seek(state->upload_arg, 0, SEEK_SET);
+  if (CURL_SEEKFUNC_OK != rc) { return rc; }
+  digest_init(&state->upload_digest, state->upload_digest.types);
+  if (COMPRESS_NONE == state->upload_compressor.type) { return CURL_SEEKFUNC_OK; }
+  return COMPRESSOR_OK == compressor_reset(&state->upload_compressor) ? CURL_SEEKFUNC_OK : CURL_SEEKFUNC_FAIL;
+}
+
+#if LIBCURL_VERSION_NUM >= 0x073800
+/* this is libCURLv7.56.0 or later, supports the MIME API */
+static void mime_source_free(void* arg) {
+  ruby_xfree(arg);
+}
+#endif
+
+static VALUE call_user_rb_progress_blk_protected(VALUE vd_curl_state) {
   struct patron_curl_state* state = (struct patron_curl_state*)vd_curl_state;
   // Invoke the block with the array
-  rb_funcall(state->user_progress_blk,
+  return rb_funcall(state->user_progress_blk,
     rb_intern("call"), 4,
     LONG2NUM(state->dltotal),
     LONG2NUM(state->dlnow),
     LONG2NUM(state->ultotal),
     LONG2NUM(state->ulnow));
+}
+
+/* Calls the progress proc with the GVL held. An exception raised from the proc may
+   not unwind through libCURL, so it gets caught here and the request is aborted instead.
+   perform_request re-raises it once libCURL has returned. */
+static void *call_user_rb_progress_blk(void *vd_curl_state) {
+  struct patron_curl_state* state = (struct patron_curl_state*)vd_curl_state;
+  VALUE retval = rb_protect(call_user_rb_progress_blk_protected, (VALUE) state, &state->callback_exception_tag);
+
+  if (state->callback_exception_tag || retval == ID2SYM(rb_intern("abort"))) {
+    state->interrupt = INTERRUPT_ABORT;
+  }
   return NULL;
 }
 
+/* Microseconds elapsed since the start of the current transfer */
+static curl_off_t progress_elapsed_us(struct patron_curl_state* state) {
+#if LIBCURL_VERSION_NUM >= 0x073D00
+  /* this is libCURLv7.61.0 or later, supports CURLINFO_TOTAL_TIME_T */
+  curl_off_t elapsed = 0;
+  curl_easy_getinfo(state->handle, CURLINFO_TOTAL_TIME_T, &elapsed);
+  return elapsed;
+#else
+  double elapsed = 0;
+  curl_easy_getinfo(state->handle, CURLINFO_TOTAL_TIME, &elapsed);
+  return (curl_off_t) (elapsed * 1000000);
+#endif
+}
+
+/* Tells whether the progress proc should be called now, according to the
+   progress_interval and progress_bytes throttles. Evaluated without the GVL. */
+static int progress_report_due(struct patron_curl_state* state) {
+  size_t transferred = state->dlnow + state->ulnow;
+  curl_off_t now_us = 0;
+
+  if (!state->progress_interval_us && !state->progress_bytes) {
+    return 1;
+  }
+  /* Always report the download reaching its end, so that the proc gets to see 100% */
+  if (state->dltotal && state->dlnow == state->dltotal && state->progress_reported_dlnow != state->dlnow) {
+    return 1;
+  }
+  if (state->progress_bytes && transferred - state->progress_reported_bytes >= state->progress_bytes) {
+    return 1;
+  }
+  if (state->progress_interval_us) {
+    now_us = progress_elapsed_us(state);
+    if (now_us - state->progress_reported_at_us >= state->progress_interval_us) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
 
 /* A non-zero return value from the progress handler will terminate the current
  * request. We use this fact in order to interrupt any request when either the
@@ -99,11 +799,19 @@ static int session_progress_handler(void* clientp, size_t dltotal, size_t dlnow,
   state->ultotal = ultotal;
   state->ulnow = ulnow;
 
-  // If a progress proc has been set, re-acquire the GIL and call it using
-  // `call_user_rb_progress_blk`. TODO: use the retval of that proc
-  // to permit premature abort 
-  if(RTEST(state->user_progress_blk)) {
-    rb_thread_call_with_gvl(call_user_rb_progress_blk, state);
+  // If a progress proc has been set and a report is due, re-acquire the GIL and
+  // call it using `call_user_rb_progress_blk`. If the proc returns :abort the
+  // interrupt gets set.
+  if(RTEST(state->user_progress_blk) && !state->interrupt) {
+    if (progress_report_due(state)) {
+      state->progress_reported_at_us = state->progress_interval_us ? progress_elapsed_us(state) : 0;
+      state->progress_reported_bytes = dlnow + ulnow;
+      state->progress_reported_dlnow = dlnow;
+      state->progress_delivered++;
+      rb_thread_call_with_gvl(call_user_rb_progress_blk, state);
+    } else {
+      state->progress_suppressed++;
+    }
   }
 
   // Set the interrupt if the download byte limit has been reached
@@ -121,48 +829,92 @@ static int session_progress_handler(void* clientp, size_t dltotal, size_t dlnow,
 }
 
 
-/*
-  List of active curl sessions, used exclusively to be able to set interrupts
-  for all of them if the Ruby interpreter gets shut down with libCURL requests still in flight.
-*/
-struct patron_curl_state_list {
-  struct patron_curl_state       *state;
-  struct patron_curl_state_list  *next;
-};
-
-#define CS_LIST_COMPARATOR(p, _state_) (p->state - _state_)
+/* Sets the interrupt flag and, if the request is waiting on the socket, wakes it
+ * up so that the interrupt gets noticed right away instead of at the next progress
+ * tick (which can take up to a second on an idle connection). Does not touch any
+ * Ruby structures so it may be called without holding the GVL.
+ */
+static void session_wakeup_abort(struct patron_curl_state* state) {
+  state->interrupt = INTERRUPT_ABORT;
+  filesink_cancel(&state->download_sink);
+#if LIBCURL_VERSION_NUM >= 0x074400
+  if (state->multi) {
+    curl_multi_wakeup(state->multi);
+  }
+#endif
+}
 
-static struct patron_curl_state_list *cs_list = NULL;
 
-static void cs_list_append( struct patron_curl_state *state ) {
-  struct patron_curl_state_list *item = NULL;
+/*
+  Registry of live curl sessions, used to be able to set interrupts for all of them
+  if the Ruby interpreter gets shut down with libCURL requests still in flight. The
+  links are embedded in patron_curl_state, so adding and removing a session is O(1)
+  and does not allocate. The lock guards against the list being walked while a
+  session gets added or removed.
+*/
+static struct patron_curl_state *cs_list = NULL;
+static rb_nativethread_lock_t cs_list_lock;
+static unsigned long cs_list_live = 0;
+static unsigned long cs_list_in_flight = 0;
 
+static void cs_list_append(struct patron_curl_state *state) {
   assert(state != NULL);
-  item = ruby_xmalloc(sizeof(struct patron_curl_state_list));
-  item->state = state;
-  item->next = NULL;
 
-  SGLIB_LIST_ADD(struct patron_curl_state_list, cs_list, item, next);
+  rb_nativethread_lock_lock(&cs_list_lock);
+  state->prev = NULL;
+  state->next = cs_list;
+  if (cs_list) {
+    cs_list->prev = state;
+  }
+  cs_list = state;
+  cs_list_live++;
+  rb_nativethread_lock_unlock(&cs_list_lock);
 }
 
 static void cs_list_remove(struct patron_curl_state *state) {
-  struct patron_curl_state_list *item = NULL;
-
   assert(state != NULL);
 
-  SGLIB_LIST_DELETE_IF_MEMBER(struct patron_curl_state_list, cs_list, state, CS_LIST_COMPARATOR, next, item);
-  if (item) {
-    ruby_xfree(item);
+  rb_nativethread_lock_lock(&cs_list_lock);
+  if (state->prev) {
+    state->prev->next = state->next;
+  } else if (cs_list == state) {
+    cs_list = state->next;
+  }
+  if (state->next) {
+    state->next->prev = state->prev;
+  }
+  state->prev = NULL;
+  state->next = NULL;
+  if (state->in_flight) {
+    cs_list_in_flight--;
+    state->in_flight = 0;
+  }
+  cs_list_live--;
+  rb_nativethread_lock_unlock(&cs_list_lock);
+}
+
+/* Marks the session as having (or no longer having) a request in flight */
+static void cs_list_set_in_flight(struct patron_curl_state *state, int in_flight) {
+  rb_nativethread_lock_lock(&cs_list_lock);
+  if (in_flight && !state->in_flight) {
+    cs_list_in_flight++;
+  } else if (!in_flight && state->in_flight) {
+    cs_list_in_flight--;
   }
+  state->in_flight = in_flight;
+  rb_nativethread_lock_unlock(&cs_list_lock);
 }
 
 /* Gets attached to at_exit of the Ruby process to be able to abort all running libCURL requests and quit */
 static void cs_list_interrupt(VALUE data) {
+  struct patron_curl_state *state = NULL;
   UNUSED_ARGUMENT(data);
 
-  SGLIB_LIST_MAP_ON_ELEMENTS(struct patron_curl_state_list, cs_list, item, next, {
-    item->state->interrupt = INTERRUPT_ABORT;
-  });
+  rb_nativethread_lock_lock(&cs_list_lock);
+  for (state = cs_list; state; state = state->next) {
+    session_wakeup_abort(state);
+  }
+  rb_nativethread_lock_unlock(&cs_list_lock);
 }
 
 
@@ -186,7 +938,22 @@ static void session_free(void *ptr) {
   session_close_debug_file(state);
 
   membuffer_destroy(&state->header_buffer);
+  membuffer_destroy(&state->links);
   membuffer_destroy(&state->body_buffer);
+  eventstream_destroy(&state->stream);
+  filesink_abort(&state->download_sink);
+  compressor_destroy(&state->upload_compressor);
+#if LIBCURL_VERSION_NUM >= 0x073800
+  curl_mime_free(state->mime);
+#endif
+
+#if LIBCURL_VERSION_NUM >= 0x073F00
+  curl_url_cleanup(state->base_url);
+  curl_url_cleanup(state->url);
+#endif
+#if LIBCURL_VERSION_NUM >= 0x074400
+  curl_multi_cleanup(state->multi);
+#endif
 
   cs_list_remove(state);
 
@@ -197,12 +964,28 @@ static void session_mark(void *ptr) {
   struct patron_curl_state *state = ptr;
 
   rb_gc_mark(state->user_progress_blk);
+  rb_gc_mark(state->on_headers_blk);
+  rb_gc_mark(state->stream_blk);
+  rb_gc_mark(state->upload_values);
+  if (!NIL_P(state->upload_values)) {
+    /* Pinned: libCURL reads the request body and the names and bodies of multipart parts from the
+       memory of their frozen Strings without the GVL, and the IOs a body or part is read from, and
+       their read buffers, are referenced from the io_source structs the read callbacks get */
+    long i;
+    for (i = 0; i < RARRAY_LEN(state->upload_values); i++) {
+      rb_gc_mark(RARRAY_AREF(state->upload_values, i));
+    }
+  }
+#if LIBCURL_VERSION_NUM >= 0x073F00
+  rb_gc_mark(state->base_url_str);
+  rb_gc_mark(state->url_str);
+#endif
 }
 
 static size_t session_memsize(const void *ptr) {
   const struct patron_curl_state *state = ptr;
 
-  return sizeof(*state) + state->header_buffer.capacity + state->body_buffer.capacity;
+  return sizeof(*state) + state->header_buffer.capacity + state->links.capacity + state->body_buffer.capacity;
 }
 
 static const rb_data_type_t patron_session_data_type = {
@@ -217,8 +1000,23 @@ VALUE session_alloc(VALUE klass) {
   VALUE obj = TypedData_Make_Struct(klass, struct patron_curl_state, &patron_session_data_type, state);
 
   membuffer_init(&state->header_buffer);
+  membuffer_init(&state->links);
   membuffer_init(&state->body_buffer);
+  filesink_init(&state->download_sink);
+  filesource_init(&state->upload_source);
+  compressor_init(&state->upload_compressor);
+  digest_init(&state->body_digest, DIGEST_NONE);
+  digest_init(&state->upload_digest, DIGEST_NONE);
+  state->upload_values = Qnil;
+  state->on_headers_blk = Qnil;
+  state->stream_blk = Qnil;
+  eventstream_init(&state->stream, 0, NULL, 0);
+  state->self = obj;
   cs_list_append(state);
+#if LIBCURL_VERSION_NUM >= 0x073F00
+  state->base_url_str = Qnil;
+  state->url_str = Qnil;
+#endif
 
   /*
     Eagerly initialize the curl handle. We initialize it only once and store it
@@ -234,10 +1032,13 @@ VALUE session_alloc(VALUE klass) {
   curl_share_setopt(state->share, CURLSHOPT_SHARE, CURL_LOCK_DATA_PSL);
   state->base_handle = curl_easy_init();
   curl_easy_setopt(state->base_handle, CURLOPT_SHARE, state->share);
-  curl_easy_setopt(state->base_handle, CURLOPT_WRITEFUNCTION, &session_write_handler);
-  curl_easy_setopt(state->base_handle, CURLOPT_WRITEDATA, &state->body_buffer);
-  curl_easy_setopt(state->base_handle, CURLOPT_HEADERFUNCTION, &session_write_handler);
-  curl_easy_setopt(state->base_handle, CURLOPT_HEADERDATA, &state->header_buffer);
+#if LIBCURL_VERSION_NUM >= 0x074400
+  state->multi = curl_multi_init();
+#endif
+  curl_easy_setopt(state->base_handle, CURLOPT_WRITEFUNCTION, &session_body_write_handler);
+  curl_easy_setopt(state->base_handle, CURLOPT_WRITEDATA, state);
+  curl_easy_setopt(state->base_handle, CURLOPT_HEADERFUNCTION, &session_header_handler);
+  curl_easy_setopt(state->base_handle, CURLOPT_HEADERDATA, state);
   curl_easy_setopt(state->base_handle, CURLOPT_NOSIGNAL, 1);
   curl_easy_setopt(state->base_handle, CURLOPT_NOPROGRESS, 0);
 #if LIBCURL_VERSION_NUM >= 0x072000
@@ -293,71 +1094,439 @@ static VALUE libcurl_version_exact(VALUE klass) {
   return version_arr;
 }
 
-/*
- * Escapes the provided string using libCURL URL escaping functions.
- *
- * @param [String] value plain string to URL-escape
-*  @return [String] the escaped string
- */
-static VALUE session_escape(VALUE self, VALUE value) {
-  
-  VALUE string = StringValue(value);
-  char* escaped = NULL;
-  VALUE retval = Qnil;
+/* Escapes a String into a new US-ASCII String, like curl_easy_escape does. */
+static VALUE escape_string(VALUE string) {
+  const char* src = RSTRING_PTR(string);
+  long len = RSTRING_LEN(string);
+  size_t count = escape_count(src, len);
+  VALUE escaped = Qnil;
 
-#if LIBCURL_VERSION_NUM >= 0x075200
-  /* this is libCURLv7.82.0 or later, the curl parameter is ignored */
-  CURL *curl = NULL;
-#else
-  CURL* curl = curl_easy_init();
-#endif
-  escaped = curl_easy_escape(curl,
-                             RSTRING_PTR(string),
-                             (int) RSTRING_LEN(string));
+  if (count == 0) { return rb_usascii_str_new(src, len); }
 
-  retval = rb_str_new2(escaped);
-#if LIBCURL_VERSION_NUM >= 0x075200
-  /* this is libCURLv7.82.0 or later, the curl parameter is ignored */
-#else
-  curl_easy_cleanup(curl);
-#endif
-  curl_free(escaped);
+  escaped = rb_usascii_str_new(NULL, len + 2 * count);
+  escape_into(RSTRING_PTR(escaped), src, len);
+  return escaped;
+}
+
+/* Unescapes a String into a new binary (ASCII-8BIT) String, like curl_easy_unescape does. */
+static VALUE unescape_string(VALUE string) {
+  const char* src = RSTRING_PTR(string);
+  long len = RSTRING_LEN(string);
+  VALUE unescaped = Qnil;
 
-  return retval;
+  if (memchr(src, '%', len) == NULL) { return rb_str_new(src, len); }
+
+  unescaped = rb_str_new(NULL, len);
+  rb_str_set_len(unescaped, unescape_into(RSTRING_PTR(unescaped), src, len));
+  return unescaped;
 }
 
 /*
- * Unescapes the provided string using libCURL URL escaping functions.
+ * Escapes the provided string the same way libCURL's `curl_easy_escape` does.
  *
- * @param [String] value URL-encoded String to unescape
-*  @return [String] unescaped (decoded) string
+ * @param [String] value plain string to URL-escape
+*  @return [String] the escaped string, US-ASCII encoded
+ */
+static VALUE session_escape(VALUE self, VALUE value) {
+  UNUSED_ARGUMENT(self);
+  return escape_string(StringValue(value));
+}
+
+/*
+ * Unescapes the provided string the same way libCURL's `curl_easy_unescape` does.
+ *
+ * @param [String] value URL-encoded String to unescape
+*  @return [String] unescaped (decoded) string, with binary (ASCII-8BIT) encoding
  */
 static VALUE session_unescape(VALUE self, VALUE value) {
-  VALUE string = StringValue(value);
-  char* unescaped = NULL;
-  VALUE retval = Qnil;
+  UNUSED_ARGUMENT(self);
+  return unescape_string(StringValue(value));
+}
 
-#if LIBCURL_VERSION_NUM >= 0x075200
-  /* this is libCURLv7.82.0 or later, the curl parameter is ignored */
-  CURL *curl = NULL;
-#else
-  CURL *curl = curl_easy_init();
-#endif
-  unescaped = curl_easy_unescape(curl,
-                                 RSTRING_PTR(string),
-                                 (int) RSTRING_LEN(string),
-                                 NULL);
-
-  retval = rb_str_new2(unescaped);
-  curl_free(unescaped);
-#if LIBCURL_VERSION_NUM >= 0x075200
-  /* this is libCURLv7.82.0 or later, the curl parameter is ignored */
-#else
-  curl_easy_cleanup(curl);
-#endif
+/*
+ * Escapes all the strings in the given Array.
+ *
+ * @param [Array<String>] values plain strings to URL-escape
+*  @return [Array<String>] the escaped strings, in the same order
+ */
+static VALUE session_escape_all(VALUE self, VALUE values) {
+  VALUE escaped = Qnil;
+  long i;
+  UNUSED_ARGUMENT(self);
+
+  Check_Type(values, T_ARRAY);
+  escaped = rb_ary_new_capa(RARRAY_LEN(values));
+  for (i = 0; i < RARRAY_LEN(values); i++) {
+    VALUE value = rb_ary_entry(values, i);
+    rb_ary_push(escaped, escape_string(StringValue(value)));
+  }
+  return escaped;
+}
+
+/*
+ * Unescapes all the strings in the given Array.
+ *
+ * @param [Array<String>] values URL-encoded strings to unescape
+*  @return [Array<String>] the unescaped strings, in the same order
+ */
+static VALUE session_unescape_all(VALUE self, VALUE values) {
+  VALUE unescaped = Qnil;
+  long i;
+  UNUSED_ARGUMENT(self);
+
+  Check_Type(values, T_ARRAY);
+  unescaped = rb_ary_new_capa(RARRAY_LEN(values));
+  for (i = 0; i < RARRAY_LEN(values); i++) {
+    VALUE value = rb_ary_entry(values, i);
+    rb_ary_push(unescaped, unescape_string(StringValue(value)));
+  }
+  return unescaped;
+}
+
+/* State for encoding a (nested) Hash into a query string in a single pass */
+struct query_encoder {
+  VALUE out;          /* the query String being built */
+  VALUE key;          /* the key of the current value, including the "[parent]" prefixes */
+  int escape_keys;
+  int escape_values;
+};
+
+/* Appends the bytes to the String, percent-encoding them if asked to. The escaped
+   data gets written directly into the String buffer, growing it geometrically. */
+static void str_cat_escaped(VALUE str, const char* src, long len, int escape) {
+  long needed = len;
+  long cur_len = RSTRING_LEN(str);
+  long capacity = (long) rb_str_capacity(str);
+
+  if (!escape) {
+    rb_str_buf_cat(str, src, len);
+    return;
+  }
+
+  needed += 2 * (long) escape_count(src, len);
+  if (capacity - cur_len < needed) {
+    rb_str_modify_expand(str, needed > capacity ? needed : capacity);
+  } else {
+    rb_str_modify(str);
+  }
+  cur_len += (long) escape_into(RSTRING_PTR(str) + cur_len, src, len);
+  rb_str_set_len(str, cur_len);
+}
+
+static void query_encode_value(struct query_encoder* encoder, VALUE value);
+
+static int query_encode_hash_i(VALUE key, VALUE value, VALUE encoder_ptr) {
+  struct query_encoder* encoder = (struct query_encoder*) encoder_ptr;
+  long prefix_len = RSTRING_LEN(encoder->key);
+
+  key = rb_obj_as_string(key);
+  if (prefix_len == 0) {
+    rb_str_buf_append(encoder->key, key);
+  } else {
+    rb_str_buf_cat(encoder->key, "[", 1);
+    rb_str_buf_append(encoder->key, key);
+    rb_str_buf_cat(encoder->key, "]", 1);
+  }
+
+  query_encode_value(encoder, value);
+  rb_str_set_len(encoder->key, prefix_len);
+
+  return ST_CONTINUE;
+}
+
+static void query_encode_value(struct query_encoder* encoder, VALUE value) {
+  long prefix_len = RSTRING_LEN(encoder->key);
+  long i;
+
+  switch (rb_type(value)) {
+    case T_HASH:
+      rb_hash_foreach(value, query_encode_hash_i, (VALUE) encoder);
+      break;
+    case T_ARRAY:
+      for (i = 0; i < RARRAY_LEN(value); i++) {
+        rb_str_buf_cat(encoder->key, "[]", 2);
+        query_encode_value(encoder, rb_ary_entry(value, i));
+        rb_str_set_len(encoder->key, prefix_len);
+      }
+      break;
+    default:
+      value = rb_obj_as_string(value);
+      if (RSTRING_LEN(encoder->out) > 0) {
+        rb_str_buf_cat(encoder->out, "&", 1);
+      }
+      str_cat_escaped(encoder->out, RSTRING_PTR(encoder->key), prefix_len, encoder->escape_keys);
+      rb_str_buf_cat(encoder->out, "=", 1);
+      str_cat_escaped(encoder->out, RSTRING_PTR(value), RSTRING_LEN(value), encoder->escape_values);
+  }
+}
+
+/*
+ * Encodes a Hash into a query string (or an `application/x-www-form-urlencoded` body)
+ * in a single pass. Nested Hashes are encoded as `parent[child]=value` and Arrays as
+ * `key[]=value`. All other values get converted using `to_s`.
+ *
+ * @param hash[Hash] the Hash of keys to values
+ * @param escape_keys[Boolean] whether the keys should be URL-escaped
+ * @param escape_values[Boolean] whether the values should be URL-escaped
+ * @return [String] the encoded String, without a leading "?"
+ */
+static VALUE util_encode_query(VALUE klass, VALUE hash, VALUE escape_keys, VALUE escape_values) {
+  struct query_encoder encoder;
+  UNUSED_ARGUMENT(klass);
+
+  Check_Type(hash, T_HASH);
+  encoder.out = rb_str_buf_new(RHASH_SIZE(hash) * 32);
+  encoder.key = rb_str_buf_new(64);
+  encoder.escape_keys = RTEST(escape_keys);
+  encoder.escape_values = RTEST(escape_values);
+
+  query_encode_value(&encoder, hash);
+  RB_GC_GUARD(encoder.key);
+
+  return encoder.out;
+}
+
+/* Bodies larger than this get decompressed without holding the GVL */
+#define DECODE_WITHOUT_GVL_SIZE (64 * 1024)
+
+struct decode_context {
+  int type;
+  const char* src;
+  size_t length;
+  membuffer out;
+  size_t limit;
+  volatile int cancelled;
+  int rc;
+};
+
+static void *decode_content_without_gvl(void *ptr) {
+  struct decode_context *context = ptr;
+  context->rc = decompress(context->type, context->src, context->length, &context->out, context->limit,
+                           &context->cancelled);
+  return NULL;
+}
+
+/* Makes a decompression which is interrupted, by Thread#raise or Timeout say, stop at its next chunk */
+static void decode_content_ubf(void *ptr) {
+  struct decode_context *context = ptr;
+  context->cancelled = 1;
+}
+
+static VALUE decode_content_protected(VALUE ptr) {
+  struct decode_context *context = (struct decode_context*) ptr;
+
+  if (context->length > DECODE_WITHOUT_GVL_SIZE) {
+    rb_thread_call_without_gvl(decode_content_without_gvl, context, decode_content_ubf, context);
+  } else {
+    decode_content_without_gvl(context);
+  }
+  if (DECOMPRESSOR_CANCELLED == context->rc) {
+    /* The interrupt is raised here, unless it was handled already */
+    rb_thread_check_ints();
+    rb_raise(eAborted, "Decoding the response body was interrupted");
+  } else if (DECOMPRESSOR_LIMIT_EXCEEDED == context->rc) {
+    rb_raise(eAborted, "Decompressed response body exceeded the decompressed_byte_limit of %lu bytes",
+             (unsigned long) context->limit);
+  } else if (DECOMPRESSOR_OK != context->rc) {
+    rb_raise(ePatronError, "Unable to decode the response body");
+  }
+  return membuffer_to_rb_str(&context->out);
+}
+
+/*
+ * Decodes a response body which was received with its Content-Encoding kept, see
+ * `Session#keep_content_encoding`. Large bodies get decoded without holding the GVL.
+ *
+ * @param data[String] the encoded body
+ * @param encoding[String] the Content-Encoding, like "gzip"
+ * @param limit[Integer, nil] the largest size the decoded body may have
+ * @return [String] the decoded body
+ * @raise [Patron::Error] when the encoding is not supported, or the body is not valid for it
+ * @raise [Patron::Aborted] when the decoded body is larger than the _limit_
+ */
+static VALUE util_decode_content(VALUE klass, VALUE data, VALUE encoding, VALUE limit) {
+  struct decode_context context;
+  VALUE decoded;
+  int state = 0;
+  UNUSED_ARGUMENT(klass);
+
+  StringValue(data);
+  StringValue(encoding);
+  context.type = decompressor_type(RSTRING_PTR(encoding), RSTRING_LEN(encoding));
+  if (DECOMPRESS_NONE == context.type) {
+    rb_raise(ePatronError, "Unsupported Content-Encoding: %"PRIsVALUE, encoding);
+  }
+  context.limit = NIL_P(limit) ? 0 : NUM2SIZET(limit);
+  context.cancelled = 0;
+  context.rc = DECOMPRESSOR_OK;
+  membuffer_init(&context.out);
+
+  /* The String may not be changed or moved while it is read without the GVL */
+  data = rb_str_new_frozen(data);
+  rb_str_locktmp(data);
+  context.src = RSTRING_PTR(data);
+  context.length = RSTRING_LEN(data);
+  decoded = rb_protect(decode_content_protected, (VALUE) &context, &state);
+  rb_str_unlocktmp(data);
+  membuffer_destroy(&context.out);
+  if (state) { rb_jump_tag(state); }
+  return decoded;
+}
+
+#if LIBCURL_VERSION_NUM >= 0x073F00
+/* this is libCURLv7.63.0 or later, supports the URL API and CURLOPT_CURLU */
+
+/* Let the URL parser accept any scheme: requests with protocols other than HTTP(S)
+   should fail with UnsupportedProtocol when performed, not while building the URL */
+#define URL_PARSE_FLAGS CURLU_NON_SUPPORT_SCHEME
+
+/* Tells whether the URL starts with a "scheme://" prefix, in which case it is
+   used as-is and the base URL of the Session does not apply. */
+static int url_has_scheme(const char* url, long len) {
+  long i;
+
+  if (len == 0 || !ISALPHA(url[0])) { return 0; }
+  for (i = 1; i < len; i++) {
+    if (url[i] == ':') {
+      return (len - i) >= 3 && url[i + 1] == '/' && url[i + 2] == '/';
+    }
+    if (!ISALNUM(url[i]) && url[i] != '+' && url[i] != '-' && url[i] != '.') {
+      return 0;
+    }
+  }
+  return 0;
+}
+
+/* Returns the parsed base URL for the Session. The parsed handle is cached
+   and only gets reparsed when the base URL string changes. */
+static CURLU* session_base_url(struct patron_curl_state* state, VALUE base_url) {
+  const char* base_url_ptr = StringValueCStr(base_url);
+  CURLU* parsed = NULL;
+
+  if (state->base_url && rb_str_equal(state->base_url_str, base_url) == Qtrue) {
+    return state->base_url;
+  }
+
+  curl_url_cleanup(state->base_url);
+  state->base_url = NULL;
+  state->base_url_str = Qnil;
+
+  parsed = curl_url();
+  if (curl_url_set(parsed, CURLUPART_URL, base_url_ptr, URL_PARSE_FLAGS) != CURLUE_OK) {
+    curl_url_cleanup(parsed);
+    rb_raise(eURLFormatError, "Malformed base URL: %s", base_url_ptr);
+  }
+
+  state->base_url = parsed;
+  state->base_url_str = rb_str_new_frozen(base_url);
+  return parsed;
+}
+
+/* Appends the path of a relative URL to the path of the base URL (the same way
+   File.join would), and replaces the query and fragment if the relative URL has them. */
+static CURLUcode join_relative_url(CURLU* url, const char* rel, long len) {
+  const char* path_end = rel + len;
+  const char* query = memchr(rel, '?', len);
+  const char* fragment = memchr(rel, '#', len);
+  char* base_path = NULL;
+  char* buf = NULL;
+  size_t base_len = 0;
+  long i = 0;
+  CURLUcode rc = CURLUE_OK;
+
+  /* Control characters and spaces are not permitted anywhere in the URL */
+  for (i = 0; i < len; i++) {
+    if ((unsigned char) rel[i] <= 0x20 || (unsigned char) rel[i] == 0x7F) {
+      return CURLUE_MALFORMED_INPUT;
+    }
+  }
 
-  return retval;
+  if (fragment && query && query > fragment) { query = NULL; }
+  if (query) { path_end = query; }
+  else if (fragment) { path_end = fragment; }
+
+  rc = curl_url_get(url, CURLUPART_PATH, &base_path, 0);
+  if (rc != CURLUE_OK) { return rc; }
+
+  buf = malloc(strlen(base_path) + len + 2);
+  if (!buf) {
+    curl_free(base_path);
+    return CURLUE_OUT_OF_MEMORY;
+  }
+
+  base_len = strlen(base_path);
+  while (base_len > 0 && base_path[base_len - 1] == '/') { base_len--; }
+  while (rel < path_end && *rel == '/') { rel++; }
+
+  memcpy(buf, base_path, base_len);
+  buf[base_len] = '/';
+  memcpy(buf + base_len + 1, rel, path_end - rel);
+  buf[base_len + 1 + (path_end - rel)] = '\0';
+  curl_free(base_path);
+
+  rc = curl_url_set(url, CURLUPART_PATH, buf, 0);
+
+  if (rc == CURLUE_OK && query) {
+    const char* query_end = fragment ? fragment : query + strlen(query);
+    memcpy(buf, query + 1, query_end - query - 1);
+    buf[query_end - query - 1] = '\0';
+    rc = curl_url_set(url, CURLUPART_QUERY, buf, 0);
+  }
+
+  if (rc == CURLUE_OK && fragment) {
+    rc = curl_url_set(url, CURLUPART_FRAGMENT, fragment + 1, 0);
+  }
+
+  free(buf);
+  return rc;
+}
+
+/*
+ * Joins the `url` onto the `base_url` of the Session and appends the `query` to it,
+ * using the libCURL URL API. The parsed URL is kept and gets handed to libCURL directly
+ * when the returned String is used as the URL of the next request.
+ *
+ * @param base_url[String] the base URL, or an empty String
+ * @param url[String] a path relative to the base URL, or a complete URL
+ * @param query[String] a query string to append to the query of the URL (can be empty)
+ * @return [String] the complete URL
+ */
+static VALUE session_build_url(VALUE self, VALUE base_url, VALUE url, VALUE query) {
+  struct patron_curl_state *state = get_patron_curl_state(self);
+  const char* url_ptr = StringValueCStr(url);
+  const char* query_ptr = StringValueCStr(query);
+  CURLU* built = NULL;
+  CURLUcode rc = CURLUE_OK;
+  char* built_str = NULL;
+
+  StringValue(base_url);
+  if (RSTRING_LEN(base_url) == 0 || url_has_scheme(url_ptr, RSTRING_LEN(url))) {
+    built = curl_url();
+    rc = curl_url_set(built, CURLUPART_URL, url_ptr, URL_PARSE_FLAGS);
+  } else {
+    built = curl_url_dup(session_base_url(state, base_url));
+    rc = join_relative_url(built, url_ptr, RSTRING_LEN(url));
+  }
+
+  if (rc == CURLUE_OK && *query_ptr) {
+    rc = curl_url_set(built, CURLUPART_QUERY, query_ptr, CURLU_APPENDQUERY);
+  }
+  if (rc == CURLUE_OK) {
+    rc = curl_url_get(built, CURLUPART_URL, &built_str, 0);
+  }
+  if (rc != CURLUE_OK) {
+    curl_url_cleanup(built);
+    rb_raise(eURLFormatError, "Malformed URL: %s", url_ptr);
+  }
+
+  curl_url_cleanup(state->url);
+  state->url = built;
+  state->url_str = rb_obj_freeze(rb_str_new2(built_str));
+  curl_free(built_str);
+
+  return state->url_str;
 }
+#endif
 
 /* Callback used to iterate over the HTTP headers and store them in an slist. */
 static int each_http_header(VALUE header_key, VALUE header_value, VALUE self) {
@@ -390,26 +1559,163 @@ static int each_http_header(VALUE header_key, VALUE header_value, VALUE self) {
   return 0;
 }
 
-static int formadd_values(VALUE data_key, VALUE data_value, VALUE self) {
-  struct patron_curl_state *state = get_patron_curl_state(self);
-  VALUE name = rb_obj_as_string(data_key);
-  VALUE value = rb_obj_as_string(data_value);
+/* Keeps _value_ referenced, and in place, until the request has been cleaned up */
+static VALUE pin_upload_value(struct patron_curl_state* state, VALUE value) {
+  if (NIL_P(state->upload_values)) {
+    state->upload_values = rb_ary_new();
+  }
+  rb_ary_push(state->upload_values, value);
+  return value;
+}
 
-  curl_formadd(&state->post, &state->last, CURLFORM_PTRNAME, RSTRING_PTR(name),
-                CURLFORM_PTRCONTENTS, RSTRING_PTR(value), CURLFORM_END);
+/* The position and the remaining size of a seekable IO, or nil */
+static VALUE io_extent(VALUE io) {
+  VALUE pos = rb_funcall(io, rb_intern("pos"), 0);
+  VALUE size = rb_funcall(io, rb_intern("size"), 0);
+  return rb_assoc_new(pos, rb_funcall(size, '-', 1, pos));
+}
 
-  return 0;
+/* Rescues io_extent for an IO which can not tell its position or size after all, like a pipe */
+static VALUE io_extent_unknown(VALUE io, VALUE error) {
+  UNUSED_ARGUMENT(io);
+  UNUSED_ARGUMENT(error);
+  return Qnil;
 }
 
-static int formadd_files(VALUE data_key, VALUE data_value, VALUE self) {
-  struct patron_curl_state *state = get_patron_curl_state(self);
-  VALUE name = rb_obj_as_string(data_key);
-  VALUE value = rb_obj_as_string(data_value);
+/* Sets up _src_ to send the String _body_, returns its size. The String is frozen so that it
+   can not change while being sent - for a String which is not frozen yet that only makes a
+   shared copy, without copying its contents. */
+static curl_off_t string_source_init(struct patron_curl_state* state, struct string_source* src, VALUE body) {
+  VALUE str = pin_upload_value(state, rb_str_new_frozen(StringValue(body)));
+
+  src->ptr = RSTRING_PTR(str);
+  src->length = RSTRING_LEN(str);
+  src->offset = 0;
+  return (curl_off_t) src->length;
+}
+
+/* Sets up _src_ to send what can be read from _io_. An IO which can tell its size gets sent from
+   its current position to its end, the size of any other IO is unknown and -1 is returned. */
+static curl_off_t io_source_init(struct patron_curl_state* state, struct io_source* src, VALUE io) {
+  VALUE extent = Qnil;
+
+  if (rb_respond_to(io, rb_intern("size")) && rb_respond_to(io, rb_intern("seek"))) {
+    extent = rb_rescue2(&io_extent, io, &io_extent_unknown, Qnil, rb_eSystemCallError, (VALUE) 0);
+  }
+
+  src->state = state;
+  src->io = pin_upload_value(state, io);
+  src->buffer = pin_upload_value(state, rb_str_buf_new(0));
+  src->seekable = !NIL_P(extent);
+  src->start = src->seekable ? (curl_off_t) NUM2LL(RARRAY_AREF(extent, 0)) : 0;
+  src->offset = 0;
+  return src->seekable ? (curl_off_t) NUM2LL(RARRAY_AREF(extent, 1)) : -1;
+}
+
+#if LIBCURL_VERSION_NUM >= 0x073800
+/* this is libCURLv7.56.0 or later, supports the MIME API */
+
+static void mime_data_string(struct patron_curl_state* state, curl_mimepart* part, VALUE body) {
+  struct string_source* src = ruby_xmalloc(sizeof(struct string_source));
+  curl_off_t size = string_source_init(state, src, body);
+
+  curl_mime_data_cb(part, size, &string_source_read, &string_source_seek, &mime_source_free, src);
+}
+
+/* Without a known size the request body gets sent with chunked encoding */
+static void mime_data_io(struct patron_curl_state* state, curl_mimepart* part, VALUE io) {
+  struct io_source* src = ruby_xmalloc(sizeof(struct io_source));
+  curl_off_t size = io_source_init(state, src, io);
+
+  curl_mime_data_cb(part, size, &io_source_read, &io_source_seek, &mime_source_free, src);
+}
+
+/* Adds a Patron::Part to the multipart body */
+static void mime_add_part(struct patron_curl_state* state, VALUE name, VALUE part) {
+  VALUE body = rb_funcall(part, rb_intern("body"), 0);
+  VALUE path = rb_funcall(part, rb_intern("path"), 0);
+  VALUE filename = rb_funcall(part, rb_intern("filename"), 0);
+  VALUE content_type = rb_funcall(part, rb_intern("content_type"), 0);
+  curl_mimepart* mimepart = curl_mime_addpart(state->mime);
+
+  curl_mime_name(mimepart, StringValueCStr(name));
+  if (RTEST(path)) {
+    if (CURLE_OK != curl_mime_filedata(mimepart, StringValueCStr(path))) {
+      rb_raise(rb_eArgError, "Unable to open specified file.");
+    }
+  } else if (rb_respond_to(body, rb_intern("read"))) {
+    mime_data_io(state, mimepart, body);
+  } else {
+    mime_data_string(state, mimepart, body);
+  }
+  if (RTEST(filename)) {
+    curl_mime_filename(mimepart, StringValueCStr(filename));
+  }
+  if (RTEST(content_type)) {
+    curl_mime_type(mimepart, StringValueCStr(content_type));
+  }
+}
+#else
+/* Adds a Patron::Part to the multipart body. Before the MIME API libCURL can not read parts from an IO. */
+static void formadd_part(struct patron_curl_state* state, VALUE name, VALUE part) {
+  VALUE body = rb_funcall(part, rb_intern("body"), 0);
+  VALUE path = rb_funcall(part, rb_intern("path"), 0);
+  VALUE filename = rb_funcall(part, rb_intern("filename"), 0);
+  VALUE content_type = rb_funcall(part, rb_intern("content_type"), 0);
+  struct curl_forms forms[4];
+  int count = 0;
+
+  name = pin_upload_value(state, rb_str_new_frozen(StringValue(name)));
+  if (RTEST(path)) {
+    forms[count].option = CURLFORM_FILE;
+    forms[count++].value = StringValueCStr(path);
+  } else if (rb_respond_to(body, rb_intern("read"))) {
+    rb_raise(rb_eArgError, "Multipart parts can only be read from an IO with libCURL 7.56.0 or later");
+  } else {
+    body = pin_upload_value(state, rb_str_new_frozen(StringValue(body)));
+    forms[count].option = CURLFORM_PTRCONTENTS;
+    forms[count++].value = RSTRING_PTR(body);
+    forms[count].option = CURLFORM_CONTENTSLENGTH;
+    forms[count++].value = (char*) (long) RSTRING_LEN(body);
+  }
+  if (RTEST(filename)) {
+    forms[count].option = CURLFORM_FILENAME;
+    forms[count++].value = StringValueCStr(filename);
+  }
+  if (RTEST(content_type)) {
+    forms[count].option = CURLFORM_CONTENTTYPE;
+    forms[count++].value = StringValueCStr(content_type);
+  }
+  forms[count].option = CURLFORM_END;
 
   curl_formadd(&state->post, &state->last, CURLFORM_PTRNAME, RSTRING_PTR(name),
-                CURLFORM_FILE, RSTRING_PTR(value), CURLFORM_END);
+               CURLFORM_NAMELENGTH, (long) RSTRING_LEN(name), CURLFORM_ARRAY, forms, CURLFORM_END);
+}
+#endif
 
-  return 0;
+/* Builds the multipart request body from the parts of the request */
+static void set_request_body_multipart(struct patron_curl_state* state, VALUE request) {
+  VALUE parts = rb_funcall(request, rb_intern("multipart_parts"), 0);
+  long i;
+
+#if LIBCURL_VERSION_NUM >= 0x073800
+  curl_mime_free(state->mime); /* left over if setting the options failed last time */
+  state->mime = curl_mime_init(state->handle);
+  for (i = 0; i < RARRAY_LEN(parts); i++) {
+    VALUE pair = RARRAY_AREF(parts, i);
+    mime_add_part(state, RARRAY_AREF(pair, 0), RARRAY_AREF(pair, 1));
+  }
+  curl_easy_setopt(state->handle, CURLOPT_MIMEPOST, state->mime);
+#else
+  curl_formfree(state->post);
+  state->post = NULL;
+  state->last = NULL;
+  for (i = 0; i < RARRAY_LEN(parts); i++) {
+    VALUE pair = RARRAY_AREF(parts, i);
+    formadd_part(state, RARRAY_AREF(pair, 0), RARRAY_AREF(pair, 1));
+  }
+  curl_easy_setopt(state->handle, CURLOPT_HTTPPOST, state->post);
+#endif
 }
 
 // Set the given char pointer and it's length to be the CURL request body
@@ -422,6 +1728,16 @@ static void set_curl_request_body(CURL* curl, char* buf, curl_off_t len) {
   #endif
 }
 
+/* Sends the String _data_ straight from its memory. It is pinned and frozen like the Strings
+   of a multipart body, so that it stays in place and unchanged while the request runs without
+   the GVL - a frozen String is used as it is, and any other one only gets a shared copy. */
+static void set_request_body_string(struct patron_curl_state* state, VALUE data) {
+  VALUE str = pin_upload_value(state, rb_str_new_frozen(StringValue(data)));
+
+  state->upload_buf = RSTRING_PTR(str);
+  set_curl_request_body(state->handle, state->upload_buf, (curl_off_t) RSTRING_LEN(str));
+}
+
 static void set_chunked_encoding(struct patron_curl_state *state) {
   state->headers = curl_slist_append(state->headers, "Transfer-Encoding: chunked");
 }
@@ -435,19 +1751,52 @@ static FILE* open_file(VALUE filename, const char* perms) {
   return handle;
 }
 
-static void set_request_body_file(struct patron_curl_state* state, VALUE r_path_str) {
+/* Uploads the request body from the read callback _read_, compressing it and computing its digests on
+   the way if the request asks for that. With a _size_ of -1, or when compressing, the body gets sent with
+   chunked encoding. */
+static void set_upload_source(struct patron_curl_state* state, curl_read_callback read,
+                              curl_seek_callback seek, void* arg, curl_off_t size) {
   CURL* curl = state->handle;
-  
-  state->request_body_file = open_file(r_path_str, "rb");
+
+  if (COMPRESS_NONE != state->upload_compressor.type || DIGEST_NONE != state->upload_digest.types) {
+    state->upload_read = read;
+    state->upload_seek = seek;
+    state->upload_arg = arg;
+    read = &upload_read_handler;
+    seek = &upload_seek_handler;
+    arg = state;
+  }
+  if (COMPRESS_NONE != state->upload_compressor.type) {
+    size = -1;
+    state->headers = curl_slist_append(state->headers, COMPRESS_GZIP == state->upload_compressor.type ?
+                                       "Content-Encoding: gzip" : "Content-Encoding: zstd");
+  }
   curl_easy_setopt(curl, CURLOPT_UPLOAD, 1);
-  curl_easy_setopt(curl, CURLOPT_READDATA, state->request_body_file);
-  struct stat stat_info;
-  fstat(fileno(state->request_body_file), &stat_info);
+  curl_easy_setopt(curl, CURLOPT_READFUNCTION, read);
+  curl_easy_setopt(curl, CURLOPT_READDATA, arg);
+  curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, seek);
+  curl_easy_setopt(curl, CURLOPT_SEEKDATA, arg);
+  if (size >= 0) {
   #ifdef CURLOPT_INFILESIZE_LARGE
-    curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, stat_info.st_size);
+    curl_easy_setopt(curl, CURLOPT_INFILESIZE_LARGE, size);
   #else
-    curl_easy_setopt(curl, CURLOPT_INFILESIZE, stat_info.st_size);
+    curl_easy_setopt(curl, CURLOPT_INFILESIZE, (long) size);
   #endif
+  }
+}
+
+static void set_request_body_file(struct patron_curl_state* state, VALUE r_path_str) {
+  CURL* curl = state->handle;
+  
+  filesource_close(&state->upload_source); /* left open if setting the options failed last time */
+  if (FSRC_OK != filesource_open(&state->upload_source, StringValueCStr(r_path_str))) {
+    rb_raise(rb_eArgError, "Unable to open specified file.");
+  }
+#if LIBCURL_VERSION_NUM >= 0x073E00
+  /* this is libCURLv7.62.0 or later, supports CURLOPT_UPLOAD_BUFFERSIZE */
+  curl_easy_setopt(curl, CURLOPT_UPLOAD_BUFFERSIZE, (long) FSRC_READ_SIZE);
+#endif
+  set_upload_source(state, &file_read_handler, &file_seek_handler, state, (curl_off_t) state->upload_source.size);
 }
 
 static long floating_rb_seconds_to_milliseconds(VALUE r_seconds) {
@@ -457,21 +1806,92 @@ static long floating_rb_seconds_to_milliseconds(VALUE r_seconds) {
 }
 
 static void set_request_body(struct patron_curl_state* state, VALUE stringable_or_file) {
-  CURL* curl = state->handle;
+  VALUE r_path_str = Qnil;
   if(rb_respond_to(stringable_or_file, rb_intern("to_path"))) {
+    // IO#to_path is nil for an IO which was not opened from a path, like a pipe
+    r_path_str = rb_funcall(stringable_or_file, rb_intern("to_path"), 0);
+  }
+  if (!NIL_P(r_path_str)) {
     // Set up a file read callback (read the entire request body from a file).
     // Instead of using the Ruby file reads, use #to_path to obtain the
     // file path on the file system and open a file pointer to it
-    VALUE r_path_str = rb_funcall(stringable_or_file, rb_intern("to_path"), 0);
     r_path_str = rb_funcall(r_path_str, rb_intern("to_s"), 0);
     set_request_body_file(state, r_path_str);
+  } else if (rb_respond_to(stringable_or_file, rb_intern("read"))) {
+    // Stream the request body from an IO
+    curl_off_t size = io_source_init(state, &state->upload_io, stringable_or_file);
+    set_upload_source(state, &io_source_read, &io_source_seek, &state->upload_io, size);
+  } else if (COMPRESS_NONE != state->upload_compressor.type || DIGEST_NONE != state->upload_digest.types) {
+    // Compress or digest the request body from a String while it is sent
+    VALUE data = rb_funcall(stringable_or_file, rb_intern("to_s"), 0);
+    curl_off_t size = string_source_init(state, &state->upload_string, data);
+    set_upload_source(state, &string_source_read, &string_source_seek, &state->upload_string, size);
   } else {
     // Set the request body from a String
-    VALUE data = rb_funcall(stringable_or_file, rb_intern("to_s"), 0);
-    long len = RSTRING_LEN(data);
-    state->upload_buf = StringValuePtr(data);
-    set_curl_request_body(curl, state->upload_buf, len);
+    set_request_body_string(state, rb_funcall(stringable_or_file, rb_intern("to_s"), 0));
+  }
+}
+
+static void fail_on_status_range(struct patron_curl_state* state, long from, long to) {
+  long status;
+
+  for (status = from < 0 ? 0 : from; status <= to && status < 1000; status++) {
+    state->fail_on_status[status / 8] |= 1 << (status % 8);
+  }
+}
+
+/* Sets the bits of the status codes given as an Integer, a Range or an Array of them */
+static void set_fail_on_status(struct patron_curl_state* state, VALUE statuses) {
+  VALUE from, to;
+  int exclusive;
+  long i;
+
+  if (NIL_P(statuses)) { return; }
+  if (RB_INTEGER_TYPE_P(statuses)) {
+    fail_on_status_range(state, NUM2LONG(statuses), NUM2LONG(statuses));
+  } else if (rb_type(statuses) == T_ARRAY) {
+    for (i = 0; i < RARRAY_LEN(statuses); i++) {
+      set_fail_on_status(state, rb_ary_entry(statuses, i));
+    }
+  } else if (rb_range_values(statuses, &from, &to, &exclusive)) {
+    fail_on_status_range(state, NIL_P(from) ? 0 : NUM2LONG(from),
+                         NIL_P(to) ? 999 : NUM2LONG(to) - (exclusive ? 1 : 0));
+  } else {
+    rb_raise(rb_eArgError, "Invalid fail_on_status: %"PRIsVALUE, rb_inspect(statuses));
+  }
+}
+
+static int digest_type(VALUE name) {
+  ID id = rb_to_id(name);
+
+  if (id == rb_intern("sha256")) { return DIGEST_SHA256; }
+  if (id == rb_intern("md5")) { return DIGEST_MD5; }
+  if (id == rb_intern("crc32c")) { return DIGEST_CRC32C; }
+  rb_raise(rb_eArgError, "Unsupported digest: %"PRIsVALUE, rb_inspect(name));
+}
+
+/* The digest types asked for with a Symbol, or an Array of them */
+static int digest_types(VALUE names) {
+  int types = DIGEST_NONE;
+  long i;
+
+  if (NIL_P(names)) { return DIGEST_NONE; }
+  if (rb_type(names) != T_ARRAY) { return digest_type(names); }
+  for (i = 0; i < RARRAY_LEN(names); i++) {
+    types |= digest_type(rb_ary_entry(names, i));
   }
+  return types;
+}
+
+static int each_expected_digest(VALUE name, VALUE hex, VALUE arg) {
+  struct patron_curl_state* state = (struct patron_curl_state*) arg;
+  int type = digest_type(name);
+
+  StringValue(hex);
+  if (DIGEST_OK != digest_expect_hex(&state->body_expected, type, RSTRING_PTR(hex), RSTRING_LEN(hex))) {
+    rb_raise(rb_eArgError, "Invalid expected %s digest: %"PRIsVALUE, digest_name(type), rb_inspect(hex));
+  }
+  return ST_CONTINUE;
 }
 
 /* Set the options on the Curl handle from a Request object. Takes each field
@@ -496,19 +1916,100 @@ static void set_options_from_request(VALUE self, VALUE request) {
   VALUE ssl_version           = Qnil;
   VALUE http_version          = Qnil;
   VALUE buffer_size           = Qnil;
+  VALUE if_modified_since     = Qnil;
   VALUE action_name           = rb_funcall(request, rb_intern("action"), 0);
   VALUE a_c_encoding          = rb_funcall(request, rb_intern("automatic_content_encoding"), 0);
+  VALUE keep_encoding         = rb_funcall(request, rb_intern("keep_content_encoding"), 0);
   VALUE download_byte_limit   = rb_funcall(request, rb_intern("download_byte_limit"), 0);
+  VALUE decompressed_byte_limit = rb_funcall(request, rb_intern("decompressed_byte_limit"), 0);
   VALUE maybe_progress_proc   = rb_funcall(request, rb_intern("progress_callback"), 0);
+  VALUE progress_interval     = rb_funcall(request, rb_intern("progress_interval"), 0);
+  VALUE progress_bytes        = rb_funcall(request, rb_intern("progress_bytes"), 0);
+  VALUE digest_names          = rb_funcall(request, rb_intern("digest"), 0);
+  VALUE expected_digest       = rb_funcall(request, rb_intern("expected_digest"), 0);
+  VALUE verify_content_digest = rb_funcall(request, rb_intern("verify_content_digest"), 0);
+  VALUE upload_digest_names   = rb_funcall(request, rb_intern("upload_digest"), 0);
+  VALUE on_headers            = rb_funcall(request, rb_intern("on_headers"), 0);
+  VALUE fail_on_status        = rb_funcall(request, rb_intern("fail_on_status"), 0);
+  VALUE max_content_length    = rb_funcall(request, rb_intern("max_content_length"), 0);
+  VALUE stream_mode           = rb_funcall(request, rb_intern("stream"), 0);
+  VALUE stream_callback       = rb_funcall(request, rb_intern("stream_callback"), 0);
+  VALUE last_event_id         = rb_funcall(request, rb_intern("last_event_id"), 0);
+  VALUE compress_name         = rb_funcall(request, rb_intern("compress_request"), 0);
+  VALUE compress_level        = rb_funcall(request, rb_intern("compress_request_level"), 0);
+  int compression             = COMPRESS_NONE;
 
   state->handle = curl;
+  state->upload_values = Qnil;
   curl_easy_setopt(curl, CURLOPT_SHARE, state->share);
 
   if (RTEST(download_byte_limit)) {
-    state->download_byte_limit = FIX2INT(download_byte_limit);
+    state->download_byte_limit = NUM2SIZET(download_byte_limit);
   } else {
     state->download_byte_limit = 0;
   }
+  state->decompressed_byte_limit = RTEST(decompressed_byte_limit) ? NUM2SIZET(decompressed_byte_limit) : 0;
+  state->body_bytes = 0;
+
+  digest_expect_none(&state->body_expected);
+  if (RTEST(expected_digest)) {
+    if (rb_type(expected_digest) != T_HASH) {
+      rb_raise(rb_eArgError, "Expected digests must be passed in a hash.");
+    }
+    rb_hash_foreach(expected_digest, each_expected_digest, (VALUE) state);
+  }
+  digest_init(&state->body_digest, digest_types(digest_names) | state->body_expected.types);
+  state->content_digest_pending = RTEST(verify_content_digest);
+  digest_init(&state->upload_digest, digest_types(upload_digest_names));
+
+  if (!NIL_P(compress_name)) {
+    ID compress_id = rb_to_id(compress_name);
+    if (compress_id == rb_intern("gzip")) {
+      compression = COMPRESS_GZIP;
+    } else if (compress_id == rb_intern("zstd")) {
+      compression = COMPRESS_ZSTD;
+    }
+    if (!compressor_supported(compression)) {
+      rb_raise(rb_eArgError, "Unsupported request compression: %"PRIsVALUE, rb_inspect(compress_name));
+    }
+  }
+  compressor_destroy(&state->upload_compressor);
+  state->upload_read = NULL;
+  if (COMPRESS_NONE != compression &&
+      COMPRESSOR_OK != compressor_start(&state->upload_compressor, compression,
+                                        NIL_P(compress_level) ? COMPRESSOR_DEFAULT_LEVEL : NUM2INT(compress_level))) {
+    rb_raise(rb_eArgError, "Invalid request compression level: %"PRIsVALUE, rb_inspect(compress_level));
+  }
+
+  state->on_headers_blk = rb_obj_is_proc(on_headers) ? on_headers : Qnil;
+  memset(state->fail_on_status, 0, sizeof(state->fail_on_status));
+  set_fail_on_status(state, fail_on_status);
+  state->max_content_length = RTEST(max_content_length) ? NUM2LL(max_content_length) : -1;
+  state->check_headers = RTEST(state->on_headers_blk) || RTEST(fail_on_status) || state->max_content_length >= 0;
+  state->headers_rejected = 0;
+
+  eventstream_destroy(&state->stream);
+  eventstream_init(&state->stream, 0, NULL, 0);
+  state->stream_blk = Qnil;
+  state->streaming = -1;
+  if (RTEST(stream_mode)) {
+    int mode = 0;
+    if (stream_mode == ID2SYM(rb_intern("lines"))) { mode = EVENTSTREAM_LINES; }
+    if (stream_mode == ID2SYM(rb_intern("events"))) { mode = EVENTSTREAM_EVENTS; }
+    if (!mode) {
+      rb_raise(rb_eArgError, "Unsupported stream: %"PRIsVALUE, rb_inspect(stream_mode));
+    }
+    if (!rb_obj_is_proc(stream_callback)) {
+      rb_raise(rb_eArgError, "A streamed body needs a stream_callback");
+    }
+    if (RTEST(last_event_id)) {
+      StringValue(last_event_id);
+      eventstream_init(&state->stream, mode, RSTRING_PTR(last_event_id), RSTRING_LEN(last_event_id));
+    } else {
+      eventstream_init(&state->stream, mode, NULL, 0);
+    }
+    state->stream_blk = stream_callback;
+  }
 
   if (rb_obj_is_proc(maybe_progress_proc)) {
     state->user_progress_blk = maybe_progress_proc;
@@ -516,6 +2017,15 @@ static void set_options_from_request(VALUE self, VALUE request) {
     state->user_progress_blk = Qnil;
   }
 
+  state->progress_interval_us = RTEST(progress_interval) ? (curl_off_t) (NUM2DBL(progress_interval) * 1000000) : 0;
+  state->progress_bytes = RTEST(progress_bytes) ? NUM2SIZET(progress_bytes) : 0;
+  state->progress_reported_at_us = 0;
+  state->progress_reported_bytes = 0;
+  state->progress_reported_dlnow = 0;
+  state->progress_delivered = 0;
+  state->progress_suppressed = 0;
+  state->callback_exception_tag = 0;
+
   headers = rb_funcall(request, rb_intern("headers"), 0);
   if (RTEST(headers)) {
     if (rb_type(headers) != T_HASH) {
@@ -538,14 +2048,53 @@ static void set_options_from_request(VALUE self, VALUE request) {
       curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "GET");
     }
     if (RTEST(download_file)) {
-      // we need the WRITEDATA option for the file destination
-      state->download_file = open_file(download_file, "wb");
-      curl_easy_setopt(curl, CURLOPT_WRITEDATA, state->download_file);
-      // curl docs say that CURLOPT_WRITEFUNCTION must be set too
-      // to avoid issues on Windows
+      VALUE resume_from = rb_funcall(request, rb_intern("resume_from"), 0);
+      int sink_flags = 0;
+      int rc = FS_OK;
+      if (RTEST(rb_funcall(request, rb_intern("download_fsync"), 0))) { sink_flags |= FS_FSYNC; }
+      if (RTEST(rb_funcall(request, rb_intern("download_direct_io"), 0))) { sink_flags |= FS_DIRECT; }
+      state->keep_filetime = RTEST(rb_funcall(request, rb_intern("download_filetime"), 0));
+      if (state->keep_filetime) {
+        /* Ask for the Last-Modified date, so that the file can be given it as its mtime */
+        curl_easy_setopt(curl, CURLOPT_FILETIME, 1L);
+      }
+
+      filesink_abort(&state->download_sink); /* left open if setting the options failed last time */
+      state->resume_body = RESUME_BODY_REPLACES;
+      if (rb_respond_to(download_file, rb_intern("fileno"))) {
+        /* An IO, like a pipe or a socket. Whatever it has buffered needs to go out before the body */
+        VALUE io_buffer_size = rb_funcall(request, rb_intern("download_io_buffer_size"), 0);
+        VALUE fileno = rb_funcall(download_file, rb_intern("fileno"), 0);
+        if (NIL_P(fileno)) {
+          /* A StringIO, say, which has nothing to write to without the GVL */
+          rb_raise(rb_eArgError, "The IO to download to has no file descriptor");
+        }
+        if (rb_respond_to(download_file, rb_intern("flush"))) {
+          rb_funcall(download_file, rb_intern("flush"), 0);
+        }
+        state->resume_from = -1;
+        rc = filesink_open_fd(&state->download_sink, NUM2INT(fileno),
+                              RTEST(io_buffer_size) ? NUM2SIZET(io_buffer_size) : 0, sink_flags);
+      } else if (NIL_P(resume_from)) {
+        state->resume_from = -1;
+        rc = filesink_open(&state->download_sink, StringValueCStr(download_file), sink_flags);
+      } else {
+        state->resume_from = (curl_off_t) NUM2LL(resume_from);
+        rc = filesink_open_resumable(&state->download_sink, StringValueCStr(download_file), (off_t) state->resume_from, sink_flags);
+        if (state->resume_from > 0) {
+          /* Not CURLOPT_RESUME_FROM_LARGE, since with it libCURL fails the request when the
+             server responds with the complete file - which is what If-Range asks for when
+             the file has changed */
+          char range[64];
+          snprintf(range, sizeof(range), "%" CURL_FORMAT_CURL_OFF_T "-", state->resume_from);
+          curl_easy_setopt(curl, CURLOPT_RANGE, range);
+        }
+      }
+      if (FS_OK != rc) {
+        rb_raise(rb_eArgError, "Unable to open specified file: %s", strerror(state->download_sink.error));
+      }
+      curl_easy_setopt(curl, CURLOPT_WRITEDATA, state);
       curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, &file_write_handler);
-    } else {
-      state->download_file = NULL;
     }
   } else if (action == rb_intern("post") || action == rb_intern("put") || action == rb_intern("patch")) {
     VALUE data = rb_funcall(request, rb_intern("upload_data"), 0);
@@ -569,20 +2118,7 @@ static void set_options_from_request(VALUE self, VALUE request) {
       set_chunked_encoding(state);
       set_request_body_file(state, filename);
     } else if (RTEST(multipart)) {
-      if (action == rb_intern("post")) {
-        if(RTEST(data) && RTEST(filename)) {
-          if (rb_type(data) == T_HASH && rb_type(filename) == T_HASH) {
-            rb_hash_foreach(data, formadd_values, self);
-            rb_hash_foreach(filename, formadd_files, self);
-          } else {
-            rb_raise(rb_eArgError, "Data and Filename must be passed in a hash.");
-          }
-        }
-        curl_easy_setopt(curl, CURLOPT_HTTPPOST, state->post);
-      } else {
-         rb_raise(rb_eArgError, "Multipart PUT not supported");
-      }
-
+      set_request_body_multipart(state, request);
     } else {
       rb_raise(rb_eArgError, "Must provide either data or a filename when doing a PUT or POST");
     }
@@ -591,16 +2127,15 @@ static void set_options_from_request(VALUE self, VALUE request) {
   } else if (action == rb_intern("delete")) {
       VALUE data = rb_funcall(request, rb_intern("upload_data"), 0);
       if (RTEST(data)) {
-        long len = RSTRING_LEN(data);
-        state->upload_buf = StringValuePtr(data);
         curl_easy_setopt(curl, CURLOPT_POST, 1);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, state->upload_buf);
-        curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, len);
+        set_request_body_string(state, rb_funcall(data, rb_intern("to_s"), 0));
       }
       curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, "DELETE");
 
   } else if (action == rb_intern("head")) {
     curl_easy_setopt(curl, CURLOPT_NOBODY, 1);
+    /* There is no body to be limited */
+    state->max_content_length = -1;
   } else {
     VALUE action_name = rb_funcall(request, rb_intern("action_name"), 0);
     curl_easy_setopt(curl, CURLOPT_CUSTOMREQUEST, StringValuePtr(action_name));
@@ -621,13 +2156,36 @@ static void set_options_from_request(VALUE self, VALUE request) {
         "The libcurl version installed doesn't support automatic content negotiation");
     #endif
   }
+
+  // Keep the body as it was sent, for Response#body to decode if it gets used. Only
+  // encodings which can be decoded then are asked for.
+  state->keep_content_encoding = RTEST(keep_encoding);
+  if (state->keep_content_encoding) {
+    curl_easy_setopt(curl, CURLOPT_HTTP_CONTENT_DECODING, 0L);
+    if (RTEST(a_c_encoding)) {
+    #ifdef CURLOPT_ACCEPT_ENCODING
+      curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, DECOMPRESSOR_ACCEPT_ENCODING);
+    #elif defined CURLOPT_ENCODING
+      curl_easy_setopt(curl, CURLOPT_ENCODING, DECOMPRESSOR_ACCEPT_ENCODING);
+    #endif
+    }
+  }
   
   url = rb_funcall(request, rb_intern("url"), 0);
   if (!RTEST(url)) {
     rb_raise(rb_eArgError, "Must provide a URL");
   }
+#if LIBCURL_VERSION_NUM >= 0x073F00
+  /* this is libCURLv7.63.0 or later, reuse the URL parsed by build_url if it is the same one */
+  if (state->url && url == state->url_str) {
+    curl_easy_setopt(curl, CURLOPT_CURLU, state->url);
+  } else {
+    curl_easy_setopt(curl, CURLOPT_URL, StringValuePtr(url));
+  }
+#else
   curl_easy_setopt(curl, CURLOPT_URL, StringValuePtr(url));
-  
+#endif
+
     
   timeout = rb_funcall(request, rb_intern("timeout"), 0);
   if (RTEST(timeout)) {
@@ -654,11 +2212,24 @@ static void set_options_from_request(VALUE self, VALUE request) {
     curl_easy_setopt(curl, CURLOPT_LOW_SPEED_LIMIT, FIX2LONG(low_speed_limit_bytes_per_second));
   }
 
+  if_modified_since = rb_funcall(request, rb_intern("if_modified_since"), 0);
+  if (RTEST(if_modified_since)) {
+    curl_easy_setopt(curl, CURLOPT_TIMECONDITION, (long) CURL_TIMECOND_IFMODSINCE);
+#if LIBCURL_VERSION_NUM >= 0x073B00
+    /* this is libCURLv7.59.0 or later, supports CURLOPT_TIMEVALUE_LARGE */
+    curl_easy_setopt(curl, CURLOPT_TIMEVALUE_LARGE, (curl_off_t) NUM2LL(if_modified_since));
+#else
+    curl_easy_setopt(curl, CURLOPT_TIMEVALUE, NUM2LONG(if_modified_since));
+#endif
+  }
+
   redirects = rb_funcall(request, rb_intern("max_redirects"), 0);
+  state->follow_redirects = 0;
   if (RTEST(redirects)) {
     int r = FIX2INT(redirects);
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, r == 0 ? 0 : 1);
     curl_easy_setopt(curl, CURLOPT_MAXREDIRS, r);
+    state->follow_redirects = r != 0;
   }
 
   proxy = rb_funcall(request, rb_intern("proxy"), 0);
@@ -767,13 +2338,30 @@ static void set_options_from_request(VALUE self, VALUE request) {
   }
 }
 
+/* Returns the targets of the links collected from the Link headers by their relation types. When
+   several links have the same relation type the first one is kept. */
+static VALUE links_to_rb_hash(const membuffer* links) {
+  VALUE hash = rb_hash_new();
+  linkheader_link link;
+  size_t offset = 0;
+
+  while (linkheader_next(links, &offset, &link)) {
+    VALUE rel = rb_usascii_str_new(link.rel, link.rel_length);
+    if (NIL_P(rb_hash_lookup(hash, rel))) {
+      rb_hash_aset(hash, rel, rb_usascii_str_new(link.target, link.target_length));
+    }
+  }
+  return hash;
+}
+
 /* Use the info in a Curl handle to create a new Response object. */
-static VALUE create_response(VALUE self, CURL* curl, VALUE header_buffer, VALUE body_buffer) {
+static VALUE create_response(VALUE self, CURL* curl, VALUE header_buffer, VALUE body_buffer, const membuffer* links) {
   VALUE args[6] = { Qnil, Qnil, Qnil, Qnil, Qnil, Qnil };
   char* effective_url = NULL;
   long code = 0;
   long count = 0;
   VALUE responseKlass = Qnil;
+  VALUE response = Qnil;
   
   curl_easy_getinfo(curl, CURLINFO_EFFECTIVE_URL, &effective_url);
   args[0] = rb_str_new2(effective_url);
@@ -789,7 +2377,23 @@ static VALUE create_response(VALUE self, CURL* curl, VALUE header_buffer, VALUE
   args[5] = rb_funcall(self, rb_intern("default_response_charset"), 0);
   
   responseKlass = rb_funcall(self, rb_intern("response_class"), 0);
-  return rb_class_new_instance(6, args, responseKlass);
+  response = rb_class_new_instance(6, args, responseKlass);
+  if (links->length > 0) {
+    rb_ivar_set(response, rb_intern("@links"), links_to_rb_hash(links));
+  }
+  return response;
+}
+
+/* With keep_content_encoding the body is left as it was received, for the Response to decode it
+   once it gets used */
+static void keep_encoded_body(struct patron_curl_state* state, VALUE response, VALUE body_str) {
+  if (!state->keep_content_encoding || NIL_P(body_str)) { return; }
+
+  rb_ivar_set(response, rb_intern("@raw_body"), body_str);
+  rb_ivar_set(response, rb_intern("@body"), Qnil);
+  if (state->decompressed_byte_limit) {
+    rb_ivar_set(response, rb_intern("@decompressed_byte_limit"), SIZET2NUM(state->decompressed_byte_limit));
+  }
 }
 
 /* Raise an exception based on the Curl error code. */
@@ -812,14 +2416,71 @@ static VALUE select_error(CURLcode code) {
 
 
 struct perform_context {
-  CURL *curl;
+  struct patron_curl_state *state;
   CURLcode code;
 };
 
+#if LIBCURL_VERSION_NUM >= 0x074400
+/* Runs the transfer on the multi handle of the session. Instead of blocking inside
+   curl_easy_perform we wait on the sockets with curl_multi_poll, which returns as
+   soon as curl_multi_wakeup gets called from the unblocking function or from
+   Session#interrupt. The interrupt is then noticed in milliseconds. */
+static CURLcode multi_perform(struct patron_curl_state *state) {
+  CURLM* multi = state->multi;
+  CURL* curl = state->handle;
+  CURLcode code = CURLE_ABORTED_BY_CALLBACK;
+  CURLMcode mcode = CURLM_OK;
+  CURLMsg* msg = NULL;
+  int running = 1;
+  int queued = 0;
+
+  mcode = curl_multi_add_handle(multi, curl);
+  if (CURLM_OK != mcode) {
+    snprintf(state->error_buf, CURL_ERROR_SIZE, "%s", curl_multi_strerror(mcode));
+    return CURLE_FAILED_INIT;
+  }
+
+  while (running && !state->interrupt) {
+    mcode = curl_multi_perform(multi, &running);
+    if (CURLM_OK == mcode && running && !state->interrupt) {
+      mcode = curl_multi_poll(multi, NULL, 0, 1000, NULL);
+    }
+    if (CURLM_OK != mcode) {
+      break;
+    }
+  }
+
+  while ((msg = curl_multi_info_read(multi, &queued))) {
+    if (CURLMSG_DONE == msg->msg && curl == msg->easy_handle) {
+      code = msg->data.result;
+      running = 0;
+    }
+  }
+
+  if (running) {
+    /* The transfer did not complete, so we either got interrupted or the multi handle failed */
+    if (CURLM_OK != mcode) {
+      snprintf(state->error_buf, CURL_ERROR_SIZE, "%s", curl_multi_strerror(mcode));
+      code = CURLE_RECV_ERROR;
+    } else {
+      snprintf(state->error_buf, CURL_ERROR_SIZE, "Request was interrupted");
+      code = CURLE_ABORTED_BY_CALLBACK;
+    }
+  }
+
+  curl_multi_remove_handle(multi, curl);
+  return code;
+}
+#endif
+
 static void *perform_without_gvl(void *ptr) {
   struct perform_context *context = ptr;
 
-  context->code = curl_easy_perform(context->curl);
+#if LIBCURL_VERSION_NUM >= 0x074400
+  context->code = multi_perform(context->state);
+#else
+  context->code = curl_easy_perform(context->state->handle);
+#endif
   return NULL;
 }
 
@@ -830,27 +2491,214 @@ static void *perform_without_gvl(void *ptr) {
 */
 void session_ubf_abort(void* patron_state) {
   struct patron_curl_state* state = (struct patron_curl_state*) patron_state;
-  state->interrupt = INTERRUPT_ABORT;
+  session_wakeup_abort(state);
+}
+
+/*
+ * Returns non-zero if the server answered that the requested document has not
+ * been modified, either to an If-None-Match header or to the time condition.
+ */
+static int download_not_modified(CURL* curl) {
+  long code = 0;
+  long unmet = 0;
+
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+  curl_easy_getinfo(curl, CURLINFO_CONDITION_UNMET, &unmet);
+  return 304 == code || unmet;
+}
+
+/* Returns the Last-Modified date of the downloaded document, or -1 if the server did not send one */
+static time_t download_filetime(CURL* curl) {
+#if LIBCURL_VERSION_NUM >= 0x073B00
+  /* this is libCURLv7.59.0 or later, supports CURLINFO_FILETIME_T */
+  curl_off_t filetime = -1;
+  curl_easy_getinfo(curl, CURLINFO_FILETIME_T, &filetime);
+#else
+  long filetime = -1;
+  curl_easy_getinfo(curl, CURLINFO_FILETIME, &filetime);
+#endif
+  return (time_t) filetime;
+}
+
+/* Returns the hex encoded digests by their names */
+static VALUE digests_to_rb_hash(digest* d) {
+  static const int types[] = { DIGEST_SHA256, DIGEST_MD5, DIGEST_CRC32C };
+  VALUE hash = rb_hash_new();
+  size_t i;
+
+  for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+    char hex[DIGEST_HEX_SIZE];
+    size_t hex_length = digest_hex(d, types[i], hex);
+    if (hex_length > 0) {
+      rb_hash_aset(hash, ID2SYM(rb_intern(digest_name(types[i]))), rb_str_new(hex, hex_length));
+    }
+  }
+  return hash;
+}
+
+/* Returns the type of a digest of the finished body which does not have the expected value, or
+   DIGEST_NONE. Only complete bodies of successful responses are checked, as the expected digests
+   are those of the document - a resumed download has its digests carried over the partial file. */
+static int body_digest_mismatch(struct patron_curl_state* state, CURL* curl) {
+  long status = 0;
+
+  if (DIGEST_NONE == state->body_expected.types) { return DIGEST_NONE; }
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+  if (status < 200 || status > 299 || (206 == status && RESUME_BODY_APPENDS != state->resume_body)) {
+    return DIGEST_NONE;
+  }
+  return digest_verify(&state->body_digest, &state->body_expected);
+}
+
+/* Raises ResponseRejected with the Response whose headers were rejected, which has no body */
+static void raise_response_rejected(VALUE self, struct patron_curl_state* state, CURL* curl) {
+  VALUE response = create_response(self, curl, membuffer_to_rb_str(&state->header_buffer), Qnil, &state->links);
+  VALUE error;
+  long status = 0;
+
+  curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
+  switch (state->headers_rejected) {
+    case REJECTED_STATUS:
+      error = rb_exc_new_str(eResponseRejected, rb_sprintf("Response status %ld rejected by fail_on_status", status));
+      break;
+    case REJECTED_LENGTH:
+      error = rb_exc_new_str(eResponseRejected, rb_sprintf("Response body exceeds the max_content_length of %lld bytes",
+                                                           (long long) state->max_content_length));
+      break;
+    default:
+      error = rb_exc_new_cstr(eResponseRejected, "Response rejected by the on_headers callback");
+  }
+  rb_ivar_set(error, rb_intern("@response"), response);
+  rb_exc_raise(error);
+}
+
+struct commit_context {
+  struct patron_curl_state *state;
+  int rc;
+};
+
+/* Writes out what is left of the download, which may need to wait for the reader of a pipe
+   (possibly a Ruby thread) or for the disk, so this runs without the GVL */
+static void *commit_download_without_gvl(void *ptr) {
+  struct commit_context *context = ptr;
+  context->rc = filesink_commit(&context->state->download_sink);
+  return NULL;
 }
 
 /* Perform the actual HTTP request by calling libcurl. */
 static VALUE perform_request(VALUE self) {
   struct patron_curl_state *state = get_patron_curl_state(self);
   CURL* curl = state->handle;
-  struct perform_context context = {curl, 0};
+  struct perform_context context = {state, CURLE_OK};
+  VALUE response = Qnil;
+  int mismatch;
 
   state->interrupt = 0;            /* clear the interrupt flag */
 
+  cs_list_set_in_flight(state, 1);
   rb_thread_call_without_gvl(perform_without_gvl, &context, session_ubf_abort, state);
 
+  /* Re-raise whatever the progress proc or an IO being uploaded raised, now that libCURL is out of the way */
+  if (state->callback_exception_tag) {
+    rb_jump_tag(state->callback_exception_tag);
+  }
+
+  if (INTERRUPT_ABORT == state->interrupt && CURLE_WRITE_ERROR == context.code) {
+    /* The body was being written to a pipe or socket which was full */
+    rb_raise(eAborted, "Request was interrupted");
+  }
+  if (INTERRUPT_HEADERS_REJECTED == state->interrupt && CURLE_WRITE_ERROR == context.code) {
+    raise_response_rejected(self, state, curl);
+  }
+  if (INTERRUPT_DOWNLOAD_OVERFLOW == state->interrupt && CURLE_OK != context.code) {
+    rb_raise(eAborted, "Response body exceeded the download_byte_limit of %lu bytes",
+             (unsigned long) state->download_byte_limit);
+  }
+  if (INTERRUPT_DECOMPRESSED_OVERFLOW == state->interrupt && CURLE_OK != context.code) {
+    rb_raise(eAborted, "Decompressed response body exceeded the decompressed_byte_limit of %lu bytes",
+             (unsigned long) state->decompressed_byte_limit);
+  }
+
   if (CURLE_OK == context.code) {
     VALUE header_str = membuffer_to_rb_str(&state->header_buffer);
     VALUE body_str = Qnil;
-    if (!state->download_file) { body_str = membuffer_to_rb_str(&state->body_buffer); }
+    if (filesink_is_open(&state->download_sink) && state->resume_from >= 0 && 0 == state->body_bytes) {
+      /* There was no body to write, so the status of the response has not been looked at yet */
+      if (FS_OK != resume_start_body(state, 0)) {
+        rb_raise(ePatronError, "Unable to save the downloaded file: %s", strerror(state->download_sink.error));
+      }
+    }
+    if (state->streaming > 0) {
+      /* A last line without a line ending */
+      if (EVENTSTREAM_OK != eventstream_finish(&state->stream)) {
+        rb_raise(ePatronError, "Unable to frame the streamed response body");
+      }
+      stream_records_to_blk((VALUE) state);
+    }
+    if (state->content_digest_pending) {
+      /* There was no body, so the digest headers have not been looked at yet */
+      expect_content_digest(state);
+    }
+    digest_final(&state->body_digest);
+    mismatch = body_digest_mismatch(state, curl);
+    if (DIGEST_NONE != mismatch) {
+      if (filesink_is_open(&state->download_sink) && state->resume_from >= 0) {
+        /* A partial file which does not add up to the document is no use for resuming */
+        filesink_restart(&state->download_sink);
+      }
+      /* The download, if any, gets discarded by the cleanup */
+      rb_raise(eDigestMismatch, "The %s digest of the response body does not match the expected one",
+               digest_name(mismatch));
+    }
+    if (filesink_is_open(&state->download_sink) && download_not_modified(curl)) {
+      /* The file at the destination is current, leave it alone */
+      filesink_abort(&state->download_sink);
+    } else if (filesink_is_open(&state->download_sink) && RESUME_BODY_DISCARD == state->resume_body) {
+      /* Keep the partial file for another attempt */
+      filesink_abort(&state->download_sink);
+    } else if (filesink_is_open(&state->download_sink)) {
+      char* metadata_path = state->resume_from >= 0 ? resume_metadata_path(&state->download_sink) : NULL;
+      struct commit_context commit;
+
+      if (state->resume_from >= 0 && !resume_complete(state)) {
+        free(metadata_path);
+        rb_raise(ePartialFileError, "The resumed download does not add up to the size of the file");
+      }
+      if (state->keep_filetime) {
+        filesink_set_mtime(&state->download_sink, download_filetime(curl));
+      }
+      /* Only now does the downloaded file replace the destination */
+      commit.state = state;
+      commit.rc = FS_OK;
+      rb_thread_call_without_gvl(commit_download_without_gvl, &commit, session_ubf_abort, state);
+      if (FS_OK != commit.rc) {
+        free(metadata_path);
+        rb_raise(ePatronError, "Unable to save the downloaded file: %s", strerror(state->download_sink.error));
+      }
+      if (metadata_path) {
+        unlink(metadata_path);
+        free(metadata_path);
+      }
+    } else {
+      body_str = membuffer_to_rb_str(&state->body_buffer);
+    }
     
     curl_easy_setopt(curl, CURLOPT_COOKIELIST, "FLUSH"); // Flush cookies to the cookie jar
     
-    return create_response(self, curl, header_str, body_str);
+    response = create_response(self, curl, header_str, body_str, &state->links);
+    keep_encoded_body(state, response, body_str);
+    if (DIGEST_NONE != state->body_digest.types) {
+      rb_ivar_set(response, rb_intern("@digests"), digests_to_rb_hash(&state->body_digest));
+    }
+    if (state->upload_read && DIGEST_NONE != state->upload_digest.types) {
+      digest_final(&state->upload_digest);
+      rb_ivar_set(response, rb_intern("@upload_digests"), digests_to_rb_hash(&state->upload_digest));
+    }
+    if (state->upload_read && COMPRESS_NONE != state->upload_compressor.type) {
+      rb_ivar_set(response, rb_intern("@upload_bytes"), SIZET2NUM(state->upload_compressor.bytes_in));
+      rb_ivar_set(response, rb_intern("@compressed_upload_bytes"), SIZET2NUM(state->upload_compressor.bytes_out));
+    }
+    return response;
   } else {
     rb_raise(select_error(context.code), "%s", state->error_buf);
   }
@@ -862,30 +2710,63 @@ static VALUE perform_request(VALUE self) {
 static VALUE cleanup(VALUE self) {
   struct patron_curl_state *state = get_patron_curl_state(self);
   curl_easy_cleanup(state->handle);
+  cs_list_set_in_flight(state, 0);
 
   if (state->headers) {
     curl_slist_free_all(state->headers);
     state->headers = NULL;
   }
   membuffer_clear(&state->header_buffer);
+  membuffer_clear(&state->links);
+  eventstream_destroy(&state->stream);
+  eventstream_init(&state->stream, 0, NULL, 0);
+  state->stream_blk = Qnil;
+
+  if (state->segments) {
+    int i;
+    for (i = 0; i < state->segment_count; i++) {
+      curl_easy_cleanup(state->segments[i].handle);
+    }
+    ruby_xfree(state->segments);
+    state->segments = NULL;
+    state->segment_count = 0;
+  }
+
+  if (state->transfers) {
+    int i;
+    for (i = 0; i < state->transfer_count; i++) {
+      curl_easy_cleanup(state->transfers[i].handle);
+      membuffer_destroy(&state->transfers[i].header_buffer);
+      membuffer_destroy(&state->transfers[i].links);
+      membuffer_destroy(&state->transfers[i].body_buffer);
+      curl_slist_free_all(state->transfers[i].headers);
+    }
+    ruby_xfree(state->transfers);
+    state->transfers = NULL;
+    state->transfer_count = 0;
+  }
 
-  if (state->download_file) {
-    fclose(state->download_file);
-    state->download_file = NULL;
+  if (filesink_is_open(&state->download_sink)) {
+    filesink_abort(&state->download_sink);
   } else {
     membuffer_clear(&state->body_buffer);
   }
 
-  if (state->request_body_file) {
-    fclose(state->request_body_file);
-    state->request_body_file = NULL;
-  }
+  filesource_close(&state->upload_source);
+  compressor_destroy(&state->upload_compressor);
+  state->upload_read = NULL;
   
+#if LIBCURL_VERSION_NUM >= 0x073800
+  curl_mime_free(state->mime);
+  state->mime = NULL;
+#else
   if (state->post) {
     curl_formfree(state->post);
     state->post = NULL;
     state->last = NULL;
   }
+#endif
+  state->upload_values = Qnil;
 
   state->upload_buf = NULL;
 
@@ -910,6 +2791,509 @@ static VALUE session_handle_request(VALUE self, VALUE request) {
   return rb_ensure(&perform_request, self, &cleanup, self);
 }
 
+#if LIBCURL_VERSION_NUM >= 0x074400
+/* Writes the data received for a segment at its offset in the download file */
+static size_t segment_write_handler(char* stream, size_t size, size_t nmemb, void* clientp) {
+  struct download_segment* segment = (struct download_segment*) clientp;
+  size_t len = size * nmemb;
+
+  if (!segment->checked) {
+    /* A server which ignores the Range sends the whole file, which must not end up at our offset */
+    long code = 0;
+    curl_easy_getinfo(segment->handle, CURLINFO_RESPONSE_CODE, &code);
+    if (206 != code) { return 0; }
+    segment->checked = 1;
+  }
+  if (segment->from + (curl_off_t) len > segment->to + 1) { return 0; }
+
+  if (FS_OK != filesink_write_at(&segment->state->download_sink, (off_t) segment->from, stream, len)) {
+    return 0;
+  }
+  segment->from += len;
+  return len;
+}
+
+/* Only the first segment collects its headers, for the response of the download */
+static size_t segment_header_handler(char* stream, size_t size, size_t nmemb, void* clientp) {
+  struct download_segment* segment = (struct download_segment*) clientp;
+  struct patron_curl_state* state = segment->state;
+  size_t len = size * nmemb;
+
+  if (segment != state->segments) { return len; }
+  if (MB_OK != membuffer_append(&state->header_buffer, stream, len)) { return 0; }
+  if (LINKHEADER_OK != linkheader_line(&state->links, stream, len)) { return 0; }
+  return len;
+}
+
+static int segment_progress_handler(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+  struct download_segment* segment = (struct download_segment*) clientp;
+  UNUSED_ARGUMENT(dltotal);
+  UNUSED_ARGUMENT(dlnow);
+  UNUSED_ARGUMENT(ultotal);
+  UNUSED_ARGUMENT(ulnow);
+  return segment->state->interrupt;
+}
+
+/* (Re)starts the transfer of whatever is still missing from the segment */
+static CURLMcode segment_start(struct download_segment* segment) {
+  char range[64];
+
+  snprintf(range, sizeof(range), "%" CURL_FORMAT_CURL_OFF_T "-%" CURL_FORMAT_CURL_OFF_T, segment->from, segment->to);
+  curl_easy_setopt(segment->handle, CURLOPT_RANGE, range);
+  if (segment == segment->state->segments) {
+    /* Only the headers of the last attempt make it into the response */
+    membuffer_clear(&segment->state->header_buffer);
+    membuffer_clear(&segment->state->links);
+  }
+  segment->checked = 0;
+  segment->attempts++;
+  return curl_multi_add_handle(segment->state->multi, segment->handle);
+}
+
+/* Runs all the segments concurrently on the multi handle of the session, retrying
+   a failed segment from where it stopped. Called without the GVL. */
+static void *segments_perform_without_gvl(void *ptr) {
+  struct perform_context *context = ptr;
+  struct patron_curl_state *state = context->state;
+  CURLM* multi = state->multi;
+  CURLMcode mcode = CURLM_OK;
+  CURLMsg* msg = NULL;
+  int remaining = 0;
+  int running = 0;
+  int queued = 0;
+  int i;
+
+  context->code = CURLE_OK;
+  for (i = 0; i < state->segment_count && CURLM_OK == mcode; i++) {
+    mcode = segment_start(&state->segments[i]);
+    remaining++;
+  }
+
+  while (CURLM_OK == mcode && CURLE_OK == context->code && remaining && !state->interrupt) {
+    mcode = curl_multi_perform(multi, &running);
+
+    while (CURLM_OK == mcode && (msg = curl_multi_info_read(multi, &queued))) {
+      struct download_segment* segment = NULL;
+      if (CURLMSG_DONE != msg->msg) { continue; }
+
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**) &segment);
+      curl_multi_remove_handle(multi, segment->handle);
+
+      if (CURLE_OK == msg->data.result && segment->from == segment->to + 1) {
+        remaining--;
+      } else if (segment->attempts < SEGMENT_ATTEMPTS && !state->interrupt && !state->download_sink.error) {
+        mcode = segment_start(segment);
+      } else {
+        context->code = CURLE_OK == msg->data.result ? CURLE_PARTIAL_FILE : msg->data.result;
+        snprintf(state->error_buf, CURL_ERROR_SIZE,
+                 "Range %" CURL_FORMAT_CURL_OFF_T "-%" CURL_FORMAT_CURL_OFF_T " failed after %d attempts: %s",
+                 segment->from, segment->to, segment->attempts, curl_easy_strerror(msg->data.result));
+      }
+    }
+
+    if (CURLM_OK == mcode && CURLE_OK == context->code && remaining && !state->interrupt) {
+      mcode = curl_multi_poll(multi, NULL, 0, 1000, NULL);
+    }
+  }
+
+  if (CURLM_OK != mcode) {
+    snprintf(state->error_buf, CURL_ERROR_SIZE, "%s", curl_multi_strerror(mcode));
+    context->code = CURLE_RECV_ERROR;
+  } else if (CURLE_OK == context->code && remaining) {
+    snprintf(state->error_buf, CURL_ERROR_SIZE, "Request was interrupted");
+    context->code = CURLE_ABORTED_BY_CALLBACK;
+  }
+
+  for (i = 0; i < state->segment_count; i++) {
+    curl_multi_remove_handle(multi, state->segments[i].handle);
+  }
+  return NULL;
+}
+
+/* Splits the download into the segments, each with its own handle copied from the request handle */
+static void segments_prepare(struct patron_curl_state *state, curl_off_t length, int count) {
+  curl_off_t segment_size;
+  int i;
+
+  if (count > (length + SEGMENT_MIN_SIZE - 1) / SEGMENT_MIN_SIZE) {
+    count = (int) ((length + SEGMENT_MIN_SIZE - 1) / SEGMENT_MIN_SIZE);
+  }
+  if (count < 1) { count = 1; }
+  segment_size = length / count;
+
+  state->segments = ruby_xcalloc(count, sizeof(struct download_segment));
+  state->segment_count = count;
+  for (i = 0; i < count; i++) {
+    struct download_segment* segment = &state->segments[i];
+    segment->state = state;
+    segment->from = segment_size * i;
+    segment->to = (i == count - 1) ? length - 1 : segment_size * (i + 1) - 1;
+    segment->handle = curl_easy_duphandle(state->handle);
+    if (!segment->handle) {
+      rb_raise(ePatronError, "Unable to create a handle for a download segment");
+    }
+    curl_easy_setopt(segment->handle, CURLOPT_PRIVATE, (char*) segment);
+    curl_easy_setopt(segment->handle, CURLOPT_WRITEFUNCTION, &segment_write_handler);
+    curl_easy_setopt(segment->handle, CURLOPT_WRITEDATA, segment);
+    curl_easy_setopt(segment->handle, CURLOPT_HEADERFUNCTION, &segment_header_handler);
+    curl_easy_setopt(segment->handle, CURLOPT_HEADERDATA, segment);
+    curl_easy_setopt(segment->handle, CURLOPT_XFERINFOFUNCTION, &segment_progress_handler);
+    curl_easy_setopt(segment->handle, CURLOPT_XFERINFODATA, segment);
+    /* Byte ranges have to refer to the file as stored, not to a compressed rendition of it */
+    curl_easy_setopt(segment->handle, CURLOPT_ACCEPT_ENCODING, NULL);
+  }
+}
+
+struct segmented_request {
+  VALUE self;
+  curl_off_t length;
+  int count;
+  int read_error;  /* the errno of reading the file back to digest it, or 0 */
+};
+
+/* Digests the file the segments were written into, which is done reading it back in once all of
+   them are in place. Called without the GVL. */
+static void *segments_digest_without_gvl(void *ptr) {
+  struct segmented_request *request = ptr;
+  struct patron_curl_state *state = get_patron_curl_state(request->self);
+
+  if (FS_OK != filesink_read_back(&state->download_sink, (off_t) request->length,
+                                  digest_read_back, &state->body_digest)) {
+    request->read_error = errno;
+  }
+  return NULL;
+}
+
+static VALUE perform_segmented_request(VALUE ptr) {
+  struct segmented_request *request = (struct segmented_request*) ptr;
+  struct patron_curl_state *state = get_patron_curl_state(request->self);
+  struct perform_context context = {state, CURLE_OK};
+  struct commit_context commit = {NULL, FS_OK};
+  VALUE response = Qnil;
+
+  state->interrupt = 0;
+  segments_prepare(state, request->length, request->count);
+  filesink_preallocate(&state->download_sink, (off_t) request->length);
+
+  cs_list_set_in_flight(state, 1);
+  rb_thread_call_without_gvl(segments_perform_without_gvl, &context, session_ubf_abort, state);
+
+  if (CURLE_OK != context.code) {
+    rb_raise(select_error(context.code), "%s", state->error_buf);
+  }
+  if (DIGEST_NONE != state->body_digest.types) {
+    int mismatch;
+    rb_thread_call_without_gvl(segments_digest_without_gvl, request, RUBY_UBF_IO, NULL);
+    if (request->read_error) {
+      rb_raise(ePatronError, "Unable to read the downloaded file back: %s", strerror(request->read_error));
+    }
+    digest_final(&state->body_digest);
+    mismatch = digest_verify(&state->body_digest, &state->body_expected);
+    if (DIGEST_NONE != mismatch) {
+      /* The download gets discarded by the cleanup */
+      rb_raise(eDigestMismatch, "The %s digest of the downloaded file does not match the expected one",
+               digest_name(mismatch));
+    }
+  }
+  /* Syncing and renaming a large file can take a while, see perform_request */
+  commit.state = state;
+  rb_thread_call_without_gvl(commit_download_without_gvl, &commit, session_ubf_abort, state);
+  if (FS_OK != commit.rc) {
+    rb_raise(ePatronError, "Unable to save the downloaded file: %s", strerror(state->download_sink.error));
+  }
+
+  response = create_response(request->self, state->segments[0].handle, membuffer_to_rb_str(&state->header_buffer),
+                             Qnil, &state->links);
+  if (DIGEST_NONE != state->body_digest.types) {
+    rb_ivar_set(response, rb_intern("@digests"), digests_to_rb_hash(&state->body_digest));
+  }
+  return response;
+}
+
+/*
+ * Downloads the file described by the +request+ in +segments+ byte ranges, which get
+ * fetched concurrently and written at their offsets into the file. The server has to
+ * support range requests and the total +length+ of the file has to be known upfront.
+ * Every segment gets retried a few times before the download fails. Segments smaller
+ * than a megabyte are not worth a connection of their own, so small files get fewer
+ * segments than requested.
+ *
+ * The response is the one of the first byte range, a 206 Partial Content, with the
+ * digests of the whole file if any were asked for.
+ *
+ * @param request[Patron::Request] the GET request with a `file_name` set
+ * @param length[Integer] the size of the file in bytes
+ * @param segments[Integer] the number of byte ranges to download at once
+ * @return [Patron::Response]
+ */
+static VALUE session_handle_segmented_request(VALUE self, VALUE request, VALUE length, VALUE segments) {
+  struct segmented_request segmented = {self, (curl_off_t) NUM2LL(length), NUM2INT(segments), 0};
+
+  if (segmented.length <= 0) {
+    rb_raise(rb_eArgError, "Segmented downloads need a known, non-zero length");
+  }
+  set_options_from_request(self, request);
+  if (!filesink_is_open(&get_patron_curl_state(self)->download_sink)) {
+    cleanup(self);
+    rb_raise(rb_eArgError, "Segmented downloads need a file to download to");
+  }
+  return rb_ensure(&perform_segmented_request, (VALUE) &segmented, &cleanup, self);
+}
+#endif
+
+#if LIBCURL_VERSION_NUM >= 0x074400
+/* Collects the body of a concurrent transfer, within the limits of the request */
+static size_t transfer_write_handler(char* stream, size_t size, size_t nmemb, void* clientp) {
+  struct concurrent_transfer* transfer = (struct concurrent_transfer*) clientp;
+
+  /* returning 0 aborts the transfer */
+  transfer->interrupt = body_limit_reached(transfer->state, transfer->handle, transfer->body_buffer.length + size * nmemb);
+  if (transfer->interrupt) { return 0; }
+  return session_write_handler(stream, size, nmemb, &transfer->body_buffer);
+}
+
+static size_t transfer_header_handler(char* stream, size_t size, size_t nmemb, void* clientp) {
+  struct concurrent_transfer* transfer = (struct concurrent_transfer*) clientp;
+  size_t len = session_write_handler(stream, size, nmemb, &transfer->header_buffer);
+
+  if (LINKHEADER_OK != linkheader_line(&transfer->links, stream, len)) { return 0; }
+  return len;
+}
+
+static int transfer_progress_handler(void* clientp, curl_off_t dltotal, curl_off_t dlnow, curl_off_t ultotal, curl_off_t ulnow) {
+  struct concurrent_transfer* transfer = (struct concurrent_transfer*) clientp;
+  UNUSED_ARGUMENT(dltotal);
+  UNUSED_ARGUMENT(dlnow);
+  UNUSED_ARGUMENT(ultotal);
+  UNUSED_ARGUMENT(ulnow);
+  return transfer->state->interrupt;
+}
+
+struct concurrent_request {
+  VALUE self;
+  VALUE urls;
+  VALUE headers;  /* the header lines of each of the urls, or nil */
+  int concurrency;
+  struct patron_curl_state *state;
+  CURLcode code;
+};
+
+/* Runs the transfers on the multi handle of the session, with no more than the concurrency of
+   the request at a time. Every transfer gets its own result, one failing does not stop the
+   others. Called without the GVL. */
+static void *transfers_perform_without_gvl(void *ptr) {
+  struct concurrent_request *context = ptr;
+  struct patron_curl_state *state = context->state;
+  CURLM* multi = state->multi;
+  CURLMcode mcode = CURLM_OK;
+  CURLMsg* msg = NULL;
+  int started = 0;
+  int remaining = state->transfer_count;
+  int running = 0;
+  int queued = 0;
+  int i;
+
+  context->code = CURLE_OK;
+  while (CURLM_OK == mcode && remaining && !state->interrupt) {
+    /* The transfers which have been started and are not done yet are the ones running */
+    while (CURLM_OK == mcode && started < state->transfer_count &&
+           started - (state->transfer_count - remaining) < context->concurrency) {
+      mcode = curl_multi_add_handle(multi, state->transfers[started++].handle);
+    }
+    if (CURLM_OK == mcode) {
+      mcode = curl_multi_perform(multi, &running);
+    }
+
+    while (CURLM_OK == mcode && (msg = curl_multi_info_read(multi, &queued))) {
+      struct concurrent_transfer* transfer = NULL;
+      if (CURLMSG_DONE != msg->msg) { continue; }
+
+      curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**) &transfer);
+      curl_multi_remove_handle(multi, transfer->handle);
+      transfer->code = msg->data.result;
+      remaining--;
+    }
+
+    if (CURLM_OK == mcode && remaining && !state->interrupt && (started == state->transfer_count ||
+        started - (state->transfer_count - remaining) >= context->concurrency)) {
+      mcode = curl_multi_poll(multi, NULL, 0, 1000, NULL);
+    }
+  }
+
+  if (CURLM_OK != mcode) {
+    snprintf(state->error_buf, CURL_ERROR_SIZE, "%s", curl_multi_strerror(mcode));
+    context->code = CURLE_RECV_ERROR;
+  } else if (remaining) {
+    snprintf(state->error_buf, CURL_ERROR_SIZE, "Request was interrupted");
+    context->code = CURLE_ABORTED_BY_CALLBACK;
+  }
+
+  for (i = 0; i < started; i++) {
+    curl_multi_remove_handle(multi, state->transfers[i].handle);
+  }
+  return NULL;
+}
+
+/* Sets the request headers of a transfer to the ones of the request, followed by its own
+   _header_lines_ */
+static void transfer_set_headers(struct concurrent_transfer* transfer, VALUE header_lines) {
+  struct curl_slist* header;
+  long i;
+
+  for (header = transfer->state->headers; header; header = header->next) {
+    transfer->headers = curl_slist_append(transfer->headers, header->data);
+  }
+  for (i = 0; i < RARRAY_LEN(header_lines); i++) {
+    transfer->headers = curl_slist_append(transfer->headers, StringValueCStr(RARRAY_AREF(header_lines, i)));
+  }
+  curl_easy_setopt(transfer->handle, CURLOPT_HTTPHEADER, transfer->headers);
+}
+
+/* Sets up a transfer to each of the _urls_, on a handle copied from the request handle. The
+   copies share the request body of the request handle instead of copying it. */
+static void transfers_prepare(struct patron_curl_state *state, VALUE urls, VALUE headers) {
+  long count = RARRAY_LEN(urls);
+  long i;
+
+  state->transfers = ruby_xcalloc(count, sizeof(struct concurrent_transfer));
+  state->transfer_count = (int) count;
+  for (i = 0; i < count; i++) {
+    struct concurrent_transfer* transfer = &state->transfers[i];
+    transfer->state = state;
+    membuffer_init(&transfer->header_buffer);
+    membuffer_init(&transfer->links);
+    membuffer_init(&transfer->body_buffer);
+    transfer->handle = curl_easy_duphandle(state->handle);
+    if (!transfer->handle) {
+      rb_raise(ePatronError, "Unable to create a handle for a concurrent request");
+    }
+#if LIBCURL_VERSION_NUM >= 0x073F00
+    curl_easy_setopt(transfer->handle, CURLOPT_CURLU, NULL);
+#endif
+    curl_easy_setopt(transfer->handle, CURLOPT_URL, StringValueCStr(RARRAY_AREF(urls, i)));
+    curl_easy_setopt(transfer->handle, CURLOPT_PRIVATE, (char*) transfer);
+    curl_easy_setopt(transfer->handle, CURLOPT_ERRORBUFFER, transfer->error_buf);
+    curl_easy_setopt(transfer->handle, CURLOPT_WRITEFUNCTION, &transfer_write_handler);
+    curl_easy_setopt(transfer->handle, CURLOPT_WRITEDATA, transfer);
+    curl_easy_setopt(transfer->handle, CURLOPT_HEADERFUNCTION, &transfer_header_handler);
+    curl_easy_setopt(transfer->handle, CURLOPT_HEADERDATA, transfer);
+    curl_easy_setopt(transfer->handle, CURLOPT_XFERINFOFUNCTION, &transfer_progress_handler);
+    curl_easy_setopt(transfer->handle, CURLOPT_XFERINFODATA, transfer);
+    if (!NIL_P(headers) && !NIL_P(RARRAY_AREF(headers, i))) {
+      transfer_set_headers(transfer, RARRAY_AREF(headers, i));
+    }
+  }
+}
+
+/* The Response of a finished transfer, or the Patron::Error it failed with */
+static VALUE transfer_result(VALUE self, struct concurrent_transfer* transfer) {
+  struct patron_curl_state *state = transfer->state;
+  VALUE response = Qnil;
+  VALUE body_str = Qnil;
+
+  if (INTERRUPT_DOWNLOAD_OVERFLOW == transfer->interrupt) {
+    return rb_exc_new_str(eAborted, rb_sprintf("Response body exceeded the download_byte_limit of %lu bytes",
+                                               (unsigned long) state->download_byte_limit));
+  }
+  if (INTERRUPT_DECOMPRESSED_OVERFLOW == transfer->interrupt) {
+    return rb_exc_new_str(eAborted, rb_sprintf("Decompressed response body exceeded the decompressed_byte_limit of %lu bytes",
+                                               (unsigned long) state->decompressed_byte_limit));
+  }
+  if (CURLE_OK != transfer->code) {
+    return rb_exc_new_cstr(select_error(transfer->code),
+                           transfer->error_buf[0] ? transfer->error_buf : curl_easy_strerror(transfer->code));
+  }
+
+  body_str = membuffer_to_rb_str(&transfer->body_buffer);
+  response = create_response(self, transfer->handle, membuffer_to_rb_str(&transfer->header_buffer), body_str, &transfer->links);
+  keep_encoded_body(state, response, body_str);
+  return response;
+}
+
+static VALUE perform_concurrent_requests(VALUE ptr) {
+  struct concurrent_request *request = (struct concurrent_request*) ptr;
+  struct patron_curl_state *state = request->state;
+  VALUE results = Qnil;
+  int i;
+
+  state->interrupt = 0;
+  transfers_prepare(state, request->urls, request->headers);
+
+  cs_list_set_in_flight(state, 1);
+  rb_thread_call_without_gvl(transfers_perform_without_gvl, request, session_ubf_abort, state);
+
+  if (CURLE_OK != request->code) {
+    rb_raise(select_error(request->code), "%s", state->error_buf);
+  }
+  curl_easy_setopt(state->handle, CURLOPT_COOKIELIST, "FLUSH");
+
+  results = rb_ary_new_capa(state->transfer_count);
+  for (i = 0; i < state->transfer_count; i++) {
+    rb_ary_push(results, transfer_result(request->self, &state->transfers[i]));
+  }
+  return results;
+}
+
+/*
+ * Sends the +request+ to every one of the +urls+, running up to +concurrency+ of them at
+ * once on the multi handle of the session. The request body has to be a String, which is
+ * sent to all of them straight from its memory. A request failing does not stop the others,
+ * its error is returned in place of its response.
+ *
+ * @param request[Patron::Request] the request to send, with a String `upload_data`
+ * @param urls[Array<String>] the complete URLs to send the request to
+ * @param concurrency[Integer] the number of requests to run at once
+ * @param headers[Array<Array<String>, nil>, nil] the "Name: value" lines of the headers sent to
+ *   each of the +urls+ in addition to the ones of the request, or nil
+ * @return [Array<Patron::Response, Patron::Error>] the result for each of the +urls+, in their order
+ */
+static VALUE session_handle_concurrent_requests(VALUE self, VALUE request, VALUE urls, VALUE concurrency, VALUE headers) {
+  struct patron_curl_state *state = get_patron_curl_state(self);
+  struct concurrent_request concurrent = {self, rb_check_array_type(urls), Qnil, NUM2INT(concurrency), state, CURLE_OK};
+  VALUE results = Qnil;
+  long i, j;
+
+  if (NIL_P(concurrent.urls)) {
+    rb_raise(rb_eArgError, "The URLs have to be an Array");
+  }
+  concurrent.urls = rb_ary_dup(concurrent.urls);
+  if (concurrent.concurrency < 1) {
+    rb_raise(rb_eArgError, "The concurrency has to be at least 1");
+  }
+  for (i = 0; i < RARRAY_LEN(concurrent.urls); i++) {
+    rb_ary_store(concurrent.urls, i, rb_str_new_frozen(StringValue(RARRAY_AREF(concurrent.urls, i))));
+  }
+  if (!NIL_P(headers)) {
+    concurrent.headers = rb_ary_dup(rb_convert_type(headers, T_ARRAY, "Array", "to_ary"));
+    if (RARRAY_LEN(concurrent.headers) != RARRAY_LEN(concurrent.urls)) {
+      rb_raise(rb_eArgError, "The headers have to be given for each of the URLs");
+    }
+    for (i = 0; i < RARRAY_LEN(concurrent.headers); i++) {
+      VALUE lines = RARRAY_AREF(concurrent.headers, i);
+      if (!NIL_P(lines)) {
+        lines = rb_ary_dup(rb_convert_type(lines, T_ARRAY, "Array", "to_ary"));
+        rb_ary_store(concurrent.headers, i, lines);
+        /* Converted up front, so that nothing can raise while the transfers are set up */
+        for (j = 0; j < RARRAY_LEN(lines); j++) {
+          VALUE line = rb_str_new_frozen(StringValue(RARRAY_AREF(lines, j)));
+          StringValueCStr(line);
+          rb_ary_store(lines, j, line);
+        }
+      }
+    }
+  }
+  set_options_from_request(self, request);
+  if (NULL == state->upload_buf && !NIL_P(rb_funcall(request, rb_intern("upload_data"), 0))) {
+    cleanup(self);
+    rb_raise(rb_eArgError, "Concurrent requests need a String body which is sent as it is");
+  }
+  results = rb_ensure(&perform_concurrent_requests, (VALUE) &concurrent, &cleanup, self);
+  RB_GC_GUARD(concurrent.urls);
+  RB_GC_GUARD(concurrent.headers);
+  return results;
+}
+#endif
+
 /* Interrupt any currently executing request. This will cause the current
  * request to error and raise an exception. The method can be called from another thread to
  * abort the request in-flight.
@@ -918,10 +3302,73 @@ static VALUE session_handle_request(VALUE self, VALUE request) {
  */
 static VALUE session_interrupt(VALUE self) {
   struct patron_curl_state *state = get_patron_curl_state(self);
-  state->interrupt = INTERRUPT_ABORT;
+  session_wakeup_abort(state);
   return self;
 }
 
+/*
+ * Returns how many times the progress callback was called during the most recent request.
+ *
+ * @return [Integer] the number of progress callbacks delivered
+ * @see #progress_callbacks_suppressed
+ */
+static VALUE session_progress_callbacks_delivered(VALUE self) {
+  struct patron_curl_state *state = get_patron_curl_state(self);
+  return ULONG2NUM(state->progress_delivered);
+}
+
+/*
+ * Returns how many progress updates from libCURL were skipped during the most recent request
+ * because of `progress_interval` or `progress_bytes`, without acquiring the GVL.
+ *
+ * @return [Integer] the number of progress callbacks suppressed
+ * @see #progress_callbacks_delivered
+ */
+static VALUE session_progress_callbacks_suppressed(VALUE self) {
+  struct patron_curl_state *state = get_patron_curl_state(self);
+  return ULONG2NUM(state->progress_suppressed);
+}
+
+/*
+ * Returns the number of Session objects which have not been garbage collected yet.
+ *
+ * @return [Integer] the number of live sessions
+ */
+static VALUE live_session_count(VALUE klass) {
+  unsigned long count = 0;
+  UNUSED_ARGUMENT(klass);
+
+  rb_nativethread_lock_lock(&cs_list_lock);
+  count = cs_list_live;
+  rb_nativethread_lock_unlock(&cs_list_lock);
+  return ULONG2NUM(count);
+}
+
+/*
+ * Returns the number of Session objects which are currently performing a request.
+ *
+ * @return [Integer] the number of sessions with a request in flight
+ */
+static VALUE in_flight_session_count(VALUE klass) {
+  unsigned long count = 0;
+  UNUSED_ARGUMENT(klass);
+
+  rb_nativethread_lock_lock(&cs_list_lock);
+  count = cs_list_in_flight;
+  rb_nativethread_lock_unlock(&cs_list_lock);
+  return ULONG2NUM(count);
+}
+
+/*
+ * Creates _dst_ as a reflink of the file at _src_. Returns false if the file
+ * system (or the platform) does not support reflinks, so that the caller can
+ * fall back to a copy.
+ */
+static VALUE download_cache_clone_file(VALUE self, VALUE src, VALUE dst) {
+  UNUSED_ARGUMENT(self);
+  return FS_OK == filesink_clone(StringValueCStr(src), StringValueCStr(dst)) ? Qtrue : Qfalse;
+}
+
 /*
  * Turn on cookie handling for this session, storing them in memory by
  * default or in +file+ if specified. The `file` must be readable and
@@ -978,6 +3425,7 @@ void Init_session_ext() {
   curl_global_init(CURL_GLOBAL_ALL);
   rb_require("patron/error");
 
+  rb_nativethread_lock_initialize(&cs_list_lock);
   rb_set_end_proc(&cs_list_interrupt, Qnil);
 
   mPatron = rb_define_module("Patron");
@@ -994,9 +3442,13 @@ void Init_session_ext() {
   eTimeoutError = rb_const_get(mPatron, rb_intern("TimeoutError"));
   eTooManyRedirects = rb_const_get(mPatron, rb_intern("TooManyRedirects"));
   eAborted = rb_const_get(mPatron, rb_intern("Aborted"));
+  eDigestMismatch = rb_const_get(mPatron, rb_intern("DigestMismatch"));
+  eResponseRejected = rb_const_get(mPatron, rb_intern("ResponseRejected"));
 
   rb_define_module_function(mPatron, "libcurl_version",       libcurl_version, 0);
   rb_define_module_function(mPatron, "libcurl_version_exact", libcurl_version_exact, 0);
+  rb_define_module_function(mPatron, "live_session_count",    live_session_count, 0);
+  rb_define_module_function(mPatron, "in_flight_session_count", in_flight_session_count, 0);
 
   cSession = rb_define_class_under(mPatron, "Session", rb_cObject);
   cRequest = rb_define_class_under(mPatron, "Request", rb_cObject);
@@ -1009,15 +3461,35 @@ void Init_session_ext() {
   rb_define_method(cSession, "escape",         session_escape,         1);
   rb_define_singleton_method(cSession, "unescape",   session_unescape,         1);
   rb_define_method(cSession, "unescape",       session_unescape,       1);
+  rb_define_singleton_method(cSession, "escape_all",   session_escape_all,   1);
+  rb_define_method(cSession, "escape_all",     session_escape_all,     1);
+  rb_define_singleton_method(cSession, "unescape_all",   session_unescape_all,   1);
+  rb_define_method(cSession, "unescape_all",   session_unescape_all,   1);
 
   rb_define_private_method(cSession, "handle_request", session_handle_request, 1);
+#if LIBCURL_VERSION_NUM >= 0x074400
+  rb_define_private_method(cSession, "handle_segmented_request", session_handle_segmented_request, 3);
+  rb_define_private_method(cSession, "handle_concurrent_requests", session_handle_concurrent_requests, 4);
+#endif
   rb_define_method(cSession, "reset",          session_interrupt,      0);
   rb_define_method(cSession, "interrupt",      session_interrupt,      0);
+  rb_define_method(cSession, "progress_callbacks_delivered",  session_progress_callbacks_delivered,  0);
+  rb_define_method(cSession, "progress_callbacks_suppressed", session_progress_callbacks_suppressed, 0);
   rb_define_private_method(cSession, "add_cookie_file", add_cookie_file, 1);
   rb_define_private_method(cSession, "set_debug_file", set_debug_file, 1);
+#if LIBCURL_VERSION_NUM >= 0x073F00
+  rb_define_private_method(cSession, "build_url", session_build_url, 3);
+#endif
   rb_define_alias(cSession, "urlencode", "escape");
   rb_define_alias(cSession, "urldecode", "unescape");
 
+  cDownloadCache = rb_define_class_under(mPatron, "DownloadCache", rb_cObject);
+  rb_define_private_method(cDownloadCache, "clone_file", download_cache_clone_file, 2);
+
+  mUtil = rb_define_module_under(mPatron, "Util");
+  rb_define_module_function(mUtil, "encode_query", util_encode_query, 3);
+  rb_define_module_function(mUtil, "decode_content", util_decode_content, 3);
+
   rb_define_const(cRequest, "AuthBasic",  LONG2NUM(CURLAUTH_BASIC));
   rb_define_const(cRequest, "AuthDigest", LONG2NUM(CURLAUTH_DIGEST));
   rb_define_const(cRequest, "AuthAny",    LONG2NUM(CURLAUTH_ANY));
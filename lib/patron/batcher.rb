@@ -0,0 +1,228 @@
+module Patron
+
+  # Collects small request bodies, like the operations of an Elasticsearch `_bulk` request, and sends
+  # them together as one newline delimited bulk request. A batch is sent by a background thread as soon
+  # as it has `max_count` payloads or `max_bytes` of them, or once its oldest payload has waited for
+  # `max_delay` seconds - so thousands of small requests per second turn into a few dozen larger ones.
+  #
+  # Every added payload gets a {Batcher::Future} for its result. Without a block every future of a batch
+  # resolves to the {Patron::Response} of the bulk request. With a block the response is split into the
+  # results of the payloads:
+  #
+  #   batcher = Patron::Batcher.new(session, "/_bulk") do |response, count|
+  #     JSON.parse(response.body).fetch("items")
+  #   end
+  #   future = batcher << %({"delete":{"_index":"logs","_id":"1"}})
+  #   future.value # => {"delete" => {"_id" => "1", "status" => 200, ...}}
+  #
+  # The {Session} is only used by the batcher while it is open, one request at a time, and must not be
+  # used by anything else meanwhile. Payloads still pending when the process exits are lost unless the
+  # batcher gets closed with #close.
+  class Batcher
+
+    # The result of a payload added to a {Batcher}, which becomes available once its batch has been sent.
+    class Future
+      def initialize
+        @lock = Mutex.new
+        @condition = ConditionVariable.new
+        @resolved = false
+      end
+
+      # @return [Boolean] whether the batch of the payload has been sent, or has failed
+      def resolved?
+        @lock.synchronize { @resolved }
+      end
+
+      # Waits for the batch of the payload to be sent.
+      #
+      # @param timeout[Numeric, nil] the number of seconds to wait at most, or `nil` to wait as long as it takes
+      # @return [Object] the result of the payload
+      # @raise [Patron::Error] the error of the bulk request, or of the block which splits its response
+      # @raise [Patron::TimeoutError] if the batch has not been sent within the +timeout+
+      def value(timeout = nil)
+        deadline = timeout && Process.clock_gettime(Process::CLOCK_MONOTONIC) + timeout
+        @lock.synchronize do
+          until @resolved
+            remaining = deadline && deadline - Process.clock_gettime(Process::CLOCK_MONOTONIC)
+            raise TimeoutError, "The batch was not sent within #{timeout} seconds" if remaining && remaining <= 0
+            @condition.wait(@lock, remaining)
+          end
+          raise @error if @error
+          @value
+        end
+      end
+
+      # @api private
+      def resolve(value, error = nil)
+        @lock.synchronize do
+          @value = value
+          @error = error
+          @resolved = true
+          @condition.broadcast
+        end
+      end
+    end
+
+    # @return [Patron::Session] the session the batches are sent with
+    attr_reader :session
+
+    # @return [String] the URL the batches are posted to
+    attr_reader :url
+
+    # @return [Integer] the number of payloads which get sent together at most
+    attr_reader :max_count
+
+    # @return [Integer] the size of the batches in bytes, which is only exceeded by a single large payload
+    attr_reader :max_bytes
+
+    # @return [Numeric] the number of seconds a payload waits for more to be batched with it
+    attr_reader :max_delay
+
+    # @param session[Patron::Session] the session to send the batches with
+    # @param url[String] the URL to post the batches to
+    # @param headers[Hash] the headers of the bulk requests, which are sent as "application/x-ndjson"
+    # @param max_count[Integer] the number of payloads to send together at most
+    # @param max_bytes[Integer] the size of a batch in bytes at which it gets sent
+    # @param max_delay[Numeric] the number of seconds a payload waits for more to be batched with it
+    # @yield [response, count] splits the response of a batch into the results of its payloads
+    # @yieldparam response[Patron::Response] the response to the bulk request
+    # @yieldparam count[Integer] the number of payloads in the batch
+    # @yieldreturn [Array] the result of every payload, in the order they were added
+    def initialize(session, url, headers = {}, max_count: 1000, max_bytes: 5 * 1024 * 1024, max_delay: 0.05, &split)
+      raise ArgumentError, "max_count has to be at least 1" unless max_count.to_i >= 1
+      @session = session
+      @url = url
+      @headers = {'Content-Type' => 'application/x-ndjson'}.merge(headers)
+      @max_count = max_count.to_i
+      @max_bytes = max_bytes.to_i
+      @max_delay = max_delay
+      @split = split
+      @lock = Mutex.new
+      @wakeup = ConditionVariable.new
+      @send_lock = Mutex.new
+      @pending = []
+      @pending_bytes = 0
+      @closed = false
+      @flusher = nil
+    end
+
+    # Adds a +payload+ to the next batch. A payload can span several lines, like an Elasticsearch
+    # action and its document, and gets a newline appended if it does not end with one.
+    #
+    # @param payload[#to_s] the payload
+    # @return [Patron::Batcher::Future] the future for the result of the payload
+    # @raise [Patron::Error] if the batcher has been closed
+    def add(payload)
+      payload = payload.to_s
+      payload += "\n" unless payload.end_with?("\n")
+      future = Future.new
+      @lock.synchronize do
+        raise Error, "The batcher has been closed" if @closed
+        @pending << [payload, future, now]
+        @pending_bytes += payload.bytesize
+        @flusher ||= Thread.new { run }
+        # The flusher waits without a timeout while nothing is pending
+        @wakeup.signal if @pending.size == 1 || batch_full?
+      end
+      future
+    end
+    alias_method :<<, :add
+
+    # @return [Integer] the number of payloads which have not been sent yet
+    def pending_count
+      @lock.synchronize { @pending.size }
+    end
+
+    # Sends all of the pending payloads right away, from the calling thread.
+    #
+    # @return [self]
+    def flush
+      loop do
+        batch = @lock.synchronize { take_batch }
+        break if batch.empty?
+        send_batch(batch)
+      end
+      self
+    end
+
+    # Sends all of the pending payloads and stops the background thread. No payloads can be added
+    # after that.
+    #
+    # @return [self]
+    def close
+      flusher = @lock.synchronize do
+        @closed = true
+        @wakeup.signal
+        @flusher
+      end
+      flusher.join if flusher
+      flush
+    end
+
+    # @return [Boolean] whether the batcher has been closed
+    def closed?
+      @lock.synchronize { @closed }
+    end
+
+    private
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    # The time the payload which has been waiting the longest was added
+    def oldest
+      @pending.first.last
+    end
+
+    def batch_full?
+      @pending.size >= @max_count || @pending_bytes >= @max_bytes
+    end
+
+    # Sends the batches as they become due, until the batcher gets closed and nothing is left
+    def run
+      loop do
+        batch = @lock.synchronize do
+          until @closed || (!@pending.empty? && (batch_full? || now - oldest >= @max_delay))
+            @wakeup.wait(@lock, @pending.empty? ? nil : [oldest + @max_delay - now, 0].max)
+          end
+          take_batch
+        end
+        break if batch.empty?
+        send_batch(batch)
+      end
+    end
+
+    # Removes the payloads of the next batch from the pending ones. Called with the lock held.
+    def take_batch
+      count = 0
+      bytes = 0
+      @pending.each do |payload, _, _|
+        break if count == @max_count || (count > 0 && bytes + payload.bytesize > @max_bytes)
+        count += 1
+        bytes += payload.bytesize
+      end
+      batch = @pending.shift(count)
+      @pending_bytes -= bytes
+      batch
+    end
+
+    def send_batch(batch)
+      body = String.new(capacity: batch.sum { |payload, _, _| payload.bytesize })
+      batch.each { |payload, _, _| body << payload.b }
+
+      @send_lock.synchronize do
+        begin
+          response = @session.post(@url, body, @headers.dup)
+          results = @split ? @split.call(response, batch.size) : Array.new(batch.size, response)
+          unless results.is_a?(Array) && results.size == batch.size
+            raise Error, "The response of a batch of #{batch.size} payloads was not split into as many results"
+          end
+          batch.each_with_index { |(_, future, _), i| future.resolve(results[i]) }
+        rescue StandardError => e
+          batch.each { |_, future, _| future.resolve(nil, e) }
+        end
+      end
+    end
+  end
+end
@@ -0,0 +1,159 @@
+require 'digest'
+require 'fileutils'
+
+module Patron
+
+  # A store for downloaded files on the local disk, addressed by the SHA-256 digest of their contents.
+  # Set it as the `download_cache` of a {Session} to have `get_file` take files from it instead of
+  # downloading them again. The cache can be shared by any number of sessions and processes.
+  #
+  # Files are placed at their destination as reflinks where the file system supports them, so that taking
+  # a file from the cache copies no data, and are copied otherwise. Either way the file at the destination
+  # is a file of its own, which can be modified without affecting the cache. A cached file is checked
+  # against its digest before it gets used, and removed from the cache if it does not match.
+  #
+  # With a `max_size` the files used least recently are removed once the cache grows past it.
+  class DownloadCache
+
+    # @return [String] the directory the cache is kept in
+    attr_reader :directory
+
+    # @return [Integer, nil] the maximum total size of the cached files in bytes, or `nil` for no limit
+    attr_reader :max_size
+
+    # @param directory[String] the directory to keep the cache in, created if it does not exist
+    # @param max_size[Integer, nil] the maximum total size of the cached files in bytes
+    def initialize(directory, max_size: nil)
+      @directory = File.expand_path(directory)
+      @max_size = max_size
+      FileUtils.mkdir_p(File.join(@directory, 'blobs'))
+      FileUtils.mkdir_p(File.join(@directory, 'urls'))
+      @size = nil
+    end
+
+    # Looks up the file last downloaded from +url+.
+    #
+    # @param url[String] the complete URL
+    # @return [Array(String, String), nil] the ETag of the file and its digest, or `nil` if the
+    #   cache does not contain the file
+    def lookup(url)
+      etag, digest = File.read(url_path(url)).split("\n", 2)
+      return unless digest && File.file?(blob_path(digest))
+      [etag, digest]
+    rescue Errno::ENOENT
+      nil
+    end
+
+    # Creates +filename+ with the contents of the cached file with the given +digest+, replacing
+    # any file which is there. A cached file which does not match its digest any more, because it
+    # has been damaged on disk, is removed instead.
+    #
+    # @param digest[String] the SHA-256 digest of the file, in hex
+    # @param filename[String] the path to create the file at
+    # @return [Boolean] `false` if the cache does not contain the file
+    def materialize(digest, filename)
+      blob = blob_path(digest)
+      return false unless File.file?(blob)
+      unless Digest::SHA256.file(blob).hexdigest == digest
+        File.unlink(blob)
+        return false
+      end
+      place(blob, filename)
+      touch(blob)
+      true
+    rescue Errno::ENOENT
+      # Removed by another process in the meantime
+      false
+    end
+
+    # Adds the downloaded file at +filename+ to the cache. If the file was downloaded from +url+ and
+    # the response had an +etag+ the file can be found by its URL later, see #lookup.
+    #
+    # @param filename[String] the path of the downloaded file
+    # @param digest[String] the SHA-256 digest of the file, in hex
+    # @param url[String, nil] the complete URL the file was downloaded from
+    # @param etag[String, nil] the ETag of the file
+    # @return [void]
+    def store(filename, digest, url = nil, etag = nil)
+      blob = blob_path(digest)
+      unless File.file?(blob)
+        place(filename, blob)
+        @size += File.size(blob) if @size
+      end
+      touch(blob)
+      if url && etag
+        entry = url_path(url)
+        tmp = temporary_path(entry)
+        File.write(tmp, "#{etag}\n#{digest}")
+        File.rename(tmp, entry)
+      end
+      # The size of the cache is only looked up again once it may have grown past the limit
+      evict if max_size && (@size.nil? || @size > max_size)
+    end
+
+    # Removes the files used least recently until the cache is no larger than `max_size`.
+    #
+    # @return [void]
+    def evict
+      blobs = Dir.glob(File.join(directory, 'blobs', '?' * 64)).map do |path|
+        begin
+          [path, File.stat(path)]
+        rescue Errno::ENOENT
+          nil
+        end
+      end.compact
+      total = blobs.inject(0) { |sum, (_, stat)| sum + stat.size }
+      blobs.sort_by { |_, stat| stat.atime }.each do |path, stat|
+        break if total <= max_size
+        begin
+          File.unlink(path)
+        rescue Errno::ENOENT
+        end
+        total -= stat.size
+      end
+      @size = total
+    end
+
+    private
+
+    def blob_path(digest)
+      raise ArgumentError, "Not a SHA-256 digest: #{digest.inspect}" unless digest =~ /\A[0-9a-f]{64}\z/
+      File.join(directory, 'blobs', digest)
+    end
+
+    def url_path(url)
+      File.join(directory, 'urls', Digest::SHA256.hexdigest(url))
+    end
+
+    def temporary_path(path)
+      "#{path}.patron-#{Process.pid}-#{rand(1 << 32)}"
+    end
+
+    # Creates +dst+ as a file of its own with the contents of +src+, without copying data where possible
+    def place(src, dst)
+      tmp = temporary_path(dst)
+      # Different file systems, or reflinks not supported
+      FileUtils.cp(src, tmp) unless clone_file(src, tmp)
+      File.rename(tmp, dst)
+    rescue
+      File.unlink(tmp) if tmp && File.exist?(tmp)
+      raise
+    end
+
+    # The access time is what orders the files for eviction. It is set explicitly
+    # since file systems mounted with `noatime` do not update it.
+    def touch(path)
+      File.utime(Time.now, File.mtime(path), path)
+    end
+
+    unless private_method_defined?(:clone_file)
+      # Creates +dst+ as a reflink of +src+. The native implementation is used instead
+      # where the platform supports reflinks.
+      #
+      # @return [Boolean] whether the reflink was created
+      def clone_file(src, dst)
+        false
+      end
+    end
+  end
+end
@@ -36,6 +36,17 @@ module Patron
   # Gets raised if the progress callback, or an interrupt, aborts the Curl perform() call
   class Aborted                < Error; end
 
+  # Gets raised when a digest of the response body does not have the value it was expected to have,
+  # either by the request or by a `Digest`, `Content-Digest` or `Content-MD5` header of the response.
+  class DigestMismatch         < Error; end
+
+  # Gets raised when the headers of a response get rejected by `fail_on_status`, `max_content_length`
+  # or the `on_headers` callback, before the body of the response is received.
+  class ResponseRejected       < Aborted
+    # @return [Patron::Response] the rejected response, with its headers and without a body
+    attr_reader :response
+  end
+
   # Gets raised when the server specifies an encoding that could not be found, or has an invalid name,
   # or when the server "lies" about the encoding of the response body (such as can be the case
   # when the server specifies an encoding in `Content-Type`) which the HTML generator then overrides
@@ -0,0 +1,30 @@
+module Patron
+
+  # A Server-Sent Event received by {Session#stream_events}.
+  class Event
+
+    # @return [String] the type of the event, "message" unless the server named it
+    attr_reader :type
+
+    # @return [String] the data of the event, with the lines of a multi-line event joined by newlines
+    attr_reader :data
+
+    # @return [String] the last event ID the server has set, which gets sent back in `Last-Event-ID` on
+    #   reconnection. Empty if the server has not set one.
+    attr_reader :id
+
+    # @return [Integer, nil] the reconnection time in milliseconds the server has asked for, if any
+    attr_reader :retry
+
+    def initialize(type, data, id, retry_ms)
+      @type  = type
+      @data  = data
+      @id    = id
+      @retry = retry_ms
+    end
+
+    def inspect
+      "#<Patron::Event @type=#{@type.inspect} @id=#{@id.inspect} @data=#{@data.inspect}>"
+    end
+  end
+end
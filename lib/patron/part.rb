@@ -0,0 +1,65 @@
+module Patron
+
+  # One part of a multipart request body. The values of the hashes passed to
+  # {Session#post_multipart} get turned into parts, and a Part can be passed
+  # as a value to give the part a content type or a file name of its own.
+  #
+  # The body of a part is sent straight from a String in memory, read from an
+  # IO while the request is being sent, or read from the file at a path - so
+  # data which is already in memory does not need to be written to a file first.
+  #
+  # @example Uploading a thumbnail rendered in memory
+  #   thumbnail = Patron::Part.new(png_data, filename: "thumb.png", content_type: "image/png")
+  #   session.post_multipart("/images", {:title => "Cat"}, {:thumbnail => thumbnail})
+  class Part
+
+    # @return [String, #read, nil] the body of the part, `nil` when it is read from a file at `path`
+    attr_reader :body
+
+    # @return [String, nil] the path of the file the body of the part is read from
+    attr_reader :path
+
+    # @return [String, nil] the file name sent for the part
+    attr_reader :filename
+
+    # @return [String, nil] the content type of the part
+    attr_reader :content_type
+
+    # @param body[String, #read, nil] the body of the part, as a String or as an IO to read it from.
+    #   An IO which can seek is read from its current position, so that the request body can be
+    #   sent again when a redirect asks for it. Other IOs get sent with chunked encoding.
+    # @param path[String, nil] the path of a file to send as the body instead
+    # @param filename[String, nil] the file name to send, defaults to the base name of `path`
+    # @param content_type[String, nil] the content type to send
+    def initialize(body = nil, path: nil, filename: nil, content_type: nil)
+      if body.nil? == path.nil?
+        raise ArgumentError, "A part needs either a body or a path"
+      end
+      @body = body.nil? || body.respond_to?(:read) ? body : body.to_s
+      @path = path && (path.respond_to?(:to_path) ? path.to_path : path.to_s)
+      @filename = filename || (@path && File.basename(@path))
+      @content_type = content_type
+    end
+
+    # Turns a value of the hashes passed to {Session#post_multipart} into a Part.
+    #
+    # @param value[Patron::Part, Pathname, #read, #to_s] the value, a Pathname is the path of the file to send
+    # @param file[Boolean] whether the value is from the hash of files, where
+    #   a String is the path of the file to send
+    # @return [Patron::Part]
+    def self.wrap(value, file)
+      return value if value.is_a?(Part)
+      # A Pathname can be read from too, but stands for the file at its path
+      if value.respond_to?(:to_path) && !value.is_a?(IO)
+        new(path: value)
+      elsif value.respond_to?(:read)
+        path = value.respond_to?(:path) && value.path
+        new(value, filename: path ? File.basename(path) : nil)
+      elsif file
+        new(path: value)
+      else
+        new(value)
+      end
+    end
+  end
+end
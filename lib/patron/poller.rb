@@ -0,0 +1,251 @@
+module Patron
+
+  # Polls many URLs, each on its own interval, and yields only the responses which have changed
+  # since the URL was last polled. The requests are conditional GETs, sending back the ETag and the
+  # Last-Modified date of the last response in `If-None-Match` and `If-Modified-Since`, so that an
+  # unchanged document costs a 304 Not Modified instead of its body. The URLs which are due together
+  # are polled concurrently on the multi handle of the session (see {Session#broadcast}), so polling
+  # thousands of URLs every few seconds takes a few requests' worth of wall time and no threads.
+  #
+  #   poller = Patron::Poller.new(session, concurrency: 64)
+  #   urls.each { |url| poller.add(url, interval: 5) }
+  #   poller.run do |url, response|
+  #     update_status(url, response.body)
+  #   end
+  #
+  # The URLs are kept on a timer wheel: a ring of slots, one for every `resolution` seconds, holding
+  # the URLs which are due in them. Adding a URL and finding the ones which are due only touch the
+  # slots in question, no matter how many URLs are polled.
+  #
+  # The {Session} is used by the poller while it polls, and must not be used by anything else
+  # meanwhile. Its `progress_callback` and `verify_content_digest` do not apply to the polls, nor do
+  # the settings which do not apply to {Session#broadcast}. URLs can be added and removed from any thread.
+  class Poller
+
+    # A URL which is polled, with the validators of its last response
+    # @api private
+    class Target
+      attr_reader :url, :interval, :headers
+      attr_accessor :due_tick, :etag, :last_modified, :fingerprint, :removed
+
+      def initialize(url, interval, headers)
+        @url = url
+        @interval = interval
+        @headers = headers
+        @removed = false
+      end
+
+      # The header lines of the next request to the URL
+      def header_lines
+        lines = @headers.map { |name, value| "#{name}: #{value}" }
+        lines << "If-None-Match: #{@etag}" if @etag
+        lines << "If-Modified-Since: #{@last_modified}" if @last_modified
+        lines
+      end
+    end
+
+    # @return [Patron::Session] the session the URLs are polled with
+    attr_reader :session
+
+    # @return [Integer] the number of requests which are run at once
+    attr_reader :concurrency
+
+    # @return [Numeric] the number of seconds a slot of the timer wheel spans, which is how precisely
+    #   the intervals are kept
+    attr_reader :resolution
+
+    # @param session[Patron::Session] the session to poll with, the `base_url` of which applies to the URLs
+    # @param concurrency[Integer] the number of requests to run at once
+    # @param resolution[Numeric] the number of seconds a slot of the timer wheel spans
+    # @param slots[Integer] the number of slots of the timer wheel. Intervals longer than the wheel
+    #   goes around in take it several turns, which only costs skipping the URL in the turns before.
+    def initialize(session, concurrency: 64, resolution: 0.1, slots: 1024)
+      raise ArgumentError, "resolution has to be positive" unless resolution > 0
+      raise ArgumentError, "slots has to be at least 1" unless slots.to_i >= 1
+      @session = session
+      @concurrency = concurrency.to_i
+      @resolution = resolution
+      @wheel = Array.new(slots.to_i) { [] }
+      @targets = {}
+      @lock = Mutex.new
+      @epoch = now
+      @tick = current_tick
+      @running = false
+    end
+
+    # Starts polling +url+ every +interval+ seconds. It is due right away, and its first response
+    # always counts as changed. Adding a URL which is being polled already replaces it.
+    #
+    # @param url[String] the URL to poll, relative to the `base_url` of the session if set
+    # @param interval[Numeric] the number of seconds between the polls of the URL
+    # @param headers[Hash] the hash of header keys to values, sent with every poll of the URL
+    # @return [self]
+    def add(url, interval:, headers: {})
+      raise ArgumentError, "interval has to be positive" unless interval > 0
+      target = Target.new(url, interval, headers)
+      @lock.synchronize do
+        @targets[url].removed = true if @targets.key?(url)
+        @targets[url] = target
+        target.due_tick = [current_tick, @tick].max
+        @wheel[target.due_tick % @wheel.size] << target
+      end
+      self
+    end
+
+    # Stops polling +url+.
+    #
+    # @param url[String] the URL as it was added
+    # @return [Boolean] whether the URL was being polled
+    def remove(url)
+      @lock.synchronize do
+        target = @targets.delete(url)
+        target.removed = true if target
+        !target.nil?
+      end
+    end
+
+    # @return [Array<String>] the URLs which are polled
+    def urls
+      @lock.synchronize { @targets.keys }
+    end
+
+    # @return [Integer] the number of URLs which are polled
+    def size
+      @lock.synchronize { @targets.size }
+    end
+
+    # Polls the URLs which are due by now, all at once, and yields those which have changed. A
+    # response has changed unless it is a 304 Not Modified, or has the same status and body as the
+    # last response from the URL - for servers which do not answer conditional requests. A request
+    # which fails is yielded with its {Patron::Error} in place of the response, and the URL stays
+    # polled.
+    #
+    # @yield [url, response] every URL which has changed
+    # @yieldparam url[String] the URL as it was added
+    # @yieldparam response[Patron::Response, Patron::Error] the response, or the error of the request
+    # @return [Integer] the number of URLs which were polled
+    def poll
+      due = @lock.synchronize { advance }
+      return 0 if due.empty?
+
+      results = fetch(due)
+      @lock.synchronize do
+        due.each { |target| reschedule(target) unless target.removed }
+      end
+      due.zip(results) do |target, result|
+        yield target.url, result if changed?(target, result) && block_given?
+      end
+      due.size
+    end
+
+    # Polls the URLs as they become due until #stop is called, from the block or another thread.
+    #
+    # @yield [url, response] every URL which has changed, see #poll
+    # @return [self]
+    def run(&block)
+      @running = true
+      while @running
+        poll(&block)
+        delay = @epoch + (@tick + 1) * @resolution - now
+        sleep(delay) if @running && delay > 0
+      end
+      self
+    end
+
+    # Makes #run return once the URLs which are being polled are done.
+    #
+    # @return [self]
+    def stop
+      @running = false
+      self
+    end
+
+    private
+
+    def now
+      Process.clock_gettime(Process::CLOCK_MONOTONIC)
+    end
+
+    def current_tick
+      ((now - @epoch) / @resolution).floor
+    end
+
+    # Puts the target into the slot of the tick it is next due in, counting from the tick it was due
+    # in so that the time taken by polling does not add up. A tick which has passed already, because
+    # polling took longer than the interval, becomes the next tick. Called with the lock held.
+    def reschedule(target)
+      interval_ticks = [(target.interval / @resolution).round, 1].max
+      target.due_tick = [target.due_tick + interval_ticks, @tick + 1].max
+      @wheel[target.due_tick % @wheel.size] << target
+    end
+
+    # Moves the wheel on to the current tick and takes out the targets which are due by then. Called
+    # with the lock held.
+    def advance
+      due = []
+      tick = current_tick
+      # The slot of the last tick again, for the targets added since, and every slot once at most
+      # even when the wheel went around since the last time
+      first = [@tick, tick - @wheel.size + 1].max
+      (first..tick).each do |t|
+        slot = @wheel[t % @wheel.size]
+        next if slot.empty?
+        later = []
+        slot.each do |target|
+          next if target.removed
+          target.due_tick <= tick ? due << target : later << target
+        end
+        @wheel[t % @wheel.size] = later
+      end
+      @tick = tick if tick > @tick
+      due
+    end
+
+    def fetch(targets)
+      options = {:on_headers => nil, :fail_on_status => nil, :max_content_length => nil, :digest => nil,
+                 :compress_request => nil, :progress_callback => nil, :verify_content_digest => nil}
+      # Before libCURL 7.68.0 the requests get sent one after the other
+      unless @session.respond_to?(:handle_concurrent_requests, true)
+        return targets.map do |target|
+          begin
+            @session.request(:get, target.url, target.headers.merge(conditional_headers(target)), options)
+          rescue Patron::Error => e
+            e
+          end
+        end
+      end
+
+      urls = targets.map { |target| @session.send(:build_request, :get, target.url, {}).url }
+      request = @session.send(:build_request, :get, targets.first.url, {}, options)
+      @session.send(:handle_concurrent_requests, request, urls, @concurrency, targets.map(&:header_lines))
+    end
+
+    def conditional_headers(target)
+      headers = {}
+      headers['If-None-Match'] = target.etag if target.etag
+      headers['If-Modified-Since'] = target.last_modified if target.last_modified
+      headers
+    end
+
+    # Keeps the validators of a response and tells whether it differs from the last one
+    def changed?(target, result)
+      return true unless result.is_a?(Response)
+      return false if result.status == 304
+
+      etag = header_value(result, 'etag')
+      last_modified = header_value(result, 'last-modified')
+      fingerprint = [result.status, result.body.hash]
+      changed = target.fingerprint != fingerprint
+      target.etag = etag
+      target.last_modified = last_modified
+      target.fingerprint = fingerprint
+      changed
+    end
+
+    # The last value of a response header, the name of which is matched case-insensitively
+    def header_value(response, name)
+      header = response.headers.find { |key, _| key.downcase == name }
+      header && Array(header[1]).last
+    end
+  end
+end
@@ -1,4 +1,5 @@
 require 'patron/util'
+require 'patron/part'
 
 module Patron
 
@@ -24,14 +25,21 @@ module Patron
       :url, :username, :password, :file_name, :proxy, :proxy_type, :insecure,
       :ignore_content_length, :multipart, :action, :timeout, :connect_timeout, :dns_cache_timeout,
       :max_redirects, :headers, :auth_type, :upload_data, :buffer_size, :cacert,
-      :ssl_version, :http_version, :automatic_content_encoding, :force_ipv4, :download_byte_limit,
-      :low_speed_time, :low_speed_limit, :progress_callback
+      :ssl_version, :http_version, :automatic_content_encoding, :keep_content_encoding, :force_ipv4, :download_byte_limit, :decompressed_byte_limit,
+      :download_fsync, :download_direct_io, :download_filetime, :download_io_buffer_size, :resume_from,
+      :low_speed_time, :low_speed_limit, :progress_callback, :progress_interval, :progress_bytes,
+      :if_modified_since, :digest, :expected_digest, :verify_content_digest, :upload_digest,
+      :compress_request, :compress_request_level, :on_headers, :fail_on_status, :max_content_length,
+      :stream, :stream_callback, :last_event_id
     ]
 
     WRITER_VARS = [
       :url, :username, :password, :file_name, :proxy, :proxy_type, :insecure, :dns_cache_timeout,
-      :ignore_content_length, :multipart, :cacert, :ssl_version, :http_version, :automatic_content_encoding, :force_ipv4, :download_byte_limit,
-      :low_speed_time, :low_speed_limit, :progress_callback
+      :ignore_content_length, :multipart, :cacert, :ssl_version, :http_version, :automatic_content_encoding, :keep_content_encoding, :force_ipv4, :download_byte_limit, :decompressed_byte_limit,
+      :download_fsync, :download_direct_io, :download_filetime, :download_io_buffer_size, :resume_from,
+      :low_speed_time, :low_speed_limit, :progress_callback, :digest, :expected_digest, :verify_content_digest,
+      :upload_digest, :compress_request, :compress_request_level, :on_headers, :fail_on_status, :max_content_length,
+      :stream, :stream_callback, :last_event_id
     ]
 
     attr_reader(*READER_VARS)
@@ -149,6 +157,38 @@ module Patron
       @buffer_size = buffer_size != nil ? buffer_size.to_i : nil
     end
 
+    # Sets the minimum time between two calls to the `progress_callback`. Progress updates
+    # which arrive sooner are skipped without acquiring the GVL.
+    #
+    # @param seconds[Numeric,nil] the interval in seconds, or `nil` to not throttle by time
+    def progress_interval=(seconds)
+      if seconds != nil && seconds.to_f < 0
+        raise ArgumentError, "Progress interval must be a positive number or nil"
+      end
+
+      @progress_interval = seconds != nil ? seconds.to_f : nil
+    end
+
+    # Sets the minimum amount of bytes which have to be transferred between two calls to
+    # the `progress_callback`. Progress updates which arrive sooner are skipped without acquiring the GVL.
+    #
+    # @param bytes[Integer,nil] the number of bytes, or `nil` to not throttle by transferred bytes
+    def progress_bytes=(bytes)
+      if bytes != nil && bytes.to_i < 0
+        raise ArgumentError, "Progress bytes must be a positive integer or nil"
+      end
+
+      @progress_bytes = bytes != nil ? bytes.to_i : nil
+    end
+
+    # Makes the request conditional on the document having been modified after the given time.
+    # The server then answers with a 304 status instead of sending the document again.
+    #
+    # @param time[Time,Integer,nil] the time, or a number of seconds since the epoch, or `nil` for an unconditional request
+    def if_modified_since=(time)
+      @if_modified_since = time != nil ? time.to_i : nil
+    end
+
     # Returns the set HTTP authentication string for basic authentication.
     #
     # @return [String, NilClass] the authentication string or nil if no authentication is used
@@ -157,6 +197,20 @@ module Patron
       "#{username}:#{password}"
     end
 
+    # Returns the parts of a multipart request body, made from the form fields in
+    # `upload_data` followed by the files in `file_name`.
+    #
+    # @return [Array<Array(String, Patron::Part)>] the names and the parts
+    def multipart_parts
+      if !(upload_data.nil? || upload_data.is_a?(Hash)) || !(file_name.nil? || file_name.is_a?(Hash))
+        raise ArgumentError, "Data and Filename must be passed in a hash."
+      end
+
+      fields = (upload_data || {}).map { |name, value| [name.to_s, Part.wrap(value, false)] }
+      files = (file_name || {}).map { |name, value| [name.to_s, Part.wrap(value, true)] }
+      fields + files
+    end
+
     # Returns the set HTTP verb
     #
     # @return [String] the HTTP verb
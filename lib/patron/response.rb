@@ -16,10 +16,6 @@ module Patron
     # @return [Integer] how many redirects were followed when fulfilling this request
     attr_reader :redirect_count
 
-    # @return [String, nil] the response body as a String encoded as `Encoding::BINARY` or
-    #           or `nil` if the response was written directly to a file
-    attr_reader :body
-    
     # @return [Hash] the response headers. If there were multiple headers received for the same value
     #   (like "Cookie"), the header values will be within an Array under the key for the header, in order.
     attr_reader :headers
@@ -28,6 +24,69 @@ module Patron
     #    to be a valid charset name, just stored. To check the charset for validity, use #body_decodable?
     attr_reader :charset
 
+    # @return [Integer, nil] the size of the request body before compression, when it was
+    #    compressed with the `compress_request` option
+    attr_reader :upload_bytes
+
+    # @return [Integer, nil] the size of the request body as it was sent, when it was
+    #    compressed with the `compress_request` option
+    attr_reader :compressed_upload_bytes
+
+    # Returns the response body as a String encoded as `Encoding::BINARY`, or `nil` if the response was
+    # written directly to a file. With `Session#keep_content_encoding` the body is decoded from its
+    # Content-Encoding when this is first called.
+    #
+    # @raise [Patron::Error] when the body can not be decoded
+    # @return [String, nil]
+    def body
+      @body ||= @raw_body && decode_content(@raw_body)
+    end
+
+    # Returns the response body as it was received. With `Session#keep_content_encoding` it still has its
+    # Content-Encoding, like gzip, so that it can be stored or passed on without being decoded. Otherwise
+    # this is the same as `body`.
+    #
+    # @return [String, nil]
+    def raw_body
+      @raw_body || @body
+    end
+
+    # Returns the hex encoded digest of the response body, if it was asked for with the `digest`
+    # option of the request or session. Digests are computed while the body is received, also when
+    # it is written to a file.
+    #
+    # @param type[Symbol, nil] `:sha256`, `:md5` or `:crc32c`, or nil for the first digest computed
+    # @return [String, nil]
+    def digest(type = nil)
+      return unless @digests
+      type ? @digests[type.to_sym] : @digests.values.first
+    end
+
+    # Returns the hex encoded digest of the request body as it was read, before any compression,
+    # if it was asked for with the `upload_digest` option of the request. Multipart bodies are not
+    # digested.
+    #
+    # @param type[Symbol, nil] `:sha256`, `:md5` or `:crc32c`, or nil for the first digest computed
+    # @return [String, nil]
+    def upload_digest(type = nil)
+      return unless @upload_digests
+      type ? @upload_digests[type.to_sym] : @upload_digests.values.first
+    end
+
+    # Returns the links of the Link headers of the response, by their relation types - like the
+    # `rel="next"` link with which paginated APIs point to their next page. The headers are parsed
+    # natively while they are received. A link with several relation types is listed under each of
+    # them, and of several links with the same relation type the first one is kept.
+    #
+    # @example
+    #   response.links # => {"next" => "https://api.example.com/items?page=3", "prev" => "/items?page=1"}
+    #
+    # @return [Hash<String, String>] the targets as given in the headers, which can be relative to #url,
+    #   by their relation types in lowercase
+    def links
+      @links || {}
+    end
+
     # Overridden so that the output is shorter and there is no response body printed
     def inspect
       # Avoid spamming the console with the header and body data
@@ -61,11 +120,12 @@ module Patron
     
     # Tells whether the response body can be decoded losslessly into the curren internal encoding
     #
-    # @return [Boolean] true if the body is decodable, false if otherwise
+    # @return [Boolean] true if the body is decodable, false if otherwise - also when a body received
+    #   with `Session#keep_content_encoding` can not be decoded from its Content-Encoding
     def body_decodable?
-      return true if @body.nil?
+      return true if body.nil?
       return true if decoded_body
-    rescue HeaderCharsetInvalid, NonRepresentableBody
+    rescue Patron::Error
       false
     end
 
@@ -93,7 +153,7 @@ module Patron
     #    when unable to decode the body into the current process encoding.
     # @return [String, nil]
     def decoded_body
-      return unless @body
+      return unless body
       @decoded_body ||= decode_body(true)
     end
     
@@ -106,12 +166,25 @@ module Patron
     # @see Patron::Response#decoded_body
     # @return [String, nil]
     def inspectable_body
-      return unless @body
+      return unless body
       @inspectable_body ||= decode_body(false)
     end
 
     private
 
+    # Decodes a body received with `Session#keep_content_encoding`, undoing the Content-Encodings in reverse order
+    def decode_content(data)
+      header = @headers.find { |name, _| name.downcase == 'content-encoding' }
+      codings = Array(header && header.last).join(',').split(',').map(&:strip)
+      codings.reject! { |coding| coding.empty? || coding.downcase == 'identity' }
+      return data if codings.empty? || data.empty?
+
+      decoded = codings.reverse.inject(data) do |body, coding|
+        Patron::Util.decode_content(body, coding, @decompressed_byte_limit)
+      end
+      decoded.force_encoding(Encoding::BINARY)
+    end
+
     # Called by the C code to parse and set the headers
     def parse_headers(header_data_for_multiple_responses)
       @headers = {}
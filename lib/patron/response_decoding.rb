@@ -39,15 +39,15 @@ EOF
       body_encoding = encoding_from_headers_or_binary
   
       # See if the body actually _is_ in this encoding. 
-      encoding_matched = @body.force_encoding(body_encoding).valid_encoding?
+      encoding_matched = body.force_encoding(body_encoding).valid_encoding?
       if !encoding_matched
         raise HeaderCharsetInvalid,  MISREPORTED_ENCODING_ERROR % {declared: body_encoding}
       end
   
       if strict
-        convert_encoding_and_raise(@body)
+        convert_encoding_and_raise(body)
       else
-        @body.encode(internal_encoding, :undefined => :replace, :replace => '?')
+        body.encode(internal_encoding, :undefined => :replace, :replace => '?')
       end
     end
 
@@ -3,7 +3,12 @@ require 'patron/error'
 require 'patron/request'
 require 'patron/response_decoding'
 require 'patron/response'
+require 'patron/sync_result'
+require 'patron/event'
 require 'patron/session_ext'
+require 'patron/download_cache'
+require 'patron/batcher'
+require 'patron/poller'
 require 'patron/util'
 require 'patron/header_parser'
 
@@ -88,11 +93,85 @@ module Patron
     # @return [Boolean] Support automatic Content-Encoding decompression and set liberal Accept-Encoding headers
     attr_accessor :automatic_content_encoding
 
-    # @return [Fixnum, nil] the amount of bytes downloaded. If it is set to nil
-    #    (default) no limit will be applied.
-    #    **Note that this only works on libCURL 7.34 and newer**
+    # @return [Boolean] whether response bodies should be kept with their Content-Encoding, such as
+    #    gzip, instead of getting decoded while they are received. `Response#raw_body` returns the body
+    #    as it was sent, and `Response#body` decodes it when it is first called - so a body which is only
+    #    stored or passed on does not get decoded at all. Files downloaded with `get_file` stay encoded.
+    #    With `automatic_content_encoding` only the encodings which can be decoded are asked for. Off by default.
+    attr_accessor :keep_content_encoding
+
+    # @return [Integer, nil] the maximum amount of response body bytes to receive from the server. The
+    #    request gets aborted with {Patron::Aborted} as soon as the limit is crossed, even if the response
+    #    does not advertise a Content-Length. If it is set to nil (default) no limit will be applied.
     attr_accessor :download_byte_limit
 
+    # @return [Integer, nil] the maximum size of the response body after libCURL has decoded its
+    #    Content-Encoding (see `automatic_content_encoding`), protecting against compression bombs.
+    #    For responses which are not encoded this is the same as the `download_byte_limit`.
+    #    If it is set to nil (default) no limit will be applied.
+    attr_accessor :decompressed_byte_limit
+
+    # @return [Boolean] whether files downloaded with `get_file` should be synced to disk
+    #    (`fsync`) before the method returns. Off by default.
+    attr_accessor :download_fsync
+
+    # @return [Boolean] whether files downloaded with `get_file` should be written with `O_DIRECT`,
+    #    bypassing the page cache. Ignored where the file system does not support it. Off by default.
+    attr_accessor :download_direct_io
+
+    # @return [Boolean] whether files downloaded with `get_file` should get the Last-Modified date
+    #    of the response as their modification time. Off by default.
+    attr_accessor :download_filetime
+
+    # @return [Integer, nil] the number of bytes to collect before writing them to an IO passed to
+    #    `get_file`. When the IO is a pipe its capacity is raised to match where the system allows it.
+    #    If it is set to nil (default) the data is written to the IO as soon as it arrives.
+    attr_accessor :download_io_buffer_size
+
+    # @return [Symbol, nil] the compression to apply to request bodies while they are being sent,
+    #    `:gzip` or `:zstd`, with the matching `Content-Encoding` header. The body is sent with
+    #    chunked encoding then. `:zstd` is only available when Patron was built with libzstd.
+    #    Multipart bodies are not compressed. Set to nil (default) to send bodies as they are.
+    attr_accessor :compress_request
+
+    # @return [Integer, nil] the level of the `compress_request` compression, or nil (default)
+    #    for the default level of the compression
+    attr_accessor :compress_request_level
+
+    # @return [Symbol, Array<Symbol>, nil] the digests to compute of response bodies while they are
+    #    received, any of `:sha256`, `:md5` and `:crc32c`. They can be read with `Response#digest`.
+    #    Set to nil (default) to not compute any. A request can also take the hex encoded digests
+    #    its response body is expected to have as the `:expected_digest` option, like
+    #    `{sha256: "e3b0c442..."}`, and the digests of its body as sent with the `:upload_digest` option.
+    attr_accessor :digest
+
+    # @return [Boolean] whether response bodies should be checked against the `Digest`, `Content-Digest`
+    #    and `Content-MD5` headers the server sends along. The digests are computed while the body is
+    #    received, and {Patron::DigestMismatch} is raised if one does not match. Bodies with a
+    #    `Content-Encoding` are not checked. Off by default.
+    attr_accessor :verify_content_digest
+
+    # @return [Proc, nil] called with the {Patron::Response} once the headers of the final response
+    #    have been received, before its body. The Response has no body then. Returning `:abort` from
+    #    the proc aborts the request, raising {Patron::ResponseRejected} - so that a body which would
+    #    be thrown away, like an error page, does not get downloaded. Responses to redirects which
+    #    are followed and interim responses do not get passed to the proc.
+    attr_accessor :on_headers
+
+    # @return [Integer, Range, Array, nil] the status codes for which the request is aborted as soon as
+    #    the headers of the final response are in, raising {Patron::ResponseRejected} before the body
+    #    is received. For example `500..599`. Set to nil (default) to receive the body of any response.
+    attr_accessor :fail_on_status
+
+    # @return [Integer, nil] the largest Content-Length the final response may have. Larger responses are
+    #    aborted before their body is received, raising {Patron::ResponseRejected}. Unlike the
+    #    `download_byte_limit` this only looks at the Content-Length header.
+    attr_accessor :max_content_length
+
+    # @return [Patron::DownloadCache, nil] a cache of downloaded files to be used by `get_file`,
+    #    or `nil` (default) to always download files
+    attr_accessor :download_cache
+
     # @return [Integer, nil] the time in number seconds that the transfer speed should be below the
     #     `low_speed_limit` for the library to consider it too slow and abort.
     # @see low_speed_limit
@@ -105,9 +184,22 @@ module Patron
 
     # @return [#call, nil] callable object that will be called with 4 arguments
     #    during request/response execution - `dltotal`, `dlnow`, `ultotal`, `ulnow`.
-    #    All these arguments are in bytes.
+    #    All these arguments are in bytes. If the callable returns `:abort` the request
+    #    gets aborted and raises {Patron::Aborted}.
+    # @see progress_interval
+    # @see progress_bytes
     attr_accessor :progress_callback
 
+    # @return [Numeric, nil] the minimum time in seconds between two calls to the `progress_callback`.
+    #    Progress updates arriving in between get skipped without acquiring the GVL. If neither this nor
+    #    `progress_bytes` is set, the callback is called on every progress update from libCURL.
+    attr_accessor :progress_interval
+
+    # @return [Integer, nil] the minimum number of bytes (downloaded and uploaded) which have to be transferred
+    #    between two calls to the `progress_callback`. When combined with `progress_interval` the callback gets
+    #    called as soon as either of the two is due.
+    attr_accessor :progress_bytes
+
     # Create a new Session object for performing requests.
     #
     # @param args[Hash] options for the Session (same names as the writable attributes of the Session)
@@ -190,14 +282,224 @@ module Patron
     # content at the URL is downloaded directly into the specified file. The file will be accessed
     # by libCURL bypassing the Ruby runtime entirely.
     #
+    # The body gets written to a temporary file next to +filename+, which is moved into place
+    # only once the download completes. If the request fails the file at +filename+ is left untouched.
+    #
     # Note that when using this option, the Response object will have ++nil++ as the body, and you
     # will need to read your target file for access to the body string).
     #
+    # Instead of a path +filename+ can be an IO with a file descriptor, like a pipe to another process
+    # or a socket. The body is written to the descriptor from the libCURL callbacks without holding the
+    # GVL, and the IO is left open. Non-blocking descriptors are waited on when they are full. Writing
+    # to an IO does not support +segments+, +resume+ or the `download_cache`.
+    #
+    # With +segments+ greater than 1 the file gets probed with a HEAD request first. If the server
+    # advertises `Accept-Ranges: bytes` and a Content-Length, the file is split into that many byte
+    # ranges which are downloaded concurrently, each over its own connection, and written at their
+    # offsets into the file. A range which fails gets retried on its own. Servers which do not
+    # support ranges get the file downloaded in one stream as usual. For segmented downloads the
+    # returned Response is the one of the first range, with the status 206 Partial Content and the
+    # digests of the whole file, and the `progress_callback` is not called.
+    #
+    # With +resume+ the body is written to +filename+ with ".part" appended, and the ETag or
+    # Last-Modified date of the file is kept in a ".part.meta" file next to it. If the download
+    # fails the partial file stays in place, and the next `get_file` with +resume+ continues where
+    # it stopped, asking for the rest of the file with `Range` and `If-Range`. If the file has changed
+    # in the meantime the server sends all of it and the download starts over. Once complete the
+    # partial file is moved to +filename+. Error responses are not written to the partial file.
+    #
+    # With a `download_cache` files get taken from the cache instead where possible. If the +digest+ of
+    # the file is given and the cache contains it no request is made at all, and the returned Response
+    # has the status 200, only a Content-Length header and the digest of the file. Otherwise
+    # a file downloaded from the same URL before is requested with its ETag in `If-None-Match`, and if the
+    # server responds with 304 Not Modified the file is taken from the cache. Downloaded files are added to
+    # the cache. Cached downloads can not use +segments+. Without a `download_cache` the file is checked
+    # against the +digest+, and {Patron::DigestMismatch} is raised instead of saving it if it does not
+    # match. A file downloaded in one stream is digested while it is received, a resumed download
+    # carries on from the digest of the partial file (which is discarded on a mismatch), and a segmented
+    # download is read back once all of its ranges are in.
+    #
     # @param url[String] the URL to fetch
-    # @param filename[String] path to the file to save the response body in
+    # @param filename[String, IO] path to the file to save the response body in, or an IO with a file
+    #   descriptor to write it to
+    # @param headers[Hash] the hash of header keys to values
+    # @param segments[Integer] the number of byte ranges to download concurrently
+    # @param resume[Boolean] whether to continue a download which failed before
+    # @param digest[String, nil] the SHA-256 digest of the file in hex, if known, to look it up in the `download_cache`
+    #   or to check the download against - all of it, also when it is resumed or downloaded in segments
     # @return [Patron::Response]
-    def get_file(url, filename, headers = {})
-      request(:get, url, headers, :file => filename)
+    # @raise [ArgumentError] when +segments+ are asked for with a `download_cache`
+    def get_file(url, filename, headers = {}, segments: 1, resume: false, digest: nil)
+      expected_digest = digest && {sha256: digest}
+      if filename.respond_to?(:fileno)
+        raise ArgumentError, "The IO to download to has no file descriptor" if filename.fileno.nil?
+        raise ArgumentError, "Resuming a download needs a file path" if resume
+        return request(:get, url, headers, :file => filename, :expected_digest => expected_digest)
+      end
+      return get_file_resumable(url, filename, headers, expected_digest) if resume
+      if download_cache
+        raise ArgumentError, "Downloads through the download_cache can not use segments" if segments.to_i > 1
+        return get_file_cached(url, filename, headers, digest)
+      end
+      if segments.to_i > 1 && respond_to?(:handle_segmented_request, true)
+        probe = head(url, headers)
+        length = segmented_download_length(probe)
+        if length
+          request = build_request(:get, probe.url, headers, :file => filename, :expected_digest => expected_digest)
+          return handle_segmented_request(request, length, segments.to_i)
+        end
+      end
+      request(:get, url, headers, :file => filename, :expected_digest => expected_digest)
+    end
+
+    # Brings the file at +filename+ up to date with the document at +url+, downloading it as with
+    # #get_file only if it has changed. The request carries the modification time of the file in
+    # `If-Modified-Since`, and the ETag stored by the previous sync in `If-None-Match`. If the server
+    # answers that the document has not been modified, the file is left alone.
+    #
+    # A downloaded file gets the Last-Modified date of the document as its modification time, and
+    # its ETag is kept next to it in a file with ".etag" appended. Only the body of a successful (2xx)
+    # response replaces the file - with any other status the file and its ETag are left as they are.
+    #
+    # @param url[String] the URL to fetch
+    # @param filename[String] path to the file to keep up to date
+    # @param headers[Hash] the hash of header keys to values
+    # @return [Patron::SyncResult]
+    # @raise [Patron::ResponseRejected] with the response, if it is neither successful nor 304 Not Modified
+    def sync_file(url, filename, headers = {})
+      etag_file = filename + '.etag'
+      local = File.file?(filename) ? File.stat(filename) : nil
+      etag = local && File.file?(etag_file) ? File.read(etag_file).strip : ''
+      conditional_headers = etag.empty? ? headers : headers.merge('If-None-Match' => etag)
+
+      response = request(:get, url, conditional_headers, :file => filename,
+        :if_modified_since => local && local.mtime, :download_filetime => true,
+        :fail_on_status => [100..199, 300..303, 305..999])
+      # A downloaded file is moved into place, so it is a different file from then on
+      if local && File.stat(filename).ino == local.ino
+        return SyncResult.new(response, false, local.size)
+      end
+
+      etag = response.headers.find { |name, _| name.downcase == 'etag' }
+      if etag
+        File.write(etag_file, Array(etag.last).last)
+      elsif File.exist?(etag_file)
+        File.unlink(etag_file)
+      end
+      SyncResult.new(response, true, 0)
+    end
+
+    # Streams the body of the response to +url+ line by line, for newline delimited formats like
+    # NDJSON. The body is split into lines natively while it is received, instead of being collected
+    # until the transfer ends, and the block gets every line as soon as it is complete. The lines
+    # completed by a chunk of the body are handed to Ruby together, so the GVL is only acquired once
+    # for each chunk which completes any.
+    #
+    # Only the body of a successful (2xx) response is streamed, the body of any other response is
+    # collected into the Response as usual. Breaking out of the block, or raising from it, stops the
+    # transfer. The `timeout` of the session does not apply, use `low_speed_time` and `low_speed_limit`
+    # to notice a stream which stalls.
+    #
+    # @param url[String] the URL to fetch
+    # @param headers[Hash] the hash of header keys to values
+    # @yield [line] every line of the body
+    # @yieldparam line[String] the line without its line ending, UTF-8 encoded
+    # @return [Patron::Response] the response, with an empty body if it was streamed
+    def stream_lines(url, headers = {}, &block)
+      raise ArgumentError, "stream_lines needs a block" unless block
+      request(:get, url, headers, :stream => :lines, :stream_callback => block, :timeout => 0)
+    end
+
+    # Receives the Server-Sent Events (text/event-stream) at +url+, like an EventSource does. The stream
+    # is parsed natively while it is received, see #stream_lines, and the block gets every event once it
+    # is complete.
+    #
+    # When the connection is closed or fails, the stream is connected to again after the reconnection
+    # time (3 seconds unless the server sets another), sending the ID of the last event in `Last-Event-ID`
+    # so that the server can carry on from there. Streaming ends when a response other than 200 OK is
+    # received, which is returned - a server answers 204 No Content to stop a client from reconnecting.
+    #
+    # @param url[String] the URL of the event stream
+    # @param headers[Hash] the hash of header keys to values
+    # @param reconnect[Boolean] whether to connect to the stream again when it ends, or to return instead
+    # @param last_event_id[String, nil] the ID of the last event received before, to carry on from it
+    # @yield [event] every event of the stream
+    # @yieldparam event[Patron::Event] the event
+    # @return [Patron::Response] the response which ended the streaming
+    def stream_events(url, headers = {}, reconnect: true, last_event_id: nil)
+      raise ArgumentError, "stream_events needs a block" unless block_given?
+      reconnection_time = 3000
+      callback = proc do |type, data, id, retry_ms|
+        last_event_id = id
+        reconnection_time = retry_ms if retry_ms
+        yield Event.new(type, data, id, retry_ms)
+      end
+
+      loop do
+        stream_headers = headers.merge('Accept' => 'text/event-stream', 'Cache-Control' => 'no-cache')
+        stream_headers['Last-Event-ID'] = last_event_id if last_event_id && !last_event_id.empty?
+        begin
+          response = request(:get, url, stream_headers, :stream => :events, :stream_callback => callback,
+                             :last_event_id => last_event_id, :timeout => 0)
+          return response unless reconnect && response.status == 200
+        rescue Aborted, URLFormatError, UnsupportedProtocol, UnsupportedSSLVersion, UnsupportedHTTPVersion
+          raise
+        rescue Error
+          # The connection failed or broke off
+          raise unless reconnect
+        end
+        sleep(reconnection_time / 1000.0)
+      end
+    end
+
+    # Walks the pages of a paginated API, starting at +url+. While the caller processes a page the
+    # request for the next one is already running in a background thread, which waits for the response
+    # with the GVL released - so the time spent on a page hides the latency of fetching the next one.
+    #
+    # The next page is found by the +next+ callable, which gets every response and returns the URL
+    # of the page after it, or `nil` after the last page. By default it follows the `rel="next"` link
+    # of the Link header (see {Response#links}). A relative URL is resolved against the URL of the
+    # page it came from. A request which fails is raised from the enumerator once its page is due.
+    #
+    # The session is busy with the next page while a page is being processed, so it must not be used
+    # for anything else until the enumeration is done. Stopping early, like with `break` or `first`,
+    # cancels the request for the page which was fetched ahead.
+    #
+    # @example
+    #   session.paginate("/items", next: ->(response) { JSON.parse(response.body)["next_url"] }).each do |page|
+    #     process(page)
+    #   end
+    #
+    # @param url[String] the URL of the first page
+    # @param headers[Hash] the hash of header keys to values, sent with every page
+    # @param next[#call] returns the URL of the page after the response it gets, or nil
+    # @yield [response] every page, if a block is given
+    # @return [Enumerator<Patron::Response>, Patron::Session] an Enumerator of the pages, or self when a block is given
+    def paginate(url, headers = {}, next: nil, &block)
+      next_url = binding.local_variable_get(:next) || lambda { |response| response.links['next'] }
+
+      pages = Enumerator.new do |yielder|
+        response = get(url, headers)
+        loop do
+          following = next_url.call(response)
+          following = URI.join(response.url, following.to_s).to_s if following && following.to_s !~ /\A[a-z][a-z0-9+.\-]*:/i
+          prefetch = following && Thread.new do
+            Thread.current.report_on_exception = false if Thread.current.respond_to?(:report_on_exception=)
+            get(following, headers)
+          end
+          begin
+            yielder << response
+            break unless prefetch
+            response = prefetch.value
+          ensure
+            # Reached with the request still running when the enumeration is stopped
+            prefetch.kill.join if prefetch && prefetch.alive?
+          end
+        end
+      end
+      return pages unless block
+      pages.each(&block)
+      self
     end
 
     # Same as #get but performs a HEAD request.
@@ -272,7 +574,7 @@ module Patron
     # @return [Patron::Response]
     def post(url, data, headers = {})
       if data.is_a?(Hash)
-        data = data.map {|k,v| urlencode(k.to_s) + '=' + urlencode(v.to_s) }.join('&')
+        data = Util.encode_query(data, true, true)
         headers['Content-Type'] = 'application/x-www-form-urlencoded'
       end
       request(:post, url, headers, :data => data)
@@ -292,15 +594,84 @@ module Patron
     # Uploads the contents of `filename` to the specified `url` using an HTTP POST,
     # in combination with given form fields passed in `data`.
     #
+    # The values of both hashes can also be IOs, which get read while the request is
+    # being sent, or {Patron::Part}s, which carry a content type and a file name.
+    # A String body of a Part is sent from memory, without writing it to a file first.
+    #
     # @param url[String] the URL to fetch
     # @param data[Hash] hash of the form fields
-    # @param filename[String] path to the file to be uploaded
+    # @param filename[Hash] hash of the paths of the files to be uploaded
     # @param headers[Hash] the hash of header keys to values
     # @return [Patron::Response]
     def post_multipart(url, data, filename, headers = {})
       request(:post, url, headers, {:data => data, :file => filename, :multipart => true})
     end
 
+    # Same as #post_multipart, but using an HTTP PUT.
+    #
+    # @param url[String] the URL to fetch
+    # @param data[Hash] hash of the form fields
+    # @param filename[Hash] hash of the paths of the files to be uploaded
+    # @param headers[Hash] the hash of header keys to values
+    # @return [Patron::Response]
+    def put_multipart(url, data, filename, headers = {})
+      request(:put, url, headers, {:data => data, :file => filename, :multipart => true})
+    end
+
+    # Same as #post_multipart, but using an HTTP PATCH.
+    #
+    # @param url[String] the URL to fetch
+    # @param data[Hash] hash of the form fields
+    # @param filename[Hash] hash of the paths of the files to be uploaded
+    # @param headers[Hash] the hash of header keys to values
+    # @return [Patron::Response]
+    def patch_multipart(url, data, filename, headers = {})
+      request(:patch, url, headers, {:data => data, :file => filename, :multipart => true})
+    end
+
+    # Sends the same +body+ to every one of the +urls+ with an HTTP POST (or the +action+ given),
+    # running up to +concurrency+ of the requests at once. The body is converted to a String once
+    # and every request sends it from that same memory, so broadcasting a large body to many URLs
+    # needs no more memory than sending it once.
+    #
+    # A request which fails does not stop the others - its {Patron::Error} is returned in place of
+    # its response, and it is not raised. The `on_headers`, `fail_on_status`, `max_content_length`,
+    # `digest` and `compress_request` settings do not apply to broadcasts, and a Session with a
+    # `progress_callback` or with `verify_content_digest` set can not broadcast.
+    #
+    # @param urls[Array<String>] the URLs to send the body to, relative to the `base_url` if set
+    # @param body[Hash, #to_s] the request body. A Hash gets sent as a urlencoded form, like with #post
+    # @param headers[Hash] the hash of header keys to values
+    # @param concurrency[Integer] the number of requests to run at once
+    # @param action[Symbol] the HTTP verb
+    # @return [Array<Patron::Response, Patron::Error>] the response or the error for each of the +urls+, in their order
+    # @raise [ArgumentError] if the Session has a `progress_callback` or `verify_content_digest` set
+    def broadcast(urls, body, headers = {}, concurrency: 16, action: :post)
+      if progress_callback || verify_content_digest
+        raise ArgumentError, "The progress_callback and verify_content_digest do not apply to broadcasts"
+      end
+      return [] if urls.empty?
+      if body.is_a?(Hash)
+        body = Util.encode_query(body, true, true)
+        headers = headers.merge('Content-Type' => 'application/x-www-form-urlencoded')
+      end
+      options = {:data => body.to_s, :on_headers => nil, :fail_on_status => nil, :max_content_length => nil,
+                 :digest => nil, :compress_request => nil}
+      # Before libCURL 7.68.0 the requests get sent one after the other
+      unless respond_to?(:handle_concurrent_requests, true)
+        return urls.map do |url|
+          begin
+            request(action, url, headers.dup, options)
+          rescue Patron::Error => e
+            e
+          end
+        end
+      end
+
+      targets = urls.map { |url| build_request(action, url, {}).url }
+      handle_concurrent_requests(build_request(action, urls.first, headers, options), targets, concurrency, nil)
+    end
+
     # @!group WebDAV methods
     # Sends a WebDAV COPY request to the specified +url+.
     #
@@ -360,6 +731,7 @@ module Patron
         req.action                 = action
         req.headers                = self.headers.merge headers
         req.automatic_content_encoding = options.fetch :automatic_content_encoding, self.automatic_content_encoding
+        req.keep_content_encoding  = options.fetch :keep_content_encoding, self.keep_content_encoding
         req.timeout                = options.fetch :timeout,               self.timeout
         req.connect_timeout        = options.fetch :connect_timeout,       self.connect_timeout
         req.dns_cache_timeout      = options.fetch :dns_cache_timeout,     self.dns_cache_timeout
@@ -379,23 +751,126 @@ module Patron
         req.ignore_content_length  = options.fetch :ignore_content_length, self.ignore_content_length
         req.buffer_size            = options.fetch :buffer_size,           self.buffer_size
         req.download_byte_limit    = options.fetch :download_byte_limit,   self.download_byte_limit
+        req.decompressed_byte_limit = options.fetch :decompressed_byte_limit, self.decompressed_byte_limit
+        req.download_fsync         = options.fetch :download_fsync,        self.download_fsync
+        req.download_direct_io     = options.fetch :download_direct_io,    self.download_direct_io
+        req.download_filetime      = options.fetch :download_filetime,     self.download_filetime
+        req.download_io_buffer_size = options.fetch :download_io_buffer_size, self.download_io_buffer_size
+        req.compress_request       = options.fetch :compress_request,      self.compress_request
+        req.compress_request_level = options.fetch :compress_request_level, self.compress_request_level
         req.progress_callback      = options.fetch :progress_callback,     self.progress_callback
+        req.on_headers             = options.fetch :on_headers,            self.on_headers
+        req.fail_on_status         = options.fetch :fail_on_status,        self.fail_on_status
+        req.max_content_length     = options.fetch :max_content_length,    self.max_content_length
+        req.progress_interval      = options.fetch :progress_interval,     self.progress_interval
+        req.progress_bytes         = options.fetch :progress_bytes,        self.progress_bytes
         req.multipart              = options[:multipart]
         req.upload_data            = options[:data]
         req.file_name              = options[:file]
+        req.resume_from            = options[:resume_from]
+        req.if_modified_since      = options[:if_modified_since]
+        req.digest                 = options.fetch :digest,                self.digest
+        req.expected_digest        = options[:expected_digest]
+        req.verify_content_digest  = options.fetch :verify_content_digest, self.verify_content_digest
+        req.upload_digest          = options[:upload_digest]
+        req.stream                 = options[:stream]
+        req.stream_callback        = options[:stream_callback]
+        req.last_event_id          = options[:last_event_id]
 
         base_url = self.base_url.to_s
         url = url.to_s
         raise ArgumentError, "Empty URL" if base_url.empty? && url.empty?
-        uri = URI.parse(base_url.empty? ? url : File.join(base_url, url))
-        query = uri.query.to_s.split('&')
-        query += options[:query].is_a?(Hash) ? Util.build_query_pairs_from_hash(options[:query]) : options[:query].to_s.split('&')
-        uri.query = query.join('&')
-        uri.query = nil if uri.query.empty?
-        url = uri.to_s
-        req.url = url
+        query = options[:query].is_a?(Hash) ? Util.build_query_string_from_hash(options[:query]) : options[:query].to_s
+        req.url = build_url(base_url, url, query)
       end
     end
     # @!endgroup
+
+    private
+
+    # Takes the file from the download cache if it is current, or downloads it into the cache, see #get_file
+    def get_file_cached(url, filename, headers, digest)
+      if digest && download_cache.materialize(digest, filename)
+        return cached_file_response(build_request(:get, url, headers).url, filename, digest)
+      end
+
+      req = build_request(:get, url, headers, :file => filename, :digest => (Array(self.digest) | [:sha256]),
+                          :expected_digest => digest && {sha256: digest})
+      etag, cached_digest = download_cache.lookup(req.url)
+      req.headers['If-None-Match'] = etag if etag
+      response = handle_request(req)
+      if response.status == 304 && cached_digest
+        return response if download_cache.materialize(cached_digest, filename)
+        # Removed from the cache in the meantime
+        req.headers.delete('If-None-Match')
+        response = handle_request(req)
+      end
+
+      if response.status == 200
+        etag = response.headers.find { |name, _| name.downcase == 'etag' }
+        download_cache.store(filename, response.digest, req.url, etag && Array(etag.last).last)
+      end
+      response
+    end
+
+    # Stands in for the response to a download which the cache made unnecessary
+    def cached_file_response(url, filename, digest)
+      header = "HTTP/1.1 200 OK\r\nContent-Length: #{File.size(filename)}\r\n\r\n"
+      response = Response.new(url.dup, 200, 0, header, nil, default_response_charset)
+      response.instance_variable_set(:@digests, {sha256: digest.downcase})
+      response
+    end
+
+    # Continues the download of a partial file if there is one, see #get_file
+    def get_file_resumable(url, filename, headers, expected_digest)
+      partial = filename + '.part'
+      metadata = partial + '.meta'
+      validator, length = File.exist?(metadata) ? File.read(metadata).split("\n", 2).map(&:strip) : nil
+      offset = File.exist?(partial) && validator && !validator.empty? ? File.size(partial) : 0
+
+      # The digests of a resumed download are carried over what the partial file has already
+      resume_headers = offset > 0 ? headers.merge('If-Range' => validator) : headers
+      response = request(:get, url, resume_headers, :file => filename, :resume_from => offset,
+                         :expected_digest => expected_digest)
+      return response unless response.status == 416 && offset > 0
+
+      # Nothing left to download past the end of the partial file
+      if offset == length.to_i && (!expected_digest || Digest::SHA256.file(partial).hexdigest == expected_digest[:sha256].downcase)
+        File.rename(partial, filename)
+        File.unlink(metadata)
+        return response
+      end
+      # The partial file does not match the file on the server, so start over
+      request(:get, url, headers, :file => filename, :resume_from => 0, :expected_digest => expected_digest)
+    end
+
+    # Returns the size of the file described by the HEAD +response+ if it can be downloaded in byte ranges
+    def segmented_download_length(response)
+      return unless response.status == 200
+      headers = response.headers.map { |name, value| [name.downcase, value] }.to_h
+      return unless headers['accept-ranges'].to_s.split(',').map(&:strip).include?('bytes')
+      return if headers['content-encoding'] && headers['content-encoding'] != 'identity'
+      length = headers['content-length'].to_s
+      return unless length =~ /\A\d+\z/ && length.to_i > 0
+      # Let a plain download enforce the limit and raise the usual error
+      return if download_byte_limit && length.to_i > download_byte_limit
+      length.to_i
+    end
+
+    unless private_method_defined?(:build_url)
+      # Joins the `url` onto the `base_url` and appends the `query` to it. The native
+      # implementation is used instead when libCURL supports the URL API (7.63.0 and newer).
+      #
+      # @param base_url[String] the base URL, or an empty String
+      # @param url[String] a path relative to the base URL, or a complete URL
+      # @param query[String] a query string to append to the URL (can be empty)
+      # @return [String] the complete URL
+      def build_url(base_url, url, query)
+        uri = URI.parse(base_url.empty? ? url : File.join(base_url, url))
+        query = uri.query.to_s.split('&') + query.split('&')
+        uri.query = query.empty? ? nil : query.join('&')
+        uri.to_s
+      end
+    end
   end
 end
@@ -0,0 +1,28 @@
+module Patron
+
+  # Describes the outcome of {Session#sync_file}.
+  class SyncResult
+
+    # @return [Patron::Response] the response to the conditional request
+    attr_reader :response
+
+    # @return [Integer] the number of bytes which did not have to be downloaded because the
+    #    local copy of the file was current, or 0 if the file was downloaded
+    attr_reader :bytes_saved
+
+    def initialize(response, updated, bytes_saved)
+      @response    = response
+      @updated     = updated
+      @bytes_saved = bytes_saved
+    end
+
+    # @return [Boolean] whether the file was downloaded, `false` if the local copy was current
+    def updated?
+      @updated
+    end
+
+    def inspect
+      "#<Patron::SyncResult @updated=#{@updated} @bytes_saved=#{@bytes_saved}>"
+    end
+  end
+end
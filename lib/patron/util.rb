@@ -2,21 +2,23 @@ module Patron
   module Util
     extend self
     
+    # Encodes the Hash into `key=value` pairs, see #build_query_string_from_hash.
+    #
+    # @param hash[Hash] the Hash of keys to values
+    # @param escape_values[Boolean] whether the values should be URL-escaped
+    # @return [Array<String>]
     def build_query_pairs_from_hash(hash, escape_values=false)
-      pairs = []
-      recursive = Proc.new do |h, prefix|
-        h.each_pair do |k,v|
-          key = prefix == '' ? k : "#{prefix}[#{k}]"
-          v = Patron::Session.escape(v.to_s) if escape_values
-          v.is_a?(Hash) ? recursive.call(v, key) : pairs << "#{key}=#{v}"
-        end
-      end
-      recursive.call(hash, '')
-      pairs
+      encode_query(hash, false, escape_values).split('&')
     end
     
+    # Encodes the Hash into a query string. Nested Hashes are encoded as `parent[child]=value`
+    # and Arrays as `key[]=value`. The encoding is done natively in a single pass, see `encode_query`.
+    #
+    # @param hash[Hash] the Hash of keys to values
+    # @param escape_values[Boolean] whether the values should be URL-escaped
+    # @return [String]
     def build_query_string_from_hash(hash, escape_values=false)
-      build_query_pairs_from_hash(hash, escape_values).join('&')
+      encode_query(hash, false, escape_values)
     end
     
   end
@@ -0,0 +1,49 @@
+require 'spec_helper'
+
+describe Patron::Batcher do
+  before(:each) do
+    @session = Patron::Session.new(:base_url => "http://localhost:9001", :timeout => 10)
+  end
+
+  def split_lines
+    proc { |response, _count| response.body.lines(chomp: true) }
+  end
+
+  it "sends the payloads together and splits the response into their results" do
+    batcher = Patron::Batcher.new(@session, "/bulk", max_count: 10, &split_lines)
+    futures = (1..25).map { |i| batcher << "item #{i}" }
+    expect(futures.map { |future| future.value(5) }).to be == (1..25).map { |i| "ok item #{i}" }
+    batcher.close
+  end
+
+  it "sends a batch once it is large enough" do
+    count = 0
+    batcher = Patron::Batcher.new(@session, "/bulk", max_bytes: 100, max_delay: 60) do |response, n|
+      count += 1
+      Array.new(n, response.body.bytesize)
+    end
+    futures = (1..5).map { batcher << "x" * 49 }
+    expect(futures[0].value(5)).to be == 106
+    expect(futures[4]).not_to be_resolved
+    batcher.close
+    expect(futures[4].value(0)).to be == 53
+    expect(count).to be == 3
+  end
+
+  it "sends a batch once its oldest payload has waited for the delay" do
+    batcher = Patron::Batcher.new(@session, "/bulk", max_delay: 0.05)
+    response = (batcher << "alone").value(5)
+    expect(response.status).to be == 200
+    expect(response.body).to be == "ok alone\n"
+    batcher.close
+  end
+
+  it "fails the futures of a batch which could not be sent" do
+    session = Patron::Session.new(:timeout => 2)
+    batcher = Patron::Batcher.new(session, "http://127.0.0.1:1/bulk", max_delay: 0.01)
+    future = batcher << "lost"
+    expect { future.value(5) }.to raise_error(Patron::ConnectionFailed)
+    batcher.close
+    expect { batcher << "late" }.to raise_error(Patron::Error)
+  end
+end
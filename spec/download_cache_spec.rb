@@ -0,0 +1,85 @@
+require 'spec_helper'
+require 'digest'
+require 'tmpdir'
+
+describe Patron::DownloadCache do
+  before(:each) do
+    @dir = Dir.mktmpdir
+    @cache = Patron::DownloadCache.new(File.join(@dir, 'cache'))
+  end
+
+  after(:each) do
+    FileUtils.rm_rf(@dir)
+  end
+
+  def write_file(name, contents)
+    path = File.join(@dir, name)
+    File.binwrite(path, contents)
+    [path, Digest::SHA256.hexdigest(contents)]
+  end
+
+  it "materializes a stored file by its digest" do
+    path, digest = write_file('stored', 'Some contents')
+    @cache.store(path, digest)
+
+    destination = File.join(@dir, 'materialized')
+    expect(@cache.materialize(digest, destination)).to be(true)
+    expect(File.binread(destination)).to be == 'Some contents'
+  end
+
+  it "keeps the cached file intact when a materialized file is modified in place" do
+    path, digest = write_file('stored', 'Some contents')
+    @cache.store(path, digest)
+    File.open(path, 'r+') { |f| f.write('Else') }
+
+    destination = File.join(@dir, 'materialized')
+    expect(@cache.materialize(digest, destination)).to be(true)
+    File.open(destination, 'r+') { |f| f.write('Else') }
+    expect(@cache.materialize(digest, File.join(@dir, 'again'))).to be(true)
+    expect(File.binread(File.join(@dir, 'again'))).to be == 'Some contents'
+  end
+
+  it "removes a cached file which does not match its digest" do
+    path, digest = write_file('stored', 'Some contents')
+    @cache.store(path, digest)
+    File.binwrite(File.join(@dir, 'cache', 'blobs', digest), 'Damaged')
+
+    destination = File.join(@dir, 'materialized')
+    expect(@cache.materialize(digest, destination)).to be(false)
+    expect(File.exist?(destination)).to be(false)
+    expect(File.exist?(File.join(@dir, 'cache', 'blobs', digest))).to be(false)
+  end
+
+  it "does not materialize a file it does not contain" do
+    destination = File.join(@dir, 'materialized')
+    expect(@cache.materialize(Digest::SHA256.hexdigest('missing'), destination)).to be(false)
+    expect(File.exist?(destination)).to be(false)
+  end
+
+  it "looks up files by their URL" do
+    path, digest = write_file('stored', 'Some contents')
+    @cache.store(path, digest, 'http://example.com/file', '"v1"')
+
+    expect(@cache.lookup('http://example.com/file')).to be == ['"v1"', digest]
+    expect(@cache.lookup('http://example.com/other')).to be_nil
+  end
+
+  it "evicts the files used least recently" do
+    cache = Patron::DownloadCache.new(File.join(@dir, 'cache'), max_size: 25)
+    first, first_digest = write_file('first', 'a' * 10)
+    second, second_digest = write_file('second', 'b' * 10)
+    third, third_digest = write_file('third', 'c' * 10)
+
+    cache.store(first, first_digest)
+    sleep 0.01
+    cache.store(second, second_digest)
+    sleep 0.01
+    cache.materialize(first_digest, File.join(@dir, 'used'))
+    sleep 0.01
+    cache.store(third, third_digest)
+
+    expect(cache.materialize(first_digest, File.join(@dir, 'out'))).to be(true)
+    expect(cache.materialize(second_digest, File.join(@dir, 'out'))).to be(false)
+    expect(cache.materialize(third_digest, File.join(@dir, 'out'))).to be(true)
+  end
+end
@@ -0,0 +1,60 @@
+require 'spec_helper'
+
+describe Patron::Poller do
+  before(:each) do
+    @session = Patron::Session.new(:base_url => "http://localhost:9001", :timeout => 10)
+    @poller = Patron::Poller.new(@session, resolution: 0.01)
+  end
+
+  it "yields the first response of every URL and then only the ones which changed" do
+    @poller.add("/unchanging", interval: 0.05)
+    @poller.add("/pages?page=2", interval: 0.05)
+    changed = []
+    expect(@poller.poll { |url, response| changed << [url, response.status] }).to be == 2
+    expect(changed.sort).to be == [["/pages?page=2", 200], ["/unchanging", 200]]
+
+    sleep 0.1
+    changed = []
+    expect(@poller.poll { |url, response| changed << url }).to be == 2
+    expect(changed).to be_empty
+  end
+
+  it "sends back the ETag of the last response, whatever the case of its header" do
+    served = /Served (\d+) times, not modified (\d+) times/.match(@session.get("/tagged").body).captures.map(&:to_i)
+
+    @poller.add("/tagged", interval: 0.01)
+    changed = []
+    @poller.poll { |url, response| changed << response.status }
+    sleep 0.05
+    @poller.poll { |url, response| changed << response.status }
+    expect(changed).to be == [200]
+
+    # The second poll carried If-None-Match, and got a 304 Not Modified back
+    body = @session.get("/tagged").body
+    expect(body).to be == "Served #{served[0] + 2} times, not modified #{served[1] + 1} times"
+  end
+
+  it "only polls the URLs which are due" do
+    @poller.add("/unchanging", interval: 0.05)
+    @poller.add("/pages", interval: 60)
+    expect(@poller.poll).to be == 2
+    expect(@poller.poll).to be == 0
+    sleep 0.1
+    expect(@poller.poll).to be == 1
+  end
+
+  it "stops polling a URL which is removed" do
+    @poller.add("/unchanging", interval: 0.05)
+    expect(@poller.remove("/unchanging")).to be == true
+    expect(@poller.remove("/unchanging")).to be == false
+    expect(@poller.urls).to be_empty
+    expect(@poller.poll).to be == 0
+  end
+
+  it "yields the error of a request which fails" do
+    @poller.add("http://127.0.0.1:1/", interval: 1)
+    errors = []
+    @poller.poll { |_url, error| errors << error }
+    expect(errors.first).to be_kind_of(Patron::ConnectionFailed)
+  end
+end
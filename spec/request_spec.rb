@@ -57,6 +57,22 @@ describe Patron::Request do
 
   end
 
+  describe :progress_interval do
+
+    it "should raise an exception when assigned a negative number" do
+      expect {@request.progress_interval = -1}.to raise_error(ArgumentError)
+    end
+
+  end
+
+  describe :progress_bytes do
+
+    it "should raise an exception when assigned a negative number" do
+      expect {@request.progress_bytes = -1}.to raise_error(ArgumentError)
+    end
+
+  end
+
   describe :eql? do
 
     it "should return true when two requests are equal" do
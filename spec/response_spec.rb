@@ -126,6 +126,15 @@ describe Patron::Response do
         response.decoded_body
       }.to raise_error(Patron::HeaderCharsetInvalid)
     end
+
+    it "should not consider a body decodable when its Content-Encoding can not be decoded" do
+      headers = "HTTP/1.1 200 OK \r\nContent-Type: text/plain\r\nContent-Encoding: gzip\r\n"
+      response = Patron::Response.new("url", 200, 0, headers, nil, "UTF-8")
+      response.instance_variable_set(:@raw_body, "not gzip")
+
+      expect(response).not_to be_body_decodable
+      expect { response.body }.to raise_error(Patron::Error)
+    end
   end
 
   it "decodes a header that contains UTF-8 even though internal encoding is ASCII" do
@@ -1,4 +1,5 @@
 require File.expand_path("./spec") + '/spec_helper.rb'
+require 'zlib'
 
 describe Patron::Util do
 
@@ -68,4 +69,53 @@ describe Patron::Util do
     end
   end
 
+  describe :encode_query do
+    it "encodes nested Hashes and Arrays" do
+      hash = {:a => [1, {:b => 2}], :c => {:d => "e"}, :f => nil}
+      expect(Patron::Util.encode_query(hash, false, false)).to be == "a[]=1&a[][b]=2&c[d]=e&f="
+    end
+
+    it "escapes the keys and values when asked to" do
+      hash = {"k y" => "++hello world++", :n => {:m => "x"}}
+      expect(Patron::Util.encode_query(hash, true, true)).to be == "k%20y=%2B%2Bhello%20world%2B%2B&n%5Bm%5D=x"
+      expect(Patron::Util.encode_query(hash, false, true)).to be == "k y=%2B%2Bhello%20world%2B%2B&n[m]=x"
+    end
+
+    it "returns an empty String for an empty Hash" do
+      expect(Patron::Util.encode_query({}, true, true)).to be == ""
+    end
+  end
+
+  describe :decode_content do
+    it "decodes gzip and deflate bodies" do
+      data = "Some highly compressible data" * 1024
+      expect(Patron::Util.decode_content(Zlib.gzip(data), "gzip", nil)).to be == data
+      expect(Patron::Util.decode_content(Zlib::Deflate.deflate(data), "deflate", nil)).to be == data
+    end
+
+    it "raises for bodies which can not be decoded" do
+      expect { Patron::Util.decode_content("not gzip", "gzip", nil) }.to raise_error(Patron::Error)
+      expect { Patron::Util.decode_content("data", "unknown", nil) }.to raise_error(Patron::Error, /Unsupported/)
+    end
+
+    it "can be interrupted while decoding a large body" do
+      # Just over the size which gets decoded without the GVL, inflating to 80MB
+      deflate = Zlib::Deflate.new
+      zeros = "\0" * 64 * 1024
+      body = 1280.times.map { deflate.deflate(zeros) }.join + deflate.finish
+
+      thread = Thread.new { Patron::Util.decode_content(body, "deflate", nil) }
+      thread.report_on_exception = false
+      # A thread running without the GVL counts as sleeping
+      Thread.pass until thread.status == "sleep" || !thread.status
+      thread.raise(Interrupt)
+      expect { thread.join }.to raise_error(Interrupt)
+    end
+
+    it "aborts once the decoded body exceeds the limit" do
+      body = Zlib.gzip("\0" * 1024 * 1024)
+      expect { Patron::Util.decode_content(body, "gzip", 1024) }.to raise_error(Patron::Aborted)
+    end
+  end
+
 end